@@ -0,0 +1,319 @@
+#!/usr/bin/perl
+# End-to-end benchmarks of a mounted nufs, with tmpfs as a baseline.
+#
+# usage: perl bench.pl [--files N] [--depth N] [--size MB] [--ops N]
+#                      [--clients N] [--image-size SIZE] [--out FILE]
+#                      [--no-baseline] [--quick]
+#
+# Formats a fresh image, mounts it on mnt-bench and runs every workload
+# there, then runs the same workloads in a directory on /dev/shm (tmpfs).
+# Results go to stdout as a table and to bench.json, one record per file
+# system and workload, so runs can be compared by a script.
+#
+# Reads mostly hit the kernel's page cache on both file systems, since
+# dropping it needs root; the write side is what nufs mostly determines.
+
+use 5.16.0;
+use warnings FATAL => 'all';
+
+use Cwd qw(abs_path);
+use Fcntl qw(O_CREAT O_RDONLY O_RDWR O_WRONLY SEEK_SET);
+use File::Path qw(make_path remove_tree);
+use Getopt::Long;
+use IO::Handle;
+use JSON::PP;
+use Time::HiRes qw(time);
+
+my %opt = (
+    files => 2000,        # files in the metadata workloads
+    depth => 32,          # levels of the nested mkdir workload
+    size => 64,           # MB per sequential or random file
+    ops => 2000,          # random I/O operations per I/O size
+    clients => 4,         # processes in the parallel workload
+    'image-size' => "1G",
+    out => "bench.json",
+    baseline => 1,
+    quick => 0,
+);
+GetOptions(\%opt, "files=i", "depth=i", "size=i", "ops=i", "clients=i",
+           "image-size=s", "out=s", "baseline!", "quick")
+    or die "usage: perl bench.pl [options]; see the top of bench.pl\n";
+if ($opt{quick}) {
+    $opt{files} = 200;
+    $opt{size} = 8;
+    $opt{ops} = 200;
+}
+
+my $MNT = "mnt-bench";
+my $IMAGE = "bench-data.nufs";
+my @IO_SIZES = (4096, 65536, 1 << 20);
+my @RAND_SIZES = (4096, 65536);
+
+# Summarize a workload: $n operations moving $bytes bytes in $secs seconds,
+# with the latency of each operation in @$lat.
+sub result {
+    my ($name, $n, $bytes, $secs, $lat) = @_;
+    my @sorted = sort { $a <=> $b } @$lat;
+    my $pct = sub {
+        return 0 unless @sorted;
+        return $sorted[int((@sorted - 1) * $_[0])] * 1e6;
+    };
+    return {
+        workload => $name,
+        ops => $n,
+        secs => $secs,
+        ops_per_sec => $secs > 0 ? $n / $secs : 0,
+        mb_per_sec => $secs > 0 ? $bytes / $secs / (1 << 20) : 0,
+        p50_us => $pct->(0.5),
+        p99_us => $pct->(0.99),
+        max_us => $pct->(1.0),
+    };
+}
+
+# Run $op->($i) for $i in 0..$n-1, timing each call.
+sub timed {
+    my ($name, $n, $bytes_per_op, $op) = @_;
+    my @lat;
+    my $start = time();
+    for my $ii (0 .. $n - 1) {
+        my $t = time();
+        $op->($ii);
+        push @lat, time() - $t;
+    }
+    return result($name, $n, $n * $bytes_per_op, time() - $start, \@lat);
+}
+
+sub bench_metadata {
+    my ($dir) = @_;
+    my $n = $opt{files};
+    mkdir "$dir/meta" or die "mkdir $dir/meta: $!";
+    my @res;
+
+    push @res, timed("create", $n, 0, sub {
+        sysopen(my $fh, "$dir/meta/f$_[0]", O_CREAT | O_WRONLY, 0644)
+            or die "create: $!";
+        close $fh;
+    });
+    push @res, timed("stat", $n, 0, sub {
+        stat("$dir/meta/f$_[0]") or die "stat: $!";
+    });
+    push @res, timed("unlink", $n, 0, sub {
+        unlink("$dir/meta/f$_[0]") or die "unlink: $!";
+    });
+    rmdir "$dir/meta";
+
+    # a chain of directories, built and torn down a level at a time
+    my @paths = ("$dir/nest");
+    push @paths, "$paths[-1]/d$_" for 1 .. $opt{depth} - 1;
+    push @res, timed("mkdir_nested", scalar @paths, 0, sub {
+        mkdir $paths[$_[0]] or die "mkdir: $!";
+    });
+    push @res, timed("rmdir_nested", scalar @paths, 0, sub {
+        rmdir $paths[-1 - $_[0]] or die "rmdir: $!";
+    });
+    return @res;
+}
+
+# Write a file of $opt{size} MB in $io byte chunks, then read it back.
+sub bench_sequential {
+    my ($dir, $io) = @_;
+    my $n = int($opt{size} * (1 << 20) / $io);
+    my $buf = "s" x $io;
+    my $path = "$dir/seq";
+    my @res;
+
+    sysopen(my $fh, $path, O_CREAT | O_WRONLY, 0644) or die "open: $!";
+    my $write = timed("seq_write_$io", $n, $io, sub {
+        syswrite($fh, $buf) == $io or die "write: $!";
+    });
+    # the data only counts as written once it is on disk
+    my $t = time();
+    $fh->sync or die "fsync: $!";
+    $write->{secs} += time() - $t;
+    $write->{mb_per_sec} = $n * $io / $write->{secs} / (1 << 20);
+    $write->{ops_per_sec} = $n / $write->{secs};
+    close $fh;
+    push @res, $write;
+
+    sysopen($fh, $path, O_RDONLY) or die "open: $!";
+    my $in;
+    push @res, timed("seq_read_$io", $n, $io, sub {
+        sysread($fh, $in, $io) == $io or die "read: $!";
+    });
+    close $fh;
+    unlink $path;
+    return @res;
+}
+
+# Random aligned reads and writes of $io bytes within a preallocated file.
+sub bench_random {
+    my ($dir, $io) = @_;
+    my $size = $opt{size} * (1 << 20);
+    my $slots = int($size / $io);
+    my $buf = "r" x $io;
+    my $path = "$dir/rand";
+
+    sysopen(my $fh, $path, O_CREAT | O_RDWR, 0644) or die "open: $!";
+    syswrite($fh, "\0" x (1 << 20)) for 1 .. $opt{size};
+
+    # the same offsets on every file system and every run
+    srand(42);
+    my @offs = map { int(rand($slots)) * $io } 1 .. $opt{ops};
+    my @res;
+    push @res, timed("rand_write_$io", $opt{ops}, $io, sub {
+        sysseek($fh, $offs[$_[0]], SEEK_SET);
+        syswrite($fh, $buf) == $io or die "write: $!";
+    });
+    my $in;
+    push @res, timed("rand_read_$io", $opt{ops}, $io, sub {
+        sysseek($fh, $offs[$_[0]], SEEK_SET);
+        sysread($fh, $in, $io) == $io or die "read: $!";
+    });
+    close $fh;
+    unlink $path;
+    return @res;
+}
+
+# Several processes each create and write small files in their own
+# directory at the same time.
+sub bench_parallel {
+    my ($dir) = @_;
+    my $per = int($opt{files} / $opt{clients}) || 1;
+    my $buf = "p" x 4096;
+    my @kids;
+
+    my $start = time();
+    for my $cc (1 .. $opt{clients}) {
+        pipe(my $rd, my $wr) or die "pipe: $!";
+        my $pid = fork() // die "fork: $!";
+        if ($pid == 0) {
+            close $rd;
+            my $sub = "$dir/par$cc";
+            mkdir $sub or die "mkdir $sub: $!";
+            my @lat;
+            for my $ii (0 .. $per - 1) {
+                my $t = time();
+                sysopen(my $fh, "$sub/f$ii", O_CREAT | O_WRONLY, 0644)
+                    or die "create: $!";
+                syswrite($fh, $buf);
+                close $fh;
+                push @lat, time() - $t;
+            }
+            print $wr join(" ", @lat);
+            close $wr;
+            exit 0;
+        }
+        close $wr;
+        push @kids, [$pid, $rd];
+    }
+
+    my @lat;
+    for my $kid (@kids) {
+        my ($pid, $rd) = @$kid;
+        local $/ = undef;
+        push @lat, split(/ /, <$rd> // "");
+        close $rd;
+        waitpid($pid, 0);
+        $? == 0 or die "parallel client failed\n";
+    }
+    my $secs = time() - $start;
+    remove_tree("$dir/par$_") for 1 .. $opt{clients};
+
+    my $n = $per * $opt{clients};
+    return result("parallel_create_write_$opt{clients}", $n, $n * 4096, $secs,
+                  \@lat);
+}
+
+sub run_all {
+    my ($dir) = @_;
+    my @res = bench_metadata($dir);
+    push @res, bench_sequential($dir, $_) for @IO_SIZES;
+    push @res, bench_random($dir, $_) for @RAND_SIZES;
+    push @res, bench_parallel($dir);
+    return @res;
+}
+
+# Is the path a mount point of the given file system type?
+sub mounted {
+    my ($path, $type) = @_;
+    my $abs = abs_path($path) // return 0;
+    open my $fh, "<", "/proc/mounts" or return 0;
+    while (my $line = <$fh>) {
+        my (undef, $point, $fstype) = split / /, $line;
+        return 1 if $point eq $abs && (!$type || $fstype =~ /^\Q$type\E/);
+    }
+    return 0;
+}
+
+sub mount_nufs {
+    system("./mkfs.nufs -s $opt{'image-size'} $IMAGE > /dev/null") == 0
+        or die "mkfs.nufs failed\n";
+    make_path($MNT);
+    my $pid = fork() // die "fork: $!";
+    if ($pid == 0) {
+        open STDOUT, ">>", "bench.log";
+        open STDERR, ">&", \*STDOUT;
+        exec("./nufs", "-f", $MNT, $IMAGE) or die "exec: $!";
+    }
+
+    # wait for the mount instead of sleeping a fixed time
+    for (1 .. 100) {
+        return $pid if mounted($MNT, "fuse");
+        Time::HiRes::sleep(0.05);
+    }
+    kill "TERM", $pid;
+    die "nufs did not mount on $MNT; see bench.log\n";
+}
+
+sub unmount_nufs {
+    my ($pid) = @_;
+    system("fusermount3 -u $MNT");
+    waitpid($pid, 0);
+    rmdir $MNT;
+    unlink $IMAGE;
+}
+
+my @results;
+my $pid = mount_nufs();
+my @nufs = eval { run_all($MNT) };
+my $err = $@;
+unmount_nufs($pid);
+die $err if $err;
+push @results, map { { fs => "nufs", %$_ } } @nufs;
+
+my %base;
+if ($opt{baseline} && mounted("/dev/shm", "tmpfs")) {
+    my $dir = "/dev/shm/nufs-bench-$$";
+    make_path($dir);
+    my @tmpfs = eval { run_all($dir) };
+    $err = $@;
+    remove_tree($dir);
+    die $err if $err;
+    push @results, map { { fs => "tmpfs", %$_ } } @tmpfs;
+    %base = map { $_->{workload} => $_ } @tmpfs;
+} elsif ($opt{baseline}) {
+    say "# /dev/shm is not tmpfs; skipping the baseline";
+}
+
+printf "%-26s %10s %9s %10s %10s %10s\n", "workload", "ops/s", "MB/s",
+    "p50_us", "p99_us", "vs tmpfs";
+for my $r (grep { $_->{fs} eq "nufs" } @results) {
+    my $b = $base{$r->{workload}};
+    my $ratio = $b && $b->{ops_per_sec} > 0
+        ? sprintf("%.2f", $r->{ops_per_sec} / $b->{ops_per_sec}) : "-";
+    printf "%-26s %10.0f %9.1f %10.1f %10.1f %10s\n", $r->{workload},
+        $r->{ops_per_sec}, $r->{mb_per_sec}, $r->{p50_us}, $r->{p99_us},
+        $ratio;
+}
+
+my $commit = `git rev-parse --short HEAD 2>/dev/null` // "";
+chomp $commit;
+open my $out, ">", $opt{out} or die "$opt{out}: $!";
+print $out JSON::PP->new->canonical->pretty->encode({
+    time => time(),
+    commit => $commit,
+    options => \%opt,
+    results => \@results,
+});
+close $out;
+say "# results written to $opt{out}";
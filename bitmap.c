@@ -6,6 +6,7 @@
  */
 #include <stdint.h>
 #include <stdio.h>
+#include <stdlib.h>
 
 #include "bitmap.h"
 
@@ -47,3 +48,200 @@ void bitmap_print(void *bm, int size) {
     }
   }
 }
+
+// Word-level operations below view the bitmap as little-endian 64-bit
+// words, which matches the byte and bit order used by bitmap_get/put.
+#define WORD_BITS 64
+#define words_for(bits) (((bits) + WORD_BITS - 1) / WORD_BITS)
+
+// Mask with bits [lo, hi) of a word set, for 0 <= lo < hi <= 64.
+static uint64_t range_mask(int lo, int hi) {
+  uint64_t high = hi == WORD_BITS ? ~0ULL : (1ULL << hi) - 1;
+  return high & (~0ULL << lo);
+}
+
+// Recompute the summary bit of the given word.
+static void summary_update(bitmap_summary_t *bs, int w) {
+  uint64_t bit = 1ULL << (w % WORD_BITS);
+  if (~bs->words[w] != 0) {
+    bs->summary[w / WORD_BITS] |= bit;
+  } else {
+    bs->summary[w / WORD_BITS] &= ~bit;
+  }
+}
+
+// Index of the first word at or after w that has a clear bit, or -1.
+static int next_free_word(bitmap_summary_t *bs, int w) {
+  int nwords = words_for(bs->size);
+  if (w >= nwords) {
+    return -1;
+  }
+
+  int sw = w / WORD_BITS;
+  uint64_t m = bs->summary[sw] & (~0ULL << (w % WORD_BITS));
+  bs->scanned++;
+  while (m == 0) {
+    if (++sw >= words_for(nwords)) {
+      return -1;
+    }
+    m = bs->summary[sw];
+    bs->scanned++;
+  }
+  return sw * WORD_BITS + __builtin_ctzll(m);
+}
+
+// Index of the first clear bit at or after i, or -1.
+static int next_clear(bitmap_summary_t *bs, int i) {
+  if (i >= bs->size) {
+    return -1;
+  }
+
+  int w = i / WORD_BITS;
+  uint64_t m = ~bs->words[w] & (~0ULL << (i % WORD_BITS));
+  bs->scanned++;
+  if (m == 0) {
+    w = next_free_word(bs, w + 1);
+    if (w < 0) {
+      return -1;
+    }
+    m = ~bs->words[w];
+    bs->scanned++;
+  }
+
+  int found = w * WORD_BITS + __builtin_ctzll(m);
+  return found < bs->size ? found : -1;
+}
+
+// Index of the first set bit at or after i, looking no further than limit.
+static int next_set(bitmap_summary_t *bs, int i, int limit) {
+  if (limit > bs->size) {
+    limit = bs->size;
+  }
+
+  while (i < limit) {
+    int w = i / WORD_BITS;
+    uint64_t m = bs->words[w] & (~0ULL << (i % WORD_BITS));
+    bs->scanned++;
+    if (m != 0) {
+      int found = w * WORD_BITS + __builtin_ctzll(m);
+      return found < limit ? found : limit;
+    }
+    i = (w + 1) * WORD_BITS;
+  }
+  return limit;
+}
+
+// Build the summary for the given bitmap.
+void bitmap_summary_init(bitmap_summary_t *bs, void *bm, int size) {
+  int nwords = words_for(size);
+  bs->words = (uint64_t *) bm;
+  bs->summary = calloc(words_for(nwords), sizeof(uint64_t));
+  bs->size = size;
+  bs->free = 0;
+  bs->scanned = 0;
+
+  if (size % WORD_BITS != 0) {
+    bs->words[nwords - 1] |= ~range_mask(0, size % WORD_BITS);
+  }
+
+  for (int w = 0; w < nwords; ++w) {
+    bs->free += WORD_BITS - __builtin_popcountll(bs->words[w]);
+    summary_update(bs, w);
+  }
+}
+
+// Release the memory held by a summary.
+void bitmap_summary_destroy(bitmap_summary_t *bs) {
+  free(bs->summary);
+  bs->summary = 0;
+}
+
+// Set or clear a run of bits, keeping the summary up to date.
+void bitmap_summary_put(bitmap_summary_t *bs, int i, int len, int v) {
+  int end = i + len;
+
+  while (i < end) {
+    int w = i / WORD_BITS;
+    int hi = end - w * WORD_BITS < WORD_BITS ? end - w * WORD_BITS : WORD_BITS;
+    uint64_t mask = range_mask(i % WORD_BITS, hi);
+
+    int before = __builtin_popcountll(bs->words[w]);
+    if (v) {
+      bs->words[w] |= mask;
+    } else {
+      bs->words[w] &= ~mask;
+    }
+    bs->free -= __builtin_popcountll(bs->words[w]) - before;
+
+    summary_update(bs, w);
+    i = (w + 1) * WORD_BITS;
+  }
+}
+
+// Find the first clear bit at or after start and set it.
+int bitmap_summary_alloc(bitmap_summary_t *bs, int start) {
+  int i = next_clear(bs, start);
+  if (i < 0) {
+    i = next_clear(bs, 0);
+  }
+  if (i < 0) {
+    return -1;
+  }
+
+  bitmap_summary_put(bs, i, 1, 1);
+  return i;
+}
+
+// Find a run of up to n clear bits at or after start and set them.
+int bitmap_summary_alloc_range(bitmap_summary_t *bs, int start, int n,
+                               int *len) {
+  int best = -1;
+  int best_len = 0;
+
+  // search [start, size) first, then wrap around to [0, start)
+  for (int pass = 0; pass < 2; ++pass) {
+    int i = pass == 0 ? start : 0;
+    int end = pass == 0 ? bs->size : start;
+
+    while ((i = next_clear(bs, i)) >= 0 && i < end) {
+      int run_end = next_set(bs, i, n < bs->size - i ? i + n : bs->size);
+      if (run_end - i >= n) {
+        bitmap_summary_put(bs, i, n, 1);
+        *len = n;
+        return i;
+      }
+      if (run_end - i > best_len) {
+        best = i;
+        best_len = run_end - i;
+      }
+      i = run_end;
+    }
+  }
+
+  if (best < 0) {
+    return -1;
+  }
+  bitmap_summary_put(bs, best, best_len, 1);
+  *len = best_len;
+  return best;
+}
+
+// Count the runs of clear bits and find the longest one.
+void bitmap_summary_runs(bitmap_summary_t *bs, int *runs, int *longest) {
+  long scanned = bs->scanned;
+  *runs = 0;
+  *longest = 0;
+
+  int i = 0;
+  while ((i = next_clear(bs, i)) >= 0) {
+    int run_end = next_set(bs, i, bs->size);
+    (*runs)++;
+    if (run_end - i > *longest) {
+      *longest = run_end - i;
+    }
+    i = run_end;
+  }
+
+  // only allocation searches count as scanning
+  bs->scanned = scanned;
+}
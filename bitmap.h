@@ -7,6 +7,8 @@
 #ifndef BITMAP_H
 #define BITMAP_H
 
+#include <stdint.h>
+
 /**
  * Get the given bit from the bitmap.
  *
@@ -34,4 +36,87 @@ void bitmap_put(void *bm, int i, int v);
  */
 void bitmap_print(void *bm, int size);
 
+/**
+ * An allocation index over a bitmap whose set bits mark used items.
+ *
+ * The bitmap is scanned a 64-bit word at a time. The summary holds one bit
+ * per word of the bitmap, set while that word still has a clear bit, so a
+ * search skips 4096 used items per summary word. The summary lives in
+ * memory and is rebuilt from the bitmap by bitmap_summary_init().
+ *
+ * The bitmap must be 8-byte aligned and padded to a whole number of words.
+ */
+typedef struct bitmap_summary {
+  uint64_t *words;   // the bitmap, viewed as 64-bit words
+  uint64_t *summary; // bit w is set while words[w] has a clear bit
+  int size;          // number of bits in use
+  int free;          // number of clear bits
+  long scanned;      // words of the bitmap and summary read by searches
+} bitmap_summary_t;
+
+/**
+ * Build the summary for the given bitmap.
+ *
+ * Padding bits past size in the last word are set so they are never
+ * handed out.
+ *
+ * @param bs The summary to initialize.
+ * @param bm Pointer to the start of the bitmap.
+ * @param size The number of bits in the bitmap.
+ */
+void bitmap_summary_init(bitmap_summary_t *bs, void *bm, int size);
+
+/**
+ * Release the memory held by a summary (the bitmap itself is untouched).
+ */
+void bitmap_summary_destroy(bitmap_summary_t *bs);
+
+/**
+ * Set or clear a run of bits, keeping the summary up to date.
+ *
+ * @param bs The summary.
+ * @param i First bit index.
+ * @param len Number of bits.
+ * @param v Value the bits should be set to (0 or 1).
+ */
+void bitmap_summary_put(bitmap_summary_t *bs, int i, int len, int v);
+
+/**
+ * Find the first clear bit at or after start (wrapping around to the
+ * beginning) and set it.
+ *
+ * @param bs The summary.
+ * @param start Bit index to start searching from (the next-fit cursor).
+ *
+ * @return The index of the bit that was set, or -1 if none are clear.
+ */
+int bitmap_summary_alloc(bitmap_summary_t *bs, int start);
+
+/**
+ * Find a run of up to n clear bits at or after start (wrapping around to
+ * the beginning) and set them.
+ *
+ * A run of n bits is preferred; a shorter run is only returned when no run
+ * of n clear bits exists, in which case the longest one found is used.
+ *
+ * @param bs The summary.
+ * @param start Bit index to start searching from (the next-fit cursor).
+ * @param n The number of bits wanted.
+ * @param len Set to the length of the run that was allocated.
+ *
+ * @return The index of the first bit of the run, or -1 if none are clear.
+ */
+int bitmap_summary_alloc_range(bitmap_summary_t *bs, int start, int n,
+                               int *len);
+
+/**
+ * Count the runs of clear bits, a measure of how fragmented the free space
+ * is. Takes time proportional to the size of the bitmap.
+ *
+ * @param bs The summary.
+ * @param runs Set to the number of maximal runs of clear bits.
+ * @param longest Set to the length of the longest run.
+ */
+void bitmap_summary_runs(bitmap_summary_t *bs, int *runs, int *longest);
+
 #endif
@@ -10,8 +10,10 @@
 #include <assert.h>
 #include <errno.h>
 #include <fcntl.h>
+#include <pthread.h>
 #include <stdint.h>
 #include <stdio.h>
+#include <stdlib.h>
 #include <sys/mman.h>
 #include <sys/stat.h>
 #include <sys/types.h>
@@ -19,21 +21,39 @@
 
 #include "bitmap.h"
 #include "blocks.h"
+#include "dedup.h"
+#include "journal.h"
+#include "trace.h"
 
-const int BLOCK_COUNT = 256; // we split the "disk" into 256 blocks
-const int BLOCK_SIZE = 4096; // = 4K
-const int NUFS_SIZE = BLOCK_SIZE * BLOCK_COUNT; // = 1MB
-
-const int BLOCK_BITMAP_SIZE = BLOCK_COUNT / 8;
-// Note: assumes block count is divisible by 8
+int BLOCK_COUNT = 0; // loaded from the superblock
+int BLOCK_SIZE = 0;
+long NUFS_SIZE = 0;
 
 static int blocks_fd = -1;
-static void *blocks_base = 0;
+static void *blocks_base = 0; // shared mapping: file data
+static void *blocks_meta = 0; // private mapping: metadata
+static superblock_t *blocks_sb = 0;
+
+static bitmap_summary_t block_summary;
+static bitmap_summary_t inode_summary;
+
+// Data blocks written through the shared mapping since they were last
+// synced, one bit per block. Each block is also in the dirty set of the
+// file that wrote it.
+static uint64_t *blocks_dirty_map = 0;
+
+// Serializes the block allocator: the summary, the bitmap, block_hint, the
+// reference counts and the counters in block_stats.
+static pthread_mutex_t block_alloc_lock = PTHREAD_MUTEX_INITIALIZER;
+static blocks_stats_t block_stats;
+
+// See blocks_on_unshared().
+static blocks_unshared_t block_unshared_hook = 0;
 
 // Get the number of blocks needed to store the given number of bytes.
-int bytes_to_blocks(int bytes) {
-  int quo = bytes / BLOCK_SIZE;
-  int rem = bytes % BLOCK_SIZE;
+int bytes_to_blocks(long bytes) {
+  long quo = bytes / BLOCK_SIZE;
+  long rem = bytes % BLOCK_SIZE;
   if (rem == 0) {
     return quo;
   } else {
@@ -41,64 +61,591 @@ int bytes_to_blocks(int bytes) {
   }
 }
 
-// Load and initialize the given disk image.
+// Number of blocks of the given size needed to hold the given no. of bytes.
+static int blocks_for(long bytes, int block_size) {
+  return (bytes + block_size - 1) / block_size;
+}
+
+// Default journal size: 1/32 of the image, between 32 and 8192 blocks.
+static int journal_default(int block_count) {
+  int blocks = block_count / 32;
+  if (blocks < 32) {
+    blocks = 32;
+  }
+  if (blocks > 8192) {
+    blocks = 8192;
+  }
+  return blocks;
+}
+
+// Size of the dedup index: a bucket of DEDUP_WAYS entries for every
+// DEDUP_WAYS blocks, rounded up to a power of two.
+static long dedup_index_bytes(int block_count) {
+  long buckets = 1;
+  while (buckets * DEDUP_WAYS < block_count) {
+    buckets *= 2;
+  }
+  return buckets * sizeof(dedup_bucket_t);
+}
+
+// Create a disk image with the given geometry.
+int blocks_format(const char *image_path, int block_size, int block_count,
+                  int inode_count, int inode_size, int journal_blocks,
+                  int features) {
+  // block sizes must be powers of two large enough for the superblock
+  if (block_size < 512 || (block_size & (block_size - 1)) != 0 ||
+      block_count <= 0 || inode_count <= 1 || inode_size <= 0) {
+    return -1;
+  }
+
+  superblock_t sb;
+  memset(&sb, 0, sizeof(sb));
+  sb.magic = NUFS_MAGIC;
+  sb.version = NUFS_VERSION;
+  sb.features = features;
+  sb.block_size = block_size;
+  sb.block_count = block_count;
+  sb.inode_count = inode_count;
+  sb.inode_size = inode_size;
+
+  sb.block_bitmap_start = 1;
+  sb.block_bitmap_blocks = blocks_for(blocks_for(block_count, 8), block_size);
+  sb.refcount_start = sb.block_bitmap_start + sb.block_bitmap_blocks;
+  sb.refcount_blocks =
+      blocks_for((long) block_count * sizeof(uint32_t), block_size);
+  sb.dedup_start = sb.refcount_start + sb.refcount_blocks;
+  sb.dedup_blocks = features & NUFS_FEATURE_DEDUP
+                        ? blocks_for(dedup_index_bytes(block_count), block_size)
+                        : 0;
+  sb.compress_start = sb.dedup_start + sb.dedup_blocks;
+  sb.compress_blocks = features & NUFS_FEATURE_COMPRESS
+                           ? blocks_for(blocks_for(block_count, 8), block_size)
+                           : 0;
+  sb.inode_bitmap_start = sb.compress_start + sb.compress_blocks;
+  sb.inode_bitmap_blocks = blocks_for(blocks_for(inode_count, 8), block_size);
+  sb.inode_table_start = sb.inode_bitmap_start + sb.inode_bitmap_blocks;
+  sb.inode_table_blocks = blocks_for((long) inode_count * inode_size,
+                                     block_size);
+  sb.journal_start = sb.inode_table_start + sb.inode_table_blocks;
+  sb.journal_blocks =
+      journal_blocks < 0 ? journal_default(block_count) : journal_blocks;
+  sb.data_start = sb.journal_start + sb.journal_blocks;
+
+  // inode 0 is reserved so that a zero inum can mark an unused entry
+  sb.root_inum = 1;
+
+  // the metadata must leave room for at least one data block
+  if (sb.data_start >= block_count) {
+    return -1;
+  }
+
+  int fd = open(image_path, O_CREAT | O_RDWR | O_TRUNC, 0644);
+  if (fd == -1) {
+    return -1;
+  }
+
+  // truncating to the full size leaves every block zeroed (and sparse)
+  long size = (long) block_size * block_count;
+  int rv = ftruncate(fd, size);
+
+  // the metadata blocks are allocated, as is the reserved inode
+  long bbm_bytes = (long) sb.block_bitmap_blocks * block_size;
+  uint8_t *bbm = calloc(1, bbm_bytes);
+  assert(bbm != 0);
+  for (int ii = 0; ii < sb.data_start; ++ii) {
+    bitmap_put(bbm, ii, 1);
+  }
+
+  uint8_t ibm[1] = {0};
+  bitmap_put(ibm, 0, 1);
+
+  if (rv == 0) {
+    rv = pwrite(fd, &sb, sizeof(sb), 0) == sizeof(sb) ? 0 : -1;
+  }
+  if (rv == 0) {
+    off_t off = (off_t) sb.block_bitmap_start * block_size;
+    rv = pwrite(fd, bbm, bbm_bytes, off) == bbm_bytes ? 0 : -1;
+  }
+  if (rv == 0) {
+    off_t off = (off_t) sb.inode_bitmap_start * block_size;
+    rv = pwrite(fd, ibm, sizeof(ibm), off) == sizeof(ibm) ? 0 : -1;
+  }
+
+  free(bbm);
+  close(fd);
+  return rv;
+}
+
+// Load the given disk image.
 void blocks_init(const char *image_path) {
-  blocks_fd = open(image_path, O_CREAT | O_RDWR, 0644);
+  blocks_fd = open(image_path, O_RDWR);
   assert(blocks_fd != -1);
 
-  // make sure the disk image is exactly 1MB
-  int rv = ftruncate(blocks_fd, NUFS_SIZE);
+  superblock_t sb;
+  int rv = pread(blocks_fd, &sb, sizeof(sb), 0);
+  assert(rv == sizeof(sb));
+
+  if (sb.magic != NUFS_MAGIC) {
+    fprintf(stderr, "%s: not a nufs image\n", image_path);
+    exit(1);
+  }
+  if (sb.version != NUFS_VERSION) {
+    fprintf(stderr, "%s: nufs image version %d, expected %d\n", image_path,
+            sb.version, NUFS_VERSION);
+    exit(1);
+  }
+
+  // finish writing home whatever the last mount committed
+  journal_replay(blocks_fd, &sb);
+
+  BLOCK_SIZE = sb.block_size;
+  BLOCK_COUNT = sb.block_count;
+  NUFS_SIZE = (long) BLOCK_SIZE * BLOCK_COUNT;
+
+  // make sure the whole image is backed by the file
+  struct stat st;
+  rv = fstat(blocks_fd, &st);
   assert(rv == 0);
+  assert(st.st_size >= NUFS_SIZE);
 
   // map the image to memory
   blocks_base =
       mmap(0, NUFS_SIZE, PROT_READ | PROT_WRITE, MAP_SHARED, blocks_fd, 0);
   assert(blocks_base != MAP_FAILED);
 
-  // block 0 stores the block bitmap and the inode bitmap
-  void *bbm = get_blocks_bitmap();
-  bitmap_put(bbm, 0, 1);
+  // metadata changes stay in memory until the journal writes them out
+  blocks_meta = blocks_base;
+  if (sb.journal_blocks > 0) {
+    blocks_meta = mmap(0, NUFS_SIZE, PROT_READ | PROT_WRITE, MAP_PRIVATE,
+                       blocks_fd, 0);
+    assert(blocks_meta != MAP_FAILED);
+  }
+
+  blocks_sb = (superblock_t *) blocks_meta;
+
+  bitmap_summary_init(&block_summary, get_blocks_bitmap(), BLOCK_COUNT);
+  memset(&block_stats, 0, sizeof(block_stats));
+  bitmap_summary_init(&inode_summary, get_inode_bitmap(), sb.inode_count);
+
+  blocks_dirty_map = calloc((BLOCK_COUNT + 63) / 64, sizeof(uint64_t));
+  assert(blocks_dirty_map != 0);
+
+  if (sb.journal_blocks > 0) {
+    journal_init(blocks_fd);
+  }
 }
 
 // Close the disk image.
 void blocks_free() {
+  // file data goes out before the metadata that points at it
+  blocks_sync_all();
+  free(blocks_dirty_map);
+  blocks_dirty_map = 0;
+
+  if (blocks_meta != blocks_base) {
+    journal_shutdown();
+    int rv = munmap(blocks_meta, NUFS_SIZE);
+    assert(rv == 0);
+  }
+  blocks_meta = 0;
+
+  bitmap_summary_destroy(&block_summary);
+  bitmap_summary_destroy(&inode_summary);
+
   int rv = munmap(blocks_base, NUFS_SIZE);
   assert(rv == 0);
+  close(blocks_fd);
+  blocks_fd = -1;
+  blocks_sb = 0;
 }
 
+// Return the superblock of the mounted image.
+superblock_t *blocks_super() { return blocks_sb; }
+
+// Return the file descriptor of the open image.
+int blocks_image_fd() { return blocks_fd; }
+
 // Get the given block, returning a pointer to its start.
-void *blocks_get_block(int bnum) { return blocks_base + BLOCK_SIZE * bnum; }
+void *blocks_get_block(int bnum) {
+  return blocks_base + (long) BLOCK_SIZE * bnum;
+}
+
+// Get the given metadata block, returning a pointer to its start.
+void *blocks_get_meta(int bnum) {
+  return blocks_meta + (long) BLOCK_SIZE * bnum;
+}
+
+// Return the number of the metadata block holding the given address.
+int blocks_meta_bnum(const void *ptr) {
+  return ((const char *) ptr - (const char *) blocks_meta) / BLOCK_SIZE;
+}
 
 // Return a pointer to the beginning of the block bitmap.
-// The size is BLOCK_BITMAP_SIZE bytes.
-void *get_blocks_bitmap() { return blocks_get_block(0); }
+// The size is block_bitmap_blocks blocks.
+void *get_blocks_bitmap() {
+  return blocks_get_meta(blocks_sb->block_bitmap_start);
+}
 
 // Return a pointer to the beginning of the inode table bitmap.
 void *get_inode_bitmap() {
-  uint8_t *block = blocks_get_block(0);
+  return blocks_get_meta(blocks_sb->inode_bitmap_start);
+}
+
+// Set or clear the dirty bit of a block, returning its old value.
+static int dirty_bit_put(int bnum, int value) {
+  uint64_t bit = 1ULL << (bnum % 64);
+  uint64_t old;
+  if (value) {
+    old = __atomic_fetch_or(&blocks_dirty_map[bnum / 64], bit,
+                            __ATOMIC_RELAXED);
+  } else {
+    old = __atomic_fetch_and(&blocks_dirty_map[bnum / 64], ~bit,
+                             __ATOMIC_RELAXED);
+  }
+  return (old & bit) != 0;
+}
+
+// Write back the pages holding a run of blocks and wait for them.
+static int blocks_msync(int bnum, int len) {
+  long page = sysconf(_SC_PAGESIZE);
+  long start = (long) bnum * BLOCK_SIZE / page * page;
+  long end = ((long) (bnum + len) * BLOCK_SIZE + page - 1) / page * page;
+  return msync(blocks_base + start, end - start, MS_SYNC);
+}
+
+// Set up an empty dirty set.
+void blocks_dirty_init(blocks_dirty_t *set) {
+  pthread_mutex_init(&set->lock, 0);
+  set->runs = 0;
+  set->count = 0;
+  set->cap = 0;
+}
+
+// Free the memory held by a dirty set.
+void blocks_dirty_destroy(blocks_dirty_t *set) {
+  pthread_mutex_destroy(&set->lock);
+  free(set->runs);
+  set->runs = 0;
+  set->count = 0;
+  set->cap = 0;
+}
+
+// Record that a run of data blocks was written.
+void blocks_mark_dirty(blocks_dirty_t *set, int bnum, int len) {
+  pthread_mutex_lock(&set->lock);
+  for (int ii = bnum; ii < bnum + len; ++ii) {
+    if (dirty_bit_put(ii, 1)) {
+      continue;
+    }
+
+    // sequential writes keep extending the last run
+    int *last = set->count > 0 ? &set->runs[2 * (set->count - 1)] : 0;
+    if (last != 0 && last[0] + last[1] == ii) {
+      last[1]++;
+      continue;
+    }
+    if (set->count == set->cap) {
+      set->cap = set->cap ? set->cap * 2 : 8;
+      set->runs = realloc(set->runs, set->cap * 2 * sizeof(int));
+      assert(set->runs != 0);
+    }
+    set->runs[2 * set->count] = ii;
+    set->runs[2 * set->count + 1] = 1;
+    set->count++;
+  }
+  pthread_mutex_unlock(&set->lock);
+}
 
-  // The inode bitmap is stored immediately after the block bitmap
-  return (void *) (block + BLOCK_BITMAP_SIZE);
+// Write back the dirty blocks of a set.
+int blocks_sync(blocks_dirty_t *set, int wait) {
+  int rv = 0;
+  pthread_mutex_lock(&set->lock);
+  if (!wait) {
+    for (int ii = 0; ii < set->count; ++ii) {
+      off_t off = (off_t) set->runs[2 * ii] * BLOCK_SIZE;
+      off_t len = (off_t) set->runs[2 * ii + 1] * BLOCK_SIZE;
+      if (sync_file_range(blocks_fd, off, len, SYNC_FILE_RANGE_WRITE) != 0) {
+        rv = -1;
+      }
+    }
+    pthread_mutex_unlock(&set->lock);
+    return rv;
+  }
+
+  // blocks written from here on are dirty again and join a new list
+  int *runs = set->runs;
+  int count = set->count;
+  set->runs = 0;
+  set->count = 0;
+  set->cap = 0;
+  for (int ii = 0; ii < count; ++ii) {
+    for (int bnum = runs[2 * ii]; bnum < runs[2 * ii] + runs[2 * ii + 1];
+         ++bnum) {
+      dirty_bit_put(bnum, 0);
+    }
+  }
+  pthread_mutex_unlock(&set->lock);
+
+  for (int ii = 0; ii < count; ++ii) {
+    if (blocks_msync(runs[2 * ii], runs[2 * ii + 1]) != 0) {
+      rv = -1;
+    }
+  }
+  free(runs);
+  return rv;
+}
+
+// Write back a run of blocks if any of them are dirty.
+int blocks_sync_range(int bnum, int len) {
+  int dirty = 0;
+  for (int ii = bnum; ii < bnum + len; ++ii) {
+    dirty |= dirty_bit_put(ii, 0);
+  }
+  return dirty ? blocks_msync(bnum, len) : 0;
+}
+
+// Write back every dirty data block in the image.
+int blocks_sync_all() {
+  int rv = 0;
+  int bnum = 0;
+  while (bnum < BLOCK_COUNT) {
+    if (blocks_dirty_map[bnum / 64] == 0) {
+      bnum = (bnum / 64 + 1) * 64;
+      continue;
+    }
+    if (!dirty_bit_put(bnum, 0)) {
+      bnum++;
+      continue;
+    }
+
+    int len = 1;
+    while (bnum + len < BLOCK_COUNT && dirty_bit_put(bnum + len, 0)) {
+      len++;
+    }
+    if (blocks_msync(bnum, len) != 0) {
+      rv = -1;
+    }
+    bnum += len;
+  }
+  return rv;
 }
 
+// Add the block bitmap blocks covering a run of blocks to the journal,
+// along with the superblock (for block_hint).
+static void block_bitmap_dirty(int bnum, int len) {
+  int bits = BLOCK_SIZE * 8;
+  journal_dirty(0);
+  for (int ii = bnum / bits; ii <= (bnum + len - 1) / bits; ++ii) {
+    journal_dirty(blocks_sb->block_bitmap_start + ii);
+  }
+}
+
+// Return the allocation summary of the inode bitmap.
+bitmap_summary_t *get_inode_summary() { return &inode_summary; }
+
 // Allocate a new block and return its index.
 int alloc_block() {
-  void *bbm = get_blocks_bitmap();
+  pthread_mutex_lock(&block_alloc_lock);
+  int bnum = bitmap_summary_alloc(&block_summary, blocks_sb->block_hint);
+  if (bnum >= 0) {
+    blocks_sb->block_hint = bnum + 1;
+    block_bitmap_dirty(bnum, 1);
+    block_stats.alloc_blocks++;
+  }
+  block_stats.allocs++;
+  pthread_mutex_unlock(&block_alloc_lock);
+
+  if (bnum < 0) {
+    return -1;
+  }
+  TRACE(TRACE_DEBUG, TRACE_OP_ALLOC_BLOCK, 0, bnum, 1, 0);
+  return bnum;
+}
+
+// Allocate a run of up to n contiguous blocks.
+int alloc_block_range(int n, int *len) {
+  return alloc_block_range_near(-1, n, len);
+}
 
-  for (int ii = 1; ii < BLOCK_COUNT; ++ii) {
-    if (!bitmap_get(bbm, ii)) {
-      bitmap_put(bbm, ii, 1);
-      printf("+ alloc_block() -> %d\n", ii);
-      return ii;
+// Allocate a run of up to n contiguous blocks, searching from goal.
+int alloc_block_range_near(int goal, int n, int *len) {
+  pthread_mutex_lock(&block_alloc_lock);
+  if (goal < 0 || goal >= blocks_sb->block_count) {
+    goal = blocks_sb->block_hint;
+  }
+  int bnum = bitmap_summary_alloc_range(&block_summary, goal, n, len);
+  if (bnum >= 0) {
+    blocks_sb->block_hint = bnum + *len;
+    block_bitmap_dirty(bnum, *len);
+    block_stats.alloc_blocks += *len;
+  }
+  block_stats.allocs++;
+  pthread_mutex_unlock(&block_alloc_lock);
+
+  if (bnum < 0) {
+    return -1;
+  }
+  TRACE(TRACE_DEBUG, TRACE_OP_ALLOC_BLOCK, 0, bnum, *len, n);
+  return bnum;
+}
+
+// Return the reference count table: the references each block has beyond
+// its first.
+static uint32_t *block_refs() {
+  return blocks_get_meta(blocks_sb->refcount_start);
+}
+
+// Add the reference count block of a block to the journal, along with the
+// superblock (for shared_blocks).
+static void block_refs_dirty(int bnum) {
+  journal_dirty(0);
+  journal_dirty_range(&block_refs()[bnum], sizeof(uint32_t));
+}
+
+// Drop a reference to each block at the start of a run that is shared,
+// returning how many there were. The caller holds block_alloc_lock.
+static int block_unref_shared(int bnum, int len) {
+  uint32_t *refs = block_refs();
+  int count = 0;
+  while (count < len && refs[bnum + count] > 0) {
+    if (--refs[bnum + count] == 0) {
+      blocks_sb->shared_blocks--;
     }
+    block_refs_dirty(bnum + count);
+    count++;
   }
+  return count;
+}
 
-  return -1;
+// Return the compress map.
+static void *block_compress_map() {
+  return blocks_get_meta(blocks_sb->compress_start);
+}
+
+// Clear the compress map bits of a run of blocks, adding the blocks of the
+// map that change to the journal. The caller holds block_alloc_lock.
+static void block_uncompress(int bnum, int len) {
+  if (blocks_sb->compress_blocks == 0) {
+    return;
+  }
+  uint8_t *map = block_compress_map();
+  for (int ii = bnum; ii < bnum + len; ++ii) {
+    if (bitmap_get(map, ii)) {
+      bitmap_put(map, ii, 0);
+      journal_dirty_range(&map[ii / 8], 1);
+    }
+  }
+}
+
+// Deallocate a run of blocks that no other file shares.
+static void block_release(int bnum, int len) {
+  TRACE(TRACE_DEBUG, TRACE_OP_FREE_BLOCK, 0, bnum, len, 0);
+
+  // freed metadata must not be written home over whatever reuses the blocks,
+  // and freed data no longer needs writing back
+  journal_forget(bnum, len);
+  for (int ii = bnum; ii < bnum + len; ++ii) {
+    dirty_bit_put(ii, 0);
+  }
+
+  pthread_mutex_lock(&block_alloc_lock);
+  bitmap_summary_put(&block_summary, bnum, len, 0);
+  block_bitmap_dirty(bnum, len);
+  block_uncompress(bnum, len);
+  block_stats.frees++;
+  block_stats.freed_blocks += len;
+  pthread_mutex_unlock(&block_alloc_lock);
 }
 
 // Deallocate the block with the given index.
-void free_block(int bnum) {
-  printf("+ free_block(%d)\n", bnum);
-  void *bbm = get_blocks_bitmap();
-  bitmap_put(bbm, bnum, 0);
+void free_block(int bnum) { free_block_range(bnum, 1); }
+
+// Drop a reference to each block of a run, deallocating the unshared ones.
+void free_block_range(int bnum, int len) {
+  if (blocks_shared() == 0) {
+    block_release(bnum, len);
+    return;
+  }
+
+  int end = bnum + len;
+  while (bnum < end) {
+    pthread_mutex_lock(&block_alloc_lock);
+    int shared = block_unref_shared(bnum, end - bnum);
+    // the blocks that are not shared belong to the caller alone, so they
+    // cannot become shared before they are released
+    int run = 0;
+    while (bnum + shared + run < end &&
+           block_refs()[bnum + shared + run] == 0) {
+      run++;
+    }
+    pthread_mutex_unlock(&block_alloc_lock);
+
+    for (int ii = bnum; block_unshared_hook && ii < bnum + shared; ++ii) {
+      if (blocks_refs(ii) == 1) {
+        block_unshared_hook(ii);
+      }
+    }
+    bnum += shared;
+
+    if (run > 0) {
+      block_release(bnum, run);
+      bnum += run;
+    }
+  }
+}
+
+// Add a reference to each block of an allocated run.
+void blocks_ref_range(int bnum, int len) {
+  uint32_t *refs = block_refs();
+  pthread_mutex_lock(&block_alloc_lock);
+  for (int ii = bnum; ii < bnum + len; ++ii) {
+    if (refs[ii]++ == 0) {
+      blocks_sb->shared_blocks++;
+    }
+    block_refs_dirty(ii);
+  }
+  pthread_mutex_unlock(&block_alloc_lock);
+}
+
+// Return the number of files using an allocated block.
+int blocks_refs(int bnum) {
+  return 1 + __atomic_load_n(&block_refs()[bnum], __ATOMIC_RELAXED);
+}
+
+// Return the number of shared blocks in the image.
+int blocks_shared() {
+  return __atomic_load_n(&blocks_sb->shared_blocks, __ATOMIC_RELAXED);
+}
+
+// Return whether a block starts a run holding a compressed cluster.
+int blocks_compressed(int bnum) {
+  return blocks_sb->compress_blocks > 0 &&
+         bitmap_get(block_compress_map(), bnum);
+}
+
+// Mark a block as the start of a compressed run.
+void blocks_set_compressed(int bnum) {
+  uint8_t *map = block_compress_map();
+  pthread_mutex_lock(&block_alloc_lock);
+  bitmap_put(map, bnum, 1);
+  journal_dirty_range(&map[bnum / 8], 1);
+  pthread_mutex_unlock(&block_alloc_lock);
+}
+
+// Set the function called when a shared block is down to one reference.
+void blocks_on_unshared(blocks_unshared_t hook) { block_unshared_hook = hook; }
+
+// Get the allocator counters and measure the fragmentation of free space.
+void blocks_stats(blocks_stats_t *st) {
+  int runs, longest;
+  pthread_mutex_lock(&block_alloc_lock);
+  *st = block_stats;
+  st->scanned = block_summary.scanned;
+  st->free_blocks = block_summary.free;
+  st->shared_blocks = blocks_sb->shared_blocks;
+  bitmap_summary_runs(&block_summary, &runs, &longest);
+  pthread_mutex_unlock(&block_alloc_lock);
+
+  st->free_runs = runs;
+  st->free_longest = longest;
 }
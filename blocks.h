@@ -5,29 +5,145 @@
  * A block-based abstraction over a disk image file.
  *
  * The disk image is mmapped, so block data is accessed using pointers.
+ *
+ * Block 0 of every image holds the superblock, which records the geometry
+ * of the image. The remaining metadata regions follow it in this order:
+ *
+ *   [superblock][block bitmap][refcounts][dedup index][compress map]
+ *   [inode bitmap][inode table][journal][data...]
+ *
+ * The dedup index is only there in images formatted with
+ * NUFS_FEATURE_DEDUP (see dedup.h), and the compress map in images
+ * formatted with NUFS_FEATURE_COMPRESS (see compress.h). The compress map
+ * has a bit per block, set for the first block of each run that holds a
+ * compressed cluster of file data.
+ *
+ * A data block may be shared by several files, which copy_file_range sets
+ * up instead of copying the data. The refcount region holds a 32-bit count
+ * per block of the references it has beyond the first, so it is zero for
+ * free blocks and for blocks only one file uses; a shared block is copied
+ * before it is written.
+ *
+ * The image is mapped twice. File data is read and written through a shared
+ * mapping (blocks_get_block()), so it goes straight to the image file.
+ * Metadata goes through a private mapping (blocks_get_meta()) and only
+ * reaches the image file through the journal (see journal.h). Images made
+ * without a journal use the shared mapping for both.
  */
 #ifndef BLOCKS_H
 #define BLOCKS_H
 
+#include <pthread.h>
 #include <stdio.h>
 
-const int BLOCK_COUNT; // we split the "disk" into blocks (default = 256)
-const int BLOCK_SIZE;  // default = 4K
-const int NUFS_SIZE;   // default = 1MB
+#include "bitmap.h"
 
-const int BLOCK_BITMAP_SIZE; // default = 256 / 8 = 32
+#define NUFS_MAGIC 0x5346554e // "NUFS"
+#define NUFS_VERSION 9
 
-/** 
+// Geometry used when an image is created without an explicit format.
+#define NUFS_DEFAULT_BLOCK_SIZE 4096  // 4K
+#define NUFS_DEFAULT_BLOCK_COUNT 256  // 1MB image
+#define NUFS_DEFAULT_INODE_COUNT 256
+#define NUFS_DEFAULT_JOURNAL -1 // sized from the block count
+
+// Optional features, chosen when an image is formatted.
+#define NUFS_FEATURE_DEDUP 1    // share blocks with the same contents
+#define NUFS_FEATURE_COMPRESS 2 // compress file data
+
+/**
+ * The on-disk superblock, stored at the start of block 0.
+ *
+ * Every region is described by its first block and its length in blocks.
+ */
+typedef struct superblock {
+  int magic;               // NUFS_MAGIC
+  int version;             // NUFS_VERSION
+  int features;            // NUFS_FEATURE_* flags
+  int block_size;          // bytes per block
+  int block_count;         // total number of blocks in the image
+  int inode_count;         // total number of inodes
+  int inode_size;          // bytes per inode record
+  int block_bitmap_start;  // first block of the free block bitmap
+  int block_bitmap_blocks;
+  int refcount_start;      // first block of the block reference counts
+  int refcount_blocks;
+  int dedup_start;         // first block of the dedup index
+  int dedup_blocks;        // 0 without NUFS_FEATURE_DEDUP
+  int compress_start;      // first block of the compress map
+  int compress_blocks;     // 0 without NUFS_FEATURE_COMPRESS
+  int inode_bitmap_start;  // first block of the free inode bitmap
+  int inode_bitmap_blocks;
+  int inode_table_start;   // first block of the inode table
+  int inode_table_blocks;
+  int journal_start;       // first block of the metadata journal
+  int journal_blocks;      // 0 if the image has no journal
+  int data_start;          // first block available for allocation
+  int root_inum;           // inode number of the root directory
+  int block_hint;          // next-fit cursors: where the next allocation
+  int inode_hint;          // starts searching
+  int journal_seq;         // last journal transaction written home
+  int orphans;             // unlinked inodes still open; freed at mount
+  int shared_blocks;       // blocks used by more than one file
+} superblock_t;
+
+/**
+ * A set of data blocks written through the shared mapping and not yet
+ * synced, kept for each inode so that one file can be synced on its own.
+ *
+ * Blocks are kept as runs, merged when written in order. A block is only
+ * added to a set if it is not dirty already; the blocks_* functions also
+ * keep track of every dirty block in the image.
+ */
+typedef struct blocks_dirty {
+  pthread_mutex_t lock;
+  int *runs;  // (first block, length) pairs
+  int count;  // runs in use
+  int cap;    // runs allocated
+} blocks_dirty_t;
+
+// Geometry of the mounted image, loaded from the superblock by blocks_init().
+extern int BLOCK_COUNT; // we split the "disk" into blocks
+extern int BLOCK_SIZE;  // bytes per block
+extern long NUFS_SIZE;  // total image size in bytes
+
+/**
  * Compute the number of blocks needed to store the given number of bytes.
  *
  * @param bytes Size of data to store in bytes.
  *
  * @return Number of blocks needed to store the given number of bytes.
  */
-int bytes_to_blocks(int bytes);
+int bytes_to_blocks(long bytes);
 
 /**
- * Load and initialize the given disk image.
+ * Create (or overwrite) a disk image with the given geometry.
+ *
+ * Writes a fresh superblock, clears both bitmaps and the reference counts
+ * and marks the metadata blocks and the reserved inode 0 as allocated. The
+ * image file is resized to exactly block_size * block_count bytes.
+ *
+ * @param image_path Path to the disk image file.
+ * @param block_size Block size in bytes; a power of two, at least 512.
+ * @param block_count Number of blocks in the image.
+ * @param inode_count Number of inodes in the inode table.
+ * @param inode_size Size of one inode record in bytes.
+ * @param journal_blocks Size of the metadata journal in blocks, 0 for no
+ *        journal or NUFS_DEFAULT_JOURNAL to size it from the block count.
+ * @param features NUFS_FEATURE_* flags.
+ *
+ * @return 0 on success, -1 if the geometry is invalid or the image could
+ *         not be written.
+ */
+int blocks_format(const char *image_path, int block_size, int block_count,
+                  int inode_count, int inode_size, int journal_blocks,
+                  int features);
+
+/**
+ * Load the given disk image.
+ *
+ * The image must have been created by blocks_format(); its geometry is read
+ * back from the superblock.
  *
  * @param image_path Path to the disk image file.
  */
@@ -38,6 +154,22 @@ void blocks_init(const char *image_path);
  */
 void blocks_free();
 
+/**
+ * Return the superblock of the mounted image.
+ *
+ * @return Pointer to the superblock in block 0.
+ */
+superblock_t *blocks_super();
+
+/**
+ * Get the file descriptor of the open image, for moving file data with
+ * read, write or splice instead of through the mapping. Data blocks start
+ * at offset bnum * BLOCK_SIZE, and the two views are always in sync.
+ *
+ * @return The image's file descriptor.
+ */
+int blocks_image_fd();
+
 /**
  * Get the block with the given index, returning a pointer to its start.
  *
@@ -48,33 +180,244 @@ void blocks_free();
 void *blocks_get_block(int bnum);
 
 /**
- * Return a pointer to the beginning of the block bitmap.
+ * Get a metadata block with the given index, returning a pointer to its
+ * start.
+ *
+ * Changes made through this pointer must be recorded with journal_dirty().
+ *
+ * @param bnum Block number (index).
+ *
+ * @return Pointer to the beginning of the block in the metadata mapping.
+ */
+void *blocks_get_meta(int bnum);
+
+/**
+ * Return the number of the block holding an address in the metadata mapping.
+ *
+ * @param ptr Address returned by (or inside a block returned by)
+ *        blocks_get_meta().
+ *
+ * @return The block number.
+ */
+int blocks_meta_bnum(const void *ptr);
+
+/**
+ * Set up an empty dirty set.
+ *
+ * @param set The set.
+ */
+void blocks_dirty_init(blocks_dirty_t *set);
+
+/**
+ * Free the memory held by a dirty set.
+ *
+ * @param set The set.
+ */
+void blocks_dirty_destroy(blocks_dirty_t *set);
+
+/**
+ * Record that a run of data blocks was written through blocks_get_block().
+ *
+ * @param set The dirty set of the file the blocks belong to.
+ * @param bnum First block of the run.
+ * @param len Number of blocks in the run.
+ */
+void blocks_mark_dirty(blocks_dirty_t *set, int bnum, int len);
+
+/**
+ * Write back the dirty blocks of a set.
+ *
+ * Only the pages holding those blocks are written; the rest of the image is
+ * left alone.
+ *
+ * @param set The dirty set.
+ * @param wait Nonzero to wait until the blocks are on disk (and forget
+ *        them), zero to only start writing them back.
+ *
+ * @return 0 on success, -1 if the image could not be written.
+ */
+int blocks_sync(blocks_dirty_t *set, int wait);
+
+/**
+ * Write back a run of data blocks, if any of them are dirty, and wait for
+ * them, whichever dirty sets they are in.
+ *
+ * @param bnum First block of the run.
+ * @param len Number of blocks in the run.
+ *
+ * @return 0 on success, -1 if the image could not be written.
+ */
+int blocks_sync_range(int bnum, int len);
+
+/**
+ * Write back every dirty data block in the image and wait for them.
+ *
+ * @return 0 on success, -1 if the image could not be written.
+ */
+int blocks_sync_all();
+
+/**
+ * Return a pointer to the beginning of the block bitmap (in the metadata
+ * mapping).
  *
  * @return A pointer to the beginning of the free blocks bitmap.
  */
 void *get_blocks_bitmap();
 
 /**
- * Return a pointer to the beginning of the inode table bitmap.
+ * Return a pointer to the beginning of the inode table bitmap (in the
+ * metadata mapping).
  *
  * @return A pointer to the beginning of the free inode bitmap.
  */
 void *get_inode_bitmap();
 
+/**
+ * Counters kept by the block allocator since the image was mounted, along
+ * with the state of the free space.
+ */
+typedef struct blocks_stats {
+  long allocs;       // calls to alloc_block() and alloc_block_range()
+  long alloc_blocks; // blocks they handed out
+  long frees;        // calls to free_block() and free_block_range()
+  long freed_blocks; // blocks they released
+  long scanned;      // bitmap and summary words read while allocating
+  long free_blocks;  // blocks free right now
+  long free_runs;    // maximal runs of free blocks
+  long free_longest; // length of the longest free run
+  long shared_blocks; // blocks used by more than one file
+} blocks_stats_t;
+
+/**
+ * Get the allocator counters and measure how fragmented the free space is.
+ *
+ * Scans the whole block bitmap while holding the allocator lock.
+ *
+ * @param st Filled in with the counters.
+ */
+void blocks_stats(blocks_stats_t *st);
+
+/**
+ * Return the allocation summary of the inode bitmap.
+ *
+ * The summary is not locked; the inode layer serializes its use.
+ *
+ * @return The summary used to allocate and free inode numbers.
+ */
+bitmap_summary_t *get_inode_summary();
+
 /**
  * Allocate a new block and return its number.
  *
- * Grabs the first unused block and marks it as allocated.
+ * Grabs the first unused block after the most recent allocation (next fit)
+ * and marks it as allocated. Safe to call from several threads.
  *
- * @return The index of the newly allocated block.
+ * @return The index of the newly allocated block, or -1 if the image is full.
  */
 int alloc_block();
 
 /**
- * Deallocate the block with the given number.
+ * Allocate a run of up to n contiguous blocks.
+ *
+ * A run of n blocks is returned whenever one exists; otherwise the longest
+ * free run found is returned.
+ *
+ * @param n Number of blocks wanted.
+ * @param len Set to the number of blocks in the run.
+ *
+ * @return The index of the first block of the run, or -1 if the image is full.
+ */
+int alloc_block_range(int n, int *len);
+
+/**
+ * Allocate a run of up to n contiguous blocks, searching from the given
+ * block instead of the most recent allocation. Passing the block after a
+ * file's last extent lets the file grow in place when that block is free.
+ *
+ * @param goal Block to start searching from, or -1 for next fit.
+ * @param n Number of blocks wanted.
+ * @param len Set to the number of blocks in the run.
+ *
+ * @return The index of the first block of the run, or -1 if the image is full.
+ */
+int alloc_block_range_near(int goal, int n, int *len);
+
+/**
+ * Deallocate the block with the given number, or drop a reference to it if
+ * it is shared.
  *
  * @param bnun The block number to deallocate.
  */
 void free_block(int bnum);
 
+/**
+ * Drop a reference to each block of a contiguous run, deallocating the
+ * blocks that no other file shares.
+ *
+ * @param bnum The first block of the run.
+ * @param len Number of blocks in the run.
+ */
+void free_block_range(int bnum, int len);
+
+/**
+ * Add a reference to each block of an allocated run, so that another file
+ * can map it. Each reference is dropped by free_block_range().
+ *
+ * @param bnum The first block of the run.
+ * @param len Number of blocks in the run.
+ */
+void blocks_ref_range(int bnum, int len);
+
+/**
+ * Return the number of files using an allocated block.
+ *
+ * @param bnum Block number.
+ *
+ * @return 1 unless the block is shared.
+ */
+int blocks_refs(int bnum);
+
+/**
+ * Return the number of blocks in the image that are shared, so that
+ * callers can skip looking up reference counts when there are none.
+ *
+ * @return The number of blocks used by more than one file.
+ */
+int blocks_shared();
+
+/**
+ * Return whether a block starts a run holding a compressed cluster.
+ *
+ * @param bnum Block number.
+ *
+ * @return Nonzero if it does; always 0 for images without a compress map.
+ */
+int blocks_compressed(int bnum);
+
+/**
+ * Mark an allocated block as the start of a run holding a compressed
+ * cluster. The mark goes away when the block is deallocated.
+ *
+ * Must be called inside a journal handle.
+ *
+ * @param bnum Block number.
+ */
+void blocks_set_compressed(int bnum);
+
+/**
+ * Called by free_block_range() for each block that it leaves with a single
+ * reference. The dedup index holds references of its own, and uses this
+ * to find the blocks that only it still holds.
+ *
+ * @param bnum Block number.
+ */
+typedef void (*blocks_unshared_t)(int bnum);
+
+/**
+ * Set the function called when a shared block is down to one reference.
+ *
+ * @param hook The function, or NULL for none.
+ */
+void blocks_on_unshared(blocks_unshared_t hook);
+
 #endif
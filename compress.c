@@ -0,0 +1,370 @@
+/**
+ * @file compress.c
+ *
+ * Cluster compression and the cache of decompressed clusters.
+ */
+#include <pthread.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "blocks.h"
+#include "compress.h"
+
+#define COMPRESS_HASH_BITS 12
+#define COMPRESS_MAX_DISTANCE 65535
+
+struct compress_buf {
+  int bnum;      // first block of the run cached, 0 for none
+  int size;      // bytes of file data
+  int pins;      // compress_get() callers that have not released it
+  int loading;   // being decompressed; wait on compress_loaded
+  int spare;     // not in the cache: freed when released
+  uint64_t used; // compress_clock when last got, to evict the oldest
+  uint8_t *data; // COMPRESS_CLUSTER bytes, allocated when first used
+};
+
+// Serializes the cache slots (but not decompressing into them) and the
+// counters.
+static pthread_mutex_t compress_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t compress_loaded = PTHREAD_COND_INITIALIZER;
+static compress_buf_t compress_cache[COMPRESS_CACHE_SLOTS];
+static uint64_t compress_clock = 0;
+static compress_stats_t compress_counts;
+static int compress_blocks = 0; // blocks per cluster, 0 when disabled
+
+// Read four bytes, wherever they are.
+static uint32_t compress_read32(const uint8_t *ptr) {
+  uint32_t word;
+  memcpy(&word, ptr, sizeof(word));
+  return word;
+}
+
+// Hash the four bytes starting a possible match.
+static int compress_hash(uint32_t word) {
+  return (word * 2654435761U) >> (32 - COMPRESS_HASH_BITS);
+}
+
+// Write what is left of a length after its nibble: 255 until the rest is
+// less than that.
+static uint8_t *compress_put_length(uint8_t *op, int len) {
+  while (len >= 255) {
+    *op++ = 255;
+    len -= 255;
+  }
+  *op++ = len;
+  return op;
+}
+
+// Write a sequence: nlit literals, then a match of mlen bytes dist back,
+// or nothing after the literals if mlen is 0. Returns the end of what was
+// written, or NULL if it does not fit before oend.
+static uint8_t *compress_put_sequence(uint8_t *op, uint8_t *oend,
+                                      const uint8_t *lit, int nlit, int dist,
+                                      int mlen) {
+  int mcode = mlen > 0 ? mlen - COMPRESS_MIN_MATCH : 0;
+  long worst = 1 + nlit / 255 + 1 + nlit + 2 + mcode / 255 + 1;
+  if (oend - op < worst) {
+    return NULL;
+  }
+
+  uint8_t *token = op++;
+  *token = (nlit < 15 ? nlit : 15) << 4;
+  if (nlit >= 15) {
+    op = compress_put_length(op, nlit - 15);
+  }
+  memcpy(op, lit, nlit);
+  op += nlit;
+  if (mlen == 0) {
+    return op;
+  }
+
+  *op++ = dist & 0xff;
+  *op++ = dist >> 8;
+  *token |= mcode < 15 ? mcode : 15;
+  if (mcode >= 15) {
+    op = compress_put_length(op, mcode - 15);
+  }
+  return op;
+}
+
+// Compress a cluster.
+int compress_pack(const void *src, int size, void *dst, int cap) {
+  const uint8_t *in = src;
+  uint8_t *op = (uint8_t *) dst + sizeof(compress_header_t);
+  uint8_t *oend = (uint8_t *) dst + cap;
+  if (cap < (int) sizeof(compress_header_t)) {
+    return -1;
+  }
+
+  // the last position each hash was seen at
+  int table[1 << COMPRESS_HASH_BITS];
+  memset(table, 0xff, sizeof(table));
+
+  int pos = 0;
+  int anchor = 0;
+  int misses = 0;
+  while (pos + COMPRESS_MIN_MATCH <= size) {
+    uint32_t word = compress_read32(in + pos);
+    int hash = compress_hash(word);
+    int cand = table[hash];
+    table[hash] = pos;
+    if (cand < 0 || pos - cand > COMPRESS_MAX_DISTANCE ||
+        compress_read32(in + cand) != word) {
+      // step faster through data that does not compress
+      pos += 1 + (misses++ >> 6);
+      continue;
+    }
+    misses = 0;
+
+    int len = COMPRESS_MIN_MATCH;
+    while (pos + len < size && in[cand + len] == in[pos + len]) {
+      len++;
+    }
+    op = compress_put_sequence(op, oend, in + anchor, pos - anchor,
+                               pos - cand, len);
+    if (op == NULL) {
+      return -1;
+    }
+    pos += len;
+    anchor = pos;
+  }
+  op = compress_put_sequence(op, oend, in + anchor, size - anchor, 0, 0);
+  if (op == NULL) {
+    return -1;
+  }
+
+  compress_header_t *hdr = dst;
+  hdr->packed = op - (uint8_t *) dst - sizeof(compress_header_t);
+  hdr->size = size;
+  return op - (uint8_t *) dst;
+}
+
+// Add the bytes continuing a length to it. Returns 0, or -1 if the input
+// ends first or the length grows past a cluster.
+static int compress_get_length(const uint8_t **ip, const uint8_t *iend,
+                               int *len) {
+  for (;;) {
+    if (*ip == iend) {
+      return -1;
+    }
+    int byte = *(*ip)++;
+    *len += byte;
+    if (*len > COMPRESS_CLUSTER) {
+      return -1;
+    }
+    if (byte < 255) {
+      return 0;
+    }
+  }
+}
+
+// Decompress packed bytes at ip into exactly size bytes at out. Returns 0,
+// or -1 if the data is not valid.
+static int compress_unpack(const uint8_t *ip, int packed, uint8_t *out,
+                           int size) {
+  const uint8_t *iend = ip + packed;
+  int op = 0;
+  while (ip < iend) {
+    int token = *ip++;
+    int nlit = token >> 4;
+    if (nlit == 15 && compress_get_length(&ip, iend, &nlit) != 0) {
+      return -1;
+    }
+    if (nlit > iend - ip || nlit > size - op) {
+      return -1;
+    }
+    memcpy(out + op, ip, nlit);
+    ip += nlit;
+    op += nlit;
+    if (ip == iend) {
+      break;
+    }
+
+    if (iend - ip < 2) {
+      return -1;
+    }
+    int dist = ip[0] | ip[1] << 8;
+    ip += 2;
+    int mlen = token & 15;
+    if (mlen == 15 && compress_get_length(&ip, iend, &mlen) != 0) {
+      return -1;
+    }
+    mlen += COMPRESS_MIN_MATCH;
+    if (dist == 0 || dist > op || mlen > size - op) {
+      return -1;
+    }
+    if (dist >= mlen) {
+      memcpy(out + op, out + op - dist, mlen);
+    } else {
+      // the match repeats bytes it is writing
+      for (int ii = 0; ii < mlen; ++ii) {
+        out[op + ii] = out[op - dist + ii];
+      }
+    }
+    op += mlen;
+  }
+  return op == size ? 0 : -1;
+}
+
+// Decompress the run starting at bnum into a buffer of COMPRESS_CLUSTER
+// bytes, setting size. Returns 0, or -1 if the run is not valid.
+static int compress_load(int bnum, uint8_t *data, int *size) {
+  const compress_header_t *hdr = blocks_get_block(bnum);
+  long cap = (long) (compress_blocks - 1) * BLOCK_SIZE;
+  if (hdr->size > COMPRESS_CLUSTER ||
+      hdr->packed > cap - sizeof(compress_header_t) ||
+      bnum + bytes_to_blocks(sizeof(*hdr) + hdr->packed) > BLOCK_COUNT) {
+    return -1;
+  }
+  *size = hdr->size;
+  return compress_unpack((const uint8_t *) (hdr + 1), hdr->packed, data,
+                         hdr->size);
+}
+
+// Start compressing, if the image was formatted for it.
+void compress_init() {
+  pthread_mutex_lock(&compress_lock);
+  memset(&compress_counts, 0, sizeof(compress_counts));
+  compress_blocks = 0;
+  // a cluster must be able to save a block
+  if ((blocks_super()->features & NUFS_FEATURE_COMPRESS) &&
+      COMPRESS_CLUSTER / BLOCK_SIZE >= 2) {
+    compress_blocks = COMPRESS_CLUSTER / BLOCK_SIZE;
+  }
+  pthread_mutex_unlock(&compress_lock);
+}
+
+// Stop compressing and drop the cache.
+void compress_free() {
+  pthread_mutex_lock(&compress_lock);
+  for (int ii = 0; ii < COMPRESS_CACHE_SLOTS; ++ii) {
+    free(compress_cache[ii].data);
+    memset(&compress_cache[ii], 0, sizeof(compress_buf_t));
+  }
+  compress_blocks = 0;
+  pthread_mutex_unlock(&compress_lock);
+}
+
+// Return whether the mounted image compresses file data.
+int compress_enabled() { return compress_blocks > 0; }
+
+// Return the number of blocks in a cluster.
+int compress_cluster_blocks() { return compress_blocks; }
+
+// Get the data of a compressed cluster, through the cache.
+const void *compress_get(int bnum, int *size, compress_buf_t **buf) {
+  pthread_mutex_lock(&compress_lock);
+  compress_buf_t *slot = 0;
+  compress_buf_t *victim = 0;
+  for (int ii = 0; ii < COMPRESS_CACHE_SLOTS && slot == 0; ++ii) {
+    compress_buf_t *cb = &compress_cache[ii];
+    if (cb->bnum == bnum) {
+      slot = cb;
+    } else if (cb->pins == 0 && (victim == 0 || cb->used < victim->used)) {
+      victim = cb;
+    }
+  }
+
+  if (slot != 0) {
+    compress_counts.hits++;
+    slot->pins++;
+    slot->used = ++compress_clock;
+    while (slot->loading) {
+      pthread_cond_wait(&compress_loaded, &compress_lock);
+    }
+    // whoever loaded it found the run corrupt
+    if (slot->bnum != bnum) {
+      slot->pins--;
+      pthread_mutex_unlock(&compress_lock);
+      return NULL;
+    }
+    pthread_mutex_unlock(&compress_lock);
+    *size = slot->size;
+    *buf = slot;
+    return slot->data;
+  }
+
+  // with every slot in use, the caller gets a buffer of its own
+  compress_counts.misses++;
+  if (victim == 0) {
+    victim = calloc(1, sizeof(compress_buf_t));
+    if (victim == 0) {
+      pthread_mutex_unlock(&compress_lock);
+      return NULL;
+    }
+    victim->spare = 1;
+  } else {
+    victim->bnum = bnum;
+    victim->loading = 1;
+  }
+  victim->pins = 1;
+  victim->used = ++compress_clock;
+  pthread_mutex_unlock(&compress_lock);
+
+  if (victim->data == 0) {
+    victim->data = malloc(COMPRESS_CLUSTER);
+  }
+  int rv = victim->data ? compress_load(bnum, victim->data, &victim->size)
+                        : -1;
+
+  pthread_mutex_lock(&compress_lock);
+  if (!victim->spare) {
+    victim->loading = 0;
+    victim->bnum = rv == 0 ? bnum : 0;
+    pthread_cond_broadcast(&compress_loaded);
+  }
+  pthread_mutex_unlock(&compress_lock);
+
+  if (rv != 0) {
+    compress_put(victim);
+    return NULL;
+  }
+  *size = victim->size;
+  *buf = victim;
+  return victim->data;
+}
+
+// Release a cluster returned by compress_get().
+void compress_put(compress_buf_t *buf) {
+  pthread_mutex_lock(&compress_lock);
+  buf->pins--;
+  int done = buf->spare && buf->pins == 0;
+  pthread_mutex_unlock(&compress_lock);
+
+  if (done) {
+    free(buf->data);
+    free(buf);
+  }
+}
+
+// Drop the cached data of a run.
+void compress_forget(int bnum) {
+  pthread_mutex_lock(&compress_lock);
+  for (int ii = 0; ii < COMPRESS_CACHE_SLOTS; ++ii) {
+    if (compress_cache[ii].bnum == bnum) {
+      compress_cache[ii].bnum = 0;
+    }
+  }
+  pthread_mutex_unlock(&compress_lock);
+}
+
+// Count a cluster being compressed or stored as is again.
+void compress_count(int blocks, int packed, int unpack) {
+  pthread_mutex_lock(&compress_lock);
+  if (unpack) {
+    compress_counts.unpacked++;
+    compress_counts.saved -= blocks - packed;
+  } else {
+    compress_counts.packed++;
+    compress_counts.saved += blocks - packed;
+  }
+  pthread_mutex_unlock(&compress_lock);
+}
+
+// Get the counters.
+void compress_stats(compress_stats_t *st) {
+  pthread_mutex_lock(&compress_lock);
+  *st = compress_counts;
+  pthread_mutex_unlock(&compress_lock);
+}
@@ -0,0 +1,134 @@
+/**
+ * @file compress.h
+ *
+ * Compression of file data in clusters.
+ *
+ * Images formatted with NUFS_FEATURE_COMPRESS store file data in clusters
+ * of COMPRESS_CLUSTER bytes: file blocks [c, c + compress_cluster_blocks())
+ * for each multiple c of compress_cluster_blocks(). A cluster is either
+ * stored as is, or compressed into a shorter run of blocks that the file
+ * maps at the start of the cluster, leaving the rest of the cluster a hole.
+ * The compress map (see blocks_compressed()) tells the two apart.
+ *
+ * A compressed run starts with a compress_header_t, followed by the
+ * cluster in a byte-oriented LZ77 format like LZ4's: each sequence is a
+ * token byte holding the number of literals (high nibble) and the match
+ * length minus COMPRESS_MIN_MATCH (low nibble), with 15 in a nibble
+ * continued by bytes that are added until one is below 255, then the
+ * literals, then the match's distance back as two little-endian bytes. The
+ * last sequence has only literals.
+ *
+ * Compressed runs are never written in place: a cluster that is written is
+ * decompressed into blocks of its own first. Reads decompress clusters into
+ * a small cache, so reading a cluster piece by piece decompresses it once.
+ */
+#ifndef COMPRESS_H
+#define COMPRESS_H
+
+#include <stdint.h>
+
+#define COMPRESS_CLUSTER 65536 // bytes of file data per cluster
+#define COMPRESS_MIN_MATCH 4
+#define COMPRESS_CACHE_SLOTS 32 // clusters kept decompressed
+
+typedef struct compress_header {
+  uint32_t packed; // bytes of compressed data after the header
+  uint32_t size;   // bytes of file data they decompress to
+} compress_header_t;
+
+/**
+ * A cluster decompressed by compress_get().
+ */
+typedef struct compress_buf compress_buf_t;
+
+/**
+ * Counters kept since the image was mounted.
+ */
+typedef struct compress_stats {
+  long packed;   // clusters compressed
+  long saved;    // blocks saved by compressing them
+  long unpacked; // compressed clusters stored as is again
+  long hits;     // reads of a cluster found in the cache
+  long misses;   // reads of a cluster that had to decompress it
+} compress_stats_t;
+
+/**
+ * Start compressing, if the mounted image was formatted for it.
+ */
+void compress_init();
+
+/**
+ * Stop compressing and drop the cache.
+ */
+void compress_free();
+
+/**
+ * Return whether the mounted image compresses file data.
+ *
+ * @return Nonzero if it does.
+ */
+int compress_enabled();
+
+/**
+ * Return the number of blocks in a cluster.
+ */
+int compress_cluster_blocks();
+
+/**
+ * Compress a cluster.
+ *
+ * @param src The file data.
+ * @param size Bytes of file data, at most COMPRESS_CLUSTER.
+ * @param dst Filled with a compress_header_t and the compressed data.
+ * @param cap Size of dst.
+ *
+ * @return The number of bytes used in dst, or -1 if they would not fit.
+ */
+int compress_pack(const void *src, int size, void *dst, int cap);
+
+/**
+ * Get the data of the compressed cluster in the run starting at bnum,
+ * decompressing it unless it is in the cache. The data stays valid until
+ * the cluster is released with compress_put(), and must not be written.
+ *
+ * @param bnum First block of the run, which must stay allocated until the
+ *        cluster is released.
+ * @param size Set to the bytes of file data in the cluster.
+ * @param buf Set to what to pass to compress_put().
+ *
+ * @return The data, or NULL if the run is not a valid compressed cluster.
+ */
+const void *compress_get(int bnum, int *size, compress_buf_t **buf);
+
+/**
+ * Release a cluster returned by compress_get().
+ *
+ * @param buf What compress_get() set.
+ */
+void compress_put(compress_buf_t *buf);
+
+/**
+ * Drop the cached data of the run starting at bnum, before a new
+ * compressed cluster is written there.
+ *
+ * @param bnum First block of the run.
+ */
+void compress_forget(int bnum);
+
+/**
+ * Count a cluster being compressed or stored as is again.
+ *
+ * @param blocks Blocks of file data in the cluster.
+ * @param packed Blocks its compressed run takes.
+ * @param unpack Nonzero if it was decompressed rather than compressed.
+ */
+void compress_count(int blocks, int packed, int unpack);
+
+/**
+ * Get the counters.
+ *
+ * @param st Filled in with the counters.
+ */
+void compress_stats(compress_stats_t *st);
+
+#endif
@@ -0,0 +1,82 @@
+/**
+ * @file dcache.c
+ *
+ * Directory lookup cache implementation.
+ */
+#include <pthread.h>
+#include <stdint.h>
+#include <string.h>
+
+#include "dcache.h"
+#include "directory.h"
+
+typedef struct dcache_entry {
+  int parent; // directory inum, 0 for an empty slot
+  int inum;   // -1 for a name known to be missing
+  uint32_t hash;
+  char name[DIR_NAME_LENGTH];
+  char _reserved[4];
+} dcache_entry_t;
+
+static dcache_entry_t dcache[DCACHE_SLOTS];
+
+// Slots are guarded by a fixed set of locks, slot i by lock i % DCACHE_LOCKS.
+// Callers already hold the directory's lock, so these only keep entries of
+// different directories that share a slot from tearing each other.
+#define DCACHE_LOCKS 64
+static pthread_mutex_t dcache_locks[DCACHE_LOCKS] = {
+    [0 ... DCACHE_LOCKS - 1] = PTHREAD_MUTEX_INITIALIZER};
+
+// Hash a (directory, name) pair, returning 0 if the name is too long to cache.
+static uint32_t dcache_hash(int parent, const char *name) {
+  uint32_t hash = 2166136261u ^ (uint32_t) parent;
+  int ii;
+  for (ii = 0; name[ii] && ii < DIR_NAME_LENGTH; ++ii) {
+    hash ^= (unsigned char) name[ii];
+    hash *= 16777619u;
+  }
+  if (ii == DIR_NAME_LENGTH) {
+    return 0;
+  }
+  return hash | 1;
+}
+
+// Drop every entry.
+void dcache_clear() { memset(dcache, 0, sizeof(dcache)); }
+
+// Look up a name in the cache.
+int dcache_lookup(int parent, const char *name, int *inum) {
+  uint32_t hash = dcache_hash(parent, name);
+  if (hash == 0) {
+    return 0;
+  }
+
+  int slot = hash & (DCACHE_SLOTS - 1);
+  dcache_entry_t *ent = &dcache[slot];
+  int hit = 0;
+  pthread_mutex_lock(&dcache_locks[slot % DCACHE_LOCKS]);
+  if (ent->hash == hash && ent->parent == parent &&
+      strcmp(ent->name, name) == 0) {
+    *inum = ent->inum;
+    hit = 1;
+  }
+  pthread_mutex_unlock(&dcache_locks[slot % DCACHE_LOCKS]);
+  return hit;
+}
+
+// Record what a name in a directory refers to.
+void dcache_set(int parent, const char *name, int inum) {
+  uint32_t hash = dcache_hash(parent, name);
+  if (hash == 0) {
+    return;
+  }
+
+  int slot = hash & (DCACHE_SLOTS - 1);
+  dcache_entry_t *ent = &dcache[slot];
+  pthread_mutex_lock(&dcache_locks[slot % DCACHE_LOCKS]);
+  ent->parent = parent;
+  ent->inum = inum;
+  ent->hash = hash;
+  strcpy(ent->name, name);
+  pthread_mutex_unlock(&dcache_locks[slot % DCACHE_LOCKS]);
+}
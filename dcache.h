@@ -0,0 +1,46 @@
+/**
+ * @file dcache.h
+ *
+ * An in-memory cache of directory lookups.
+ *
+ * Entries map a (directory inum, name) pair to the inum the name refers to.
+ * Names that are known to be missing are cached too, so repeated lookups of
+ * nonexistent paths do not have to search the directory. The directory
+ * layer keeps the cache exact: every directory_put() and directory_delete()
+ * updates the entry for the name it changed.
+ *
+ * The cache is a fixed-size, direct-mapped table; a new entry simply
+ * replaces whatever shared its slot.
+ */
+#ifndef DCACHE_H
+#define DCACHE_H
+
+#define DCACHE_SLOTS 16384 // must be a power of two
+
+/**
+ * Drop every entry, e.g. when a different image is mounted.
+ */
+void dcache_clear();
+
+/**
+ * Look up a name in the cache.
+ *
+ * @param parent Inode number of the directory.
+ * @param name Name of the entry.
+ * @param inum Set to the cached inum, or -1 if the name is known to be
+ *             missing.
+ *
+ * @return 1 on a hit, 0 if the cache knows nothing about the name.
+ */
+int dcache_lookup(int parent, const char *name, int *inum);
+
+/**
+ * Record what a name in a directory refers to.
+ *
+ * @param parent Inode number of the directory.
+ * @param name Name of the entry.
+ * @param inum Inode number the name refers to, or -1 if it does not exist.
+ */
+void dcache_set(int parent, const char *name, int inum);
+
+#endif
@@ -0,0 +1,141 @@
+/**
+ * @file dedup.c
+ *
+ * Content-hash index of data blocks.
+ */
+#include <pthread.h>
+#include <stdint.h>
+#include <string.h>
+
+#include "blocks.h"
+#include "dedup.h"
+#include "journal.h"
+
+#define DEDUP_PRIME 0xff51afd7ed558ccdULL
+
+// Serializes the index, its counters and the references it holds.
+static pthread_mutex_t dedup_lock = PTHREAD_MUTEX_INITIALIZER;
+static dedup_bucket_t *dedup_table = 0; // in the metadata mapping
+static uint64_t dedup_mask = 0;         // buckets - 1
+static dedup_stats_t dedup_counts;
+
+// Hash the contents of a block, four words at a time. A collision only
+// costs a comparison, so speed matters more than quality.
+static uint64_t dedup_hash(const void *block) {
+  const uint64_t *words = block;
+  uint64_t lanes[4] = {1, 2, 3, 4};
+  for (int ii = 0; ii < BLOCK_SIZE / 8; ii += 4) {
+    for (int ll = 0; ll < 4; ++ll) {
+      lanes[ll] = (lanes[ll] ^ words[ii + ll]) * DEDUP_PRIME;
+      lanes[ll] ^= lanes[ll] >> 29;
+    }
+  }
+  uint64_t hash = 0;
+  for (int ll = 0; ll < 4; ++ll) {
+    hash = (hash ^ lanes[ll]) * DEDUP_PRIME;
+    hash ^= hash >> 32;
+  }
+  return hash;
+}
+
+// Return the bucket a hash belongs in.
+static dedup_bucket_t *dedup_bucket(uint64_t hash) {
+  return &dedup_table[hash & dedup_mask];
+}
+
+// blocks_on_unshared() hook: drop a block from the index, and free it, if
+// the index is all that still holds it. The block only hashes to its
+// bucket if it is indexed, since indexed blocks never change.
+static void dedup_forget(int bnum) {
+  dedup_bucket_t *bucket = dedup_bucket(dedup_hash(blocks_get_block(bnum)));
+  int found = 0;
+  pthread_mutex_lock(&dedup_lock);
+  for (int ii = 0; ii < DEDUP_WAYS && !found; ++ii) {
+    dedup_entry_t *ent = &bucket->entries[ii];
+    if (ent->bnum == bnum && blocks_refs(bnum) == 1) {
+      memset(ent, 0, sizeof(*ent));
+      journal_dirty_range(ent, sizeof(*ent));
+      found = 1;
+    }
+  }
+  pthread_mutex_unlock(&dedup_lock);
+
+  // no file maps the block, and it can no longer be looked up
+  if (found) {
+    free_block(bnum);
+  }
+}
+
+// Start deduplicating, if the image was formatted for it.
+void dedup_init() {
+  superblock_t *sb = blocks_super();
+  memset(&dedup_counts, 0, sizeof(dedup_counts));
+  if (!(sb->features & NUFS_FEATURE_DEDUP)) {
+    dedup_table = 0;
+    return;
+  }
+
+  // the index is a power of two buckets, padded to whole blocks
+  long buckets = (long) sb->dedup_blocks * BLOCK_SIZE / sizeof(dedup_bucket_t);
+  uint64_t count = 1;
+  while (count * 2 <= buckets) {
+    count *= 2;
+  }
+  dedup_mask = count - 1;
+  dedup_table = blocks_get_meta(sb->dedup_start);
+  blocks_on_unshared(dedup_forget);
+}
+
+// Stop deduplicating.
+void dedup_free() {
+  blocks_on_unshared(0);
+  dedup_table = 0;
+}
+
+// Return whether the mounted image deduplicates file data.
+int dedup_enabled() { return dedup_table != 0; }
+
+// Share an indexed block with the same contents as bnum, or index bnum.
+int dedup_block(int bnum) {
+  const void *data = blocks_get_block(bnum);
+  uint64_t hash = dedup_hash(data);
+  dedup_bucket_t *bucket = dedup_bucket(hash);
+
+  int same = -1;
+  dedup_entry_t *unused = 0;
+  pthread_mutex_lock(&dedup_lock);
+  dedup_counts.lookups++;
+  for (int ii = 0; ii < DEDUP_WAYS && same < 0; ++ii) {
+    dedup_entry_t *ent = &bucket->entries[ii];
+    if (ent->bnum == 0) {
+      unused = unused ? unused : ent;
+    } else if (ent->hash == hash &&
+               memcmp(blocks_get_block(ent->bnum), data, BLOCK_SIZE) == 0) {
+      same = ent->bnum;
+      blocks_ref_range(same, 1);
+      dedup_counts.hits++;
+    }
+  }
+  if (same < 0 && unused != 0) {
+    unused->hash = hash;
+    unused->bnum = bnum;
+    journal_dirty_range(unused, sizeof(*unused));
+    blocks_ref_range(bnum, 1);
+    dedup_counts.indexed++;
+  }
+  pthread_mutex_unlock(&dedup_lock);
+
+  // the file that wrote the block may not have synced it yet
+  if (same >= 0 && blocks_sync_range(same, 1) != 0) {
+    free_block(same);
+    return -1;
+  }
+  return same;
+}
+
+// Get the counters.
+void dedup_stats(dedup_stats_t *st) {
+  pthread_mutex_lock(&dedup_lock);
+  *st = dedup_counts;
+  pthread_mutex_unlock(&dedup_lock);
+}
@@ -0,0 +1,90 @@
+/**
+ * @file dedup.h
+ *
+ * Block-level deduplication of file data.
+ *
+ * Images formatted with NUFS_FEATURE_DEDUP keep an index from the hash of
+ * a block's contents to the block. When a whole block of a file has been
+ * written, it is looked up in the index; if an indexed block holds the
+ * same bytes, the file maps that block instead and gives its own back.
+ * Otherwise the block joins the index.
+ *
+ * The index is a hash table of buckets, each a cache line of DEDUP_WAYS
+ * entries, stored in its own region of the image and journaled like the
+ * rest of the metadata. A hash only picks candidates: blocks are compared
+ * byte for byte before one is shared. A block whose bucket is full is not
+ * indexed.
+ *
+ * The index holds a reference to every block in it (see
+ * blocks_ref_range()), so an indexed block is always shared and never
+ * changes: a file that writes it gets a copy. A block that only the index
+ * still holds leaves the index and is freed.
+ */
+#ifndef DEDUP_H
+#define DEDUP_H
+
+#include <stdint.h>
+
+#define DEDUP_WAYS 4 // entries per bucket
+
+typedef struct dedup_entry {
+  uint64_t hash;
+  int bnum; // 0 for an unused entry
+  int _reserved;
+} dedup_entry_t;
+
+typedef struct dedup_bucket {
+  dedup_entry_t entries[DEDUP_WAYS];
+} dedup_bucket_t;
+
+/**
+ * Counters kept since the image was mounted.
+ */
+typedef struct dedup_stats {
+  long lookups; // whole blocks looked up
+  long hits;    // blocks replaced by an indexed block
+  long indexed; // blocks added to the index
+} dedup_stats_t;
+
+/**
+ * Start deduplicating, if the mounted image was formatted for it.
+ */
+void dedup_init();
+
+/**
+ * Stop deduplicating.
+ */
+void dedup_free();
+
+/**
+ * Return whether the mounted image deduplicates file data.
+ *
+ * @return Nonzero if it does.
+ */
+int dedup_enabled();
+
+/**
+ * Look up a block of file data that was just written and belongs to one
+ * file only.
+ *
+ * If an indexed block holds the same bytes, a reference to it is taken
+ * for the caller and it is returned; it has been written back, so a file
+ * that maps it can be synced without it. Otherwise bnum joins the index,
+ * if there is room, and -1 is returned.
+ *
+ * Must be called inside a journal handle.
+ *
+ * @param bnum The block.
+ *
+ * @return An indexed block with the same contents, or -1.
+ */
+int dedup_block(int bnum);
+
+/**
+ * Get the counters.
+ *
+ * @param st Filled in with the counters.
+ */
+void dedup_stats(dedup_stats_t *st);
+
+#endif
@@ -7,194 +7,591 @@
 #include <stdio.h>
 #include <string.h>
 #include <stdlib.h>
+#include <sys/stat.h>
 #include "blocks.h"
 #include "inode.h"
 #include "slist.h"
+#include "dcache.h"
+#include "icache.h"
+#include "journal.h"
+#include "trace.h"
 #include "directory.h"
 
-//initializes a directory at a pointer to a block
-void directory_init(void* block,  char* name, int this_inum, int parent_inum) { 
-    //at the beginning, put header
-    dir_header_t *header = (dir_header_t*) block;
-    strcpy(header->name, name);
-    header->num_entries = 2;
-    header->inode_num = this_inum;
-    
-    //first entry is itself
-    header++;
-    direntry_t *self = (direntry_t*) header;
-    strcpy(self->name, ".");
-    self->inum = this_inum;
+#define DIR_MAGIC 0x52494444 // "DDIR"
+#define DIR_MAX_DEPTH 8
+#define DIR_PROBE 16 // keys tried past a name's hash before giving up
+
+//a path from the root of the tree down to a leaf
+typedef struct dir_path {
+    dir_node_t *node[DIR_MAX_DEPTH + 1];
+    int fbnum[DIR_MAX_DEPTH + 1];
+    int idx[DIR_MAX_DEPTH + 1];
+    int levels;
+} dir_path_t;
 
-    //second entry is the parent
-    direntry_t *parent = self + 1;
-    strcpy(parent->name, "..");
-    parent->inum = parent_inum;
-    
+//node blocks set aside before an insert so a split can never fail halfway
+typedef struct dir_reserve {
+    int fbnum[DIR_MAX_DEPTH + 2];
+    int count;
+} dir_reserve_t;
+
+static dir_header_t *dir_header(inode_t *dd) {
+    return blocks_get_meta(inode_get_bnum(dd, 0));
 }
 
-//returns the inode number for some path(only checks the root for now)
-//returns -1 upon failure to find the path
-//TODO make recursive search
-int tree_lookup(const char *path) {
-    //root directory at block 2
-    fprintf(stderr, "tree lookup for path %s\n", path);
-    
-    
-    char* cpy = malloc(strlen(path));
-    //create copy for exploding
-    strcpy(cpy, path);
-    slist_t *list = s_explode(cpy, '/');
-    free(cpy);
-    slist_t *temp = list;
-
-    //check for the root, return inode 0
-    if(strcmp(path, "/") == 0) {
-        return 0;
+static dir_node_t *dir_node(inode_t *dd, int fbnum) {
+    return blocks_get_meta(inode_get_bnum(dd, fbnum));
+}
+
+//adds the block holding a header or node to the running journal
+//transaction; every change to a directory block must be marked
+static void dir_dirty(void *block) {
+    journal_dirty(blocks_meta_bnum(block));
+}
+
+static dirent_t *leaf_entries(dir_node_t *node) {
+    return (dirent_t*) (node + 1);
+}
+
+static dir_index_t *index_entries(dir_node_t *node) {
+    return (dir_index_t*) (node + 1);
+}
+
+static int entry_size(dir_node_t *node) {
+    return node->level == 0 ? sizeof(dirent_t) : sizeof(dir_index_t);
+}
+
+static int node_max(dir_node_t *node) {
+    return (BLOCK_SIZE - sizeof(dir_node_t)) / entry_size(node);
+}
+
+//key of the entry at the given position, in either kind of node
+static uint64_t node_key(dir_node_t *node, int pos) {
+    if(node->level == 0) {
+        return leaf_entries(node)[pos].key;
+    }
+    return index_entries(node)[pos].key;
+}
+
+//hashes a name into the key space above the reserved offsets
+static uint64_t dir_hash(const char *name) {
+    //FNV-1a, followed by a final mix so similar names spread out
+    uint64_t hash = 14695981039346656037ULL;
+    for(; *name; name++) {
+        hash ^= (unsigned char) *name;
+        hash *= 1099511628211ULL;
+    }
+    hash ^= hash >> 33;
+    hash *= 0xff51afd7ed558ccdULL;
+    hash ^= hash >> 33;
+
+    //leave room below 2^63 so keys + 1 are still valid offsets
+    return (hash >> 2) + DIR_FIRST_KEY;
+}
+
+//the last index entry whose key is <= key (or the first entry)
+static int index_search(dir_node_t *node, uint64_t key) {
+    dir_index_t *ents = index_entries(node);
+    int lo = 0;
+    int hi = node->count - 1;
+    while(lo < hi) {
+        int mid = (lo + hi + 1) / 2;
+        if(ents[mid].key <= key) {
+            lo = mid;
+        } else {
+            hi = mid - 1;
+        }
+    }
+    return lo;
+}
+
+//the first leaf entry whose key is >= key
+static int leaf_search(dir_node_t *node, uint64_t key) {
+    dirent_t *ents = leaf_entries(node);
+    int lo = 0;
+    int hi = node->count;
+    while(lo < hi) {
+        int mid = (lo + hi) / 2;
+        if(ents[mid].key < key) {
+            lo = mid + 1;
+        } else {
+            hi = mid;
+        }
+    }
+    return lo;
+}
+
+//walks from the root to the leaf where key belongs
+static void path_descend(inode_t *dd, uint64_t key, dir_path_t *path) {
+    int fbnum = dir_header(dd)->root;
+    for(int ll = 0; ; ll++) {
+        dir_node_t *node = dir_node(dd, fbnum);
+        path->node[ll] = node;
+        path->fbnum[ll] = fbnum;
+
+        if(node->level == 0) {
+            path->idx[ll] = leaf_search(node, key);
+            path->levels = ll + 1;
+            return;
+        }
+
+        int ii = index_search(node, key);
+        path->idx[ll] = ii;
+        fbnum = index_entries(node)[ii].child;
     }
-    inode_t *curr_inode = get_inode(0);
-    
-    int next_inum = directory_lookup(curr_inode, temp->data);
-    
-    //if there is a leading /, slist will give an empty entry at the start, 
-    //so if couldn't find try again
-    if(next_inum == -1) {
-        temp = temp->next;
-        next_inum = directory_lookup(curr_inode, temp->data);
-        if(temp->next == NULL) {
-            fprintf(stderr, "exiting here\n");
-            return next_inum;
+}
+
+//moves the path to the first entry of the next leaf, -1 if there is none
+static int path_next_leaf(inode_t *dd, dir_path_t *path) {
+    int ll = path->levels - 2;
+    while(ll >= 0 && path->idx[ll] + 1 >= path->node[ll]->count) {
+        ll--;
+    }
+    if(ll < 0) {
+        return -1;
+    }
+
+    path->idx[ll]++;
+    for(; ll < path->levels - 1; ll++) {
+        int fbnum = index_entries(path->node[ll])[path->idx[ll]].child;
+        path->node[ll + 1] = dir_node(dd, fbnum);
+        path->fbnum[ll + 1] = fbnum;
+        path->idx[ll + 1] = 0;
+    }
+    return 0;
+}
+
+//the entry the path points at, moving on to later leaves if needed
+static dirent_t *path_entry(inode_t *dd, dir_path_t *path) {
+    int leaf = path->levels - 1;
+    while(path->idx[leaf] >= path->node[leaf]->count) {
+        if(path_next_leaf(dd, path) != 0) {
+            return NULL;
         }
     }
+    return &leaf_entries(path->node[leaf])[path->idx[leaf]];
+}
+
+//the first entry with a key >= key, or NULL
+static dirent_t *path_find(inode_t *dd, uint64_t key, dir_path_t *path) {
+    path_descend(dd, key, path);
+    return path_entry(dd, path);
+}
+
+//the entry after the one the path points at, or NULL
+static dirent_t *path_next(inode_t *dd, dir_path_t *path) {
+    path->idx[path->levels - 1]++;
+    return path_entry(dd, path);
+}
+
+//finds the entry for a name, leaving the path pointing at it
+static dirent_t *dir_find(inode_t *dd, const char *name, dir_path_t *path) {
+    uint64_t hash = dir_hash(name);
+    dirent_t *ent = path_find(dd, hash, path);
+
+    //a colliding name may have been pushed to one of the following keys
+    while(ent != NULL && ent->key < hash + DIR_PROBE) {
+        if(strcmp(ent->name, name) == 0) {
+            return ent;
+        }
+        ent = path_next(dd, path);
+    }
+    return NULL;
+}
+
+//grows a directory to the given size with every block of it allocated,
+//since directory blocks are reached through the journal and cannot be holes
+static int dir_grow(inode_t *dd, long size) {
+    long old_size = dd->size;
+    if(grow_inode(dd, size) != 0 || inode_fill(dd, old_size, size) != 0) {
+        shrink_inode(dd, old_size);
+        return -1;
+    }
+    return 0;
+}
+
+//takes a node block off the free list, or grows the directory by a block
+static int dir_alloc_node(inode_t *dd) {
+    dir_header_t *header = dir_header(dd);
+    int fbnum = header->free_list;
+    if(fbnum != 0) {
+        header->free_list = dir_node(dd, fbnum)->next_free;
+        dir_dirty(header);
+        return fbnum;
+    }
+
+    fbnum = header->next_fbnum;
+    if(dir_grow(dd, (long) (fbnum + 1) * BLOCK_SIZE) != 0) {
+        return -1;
+    }
+    header->next_fbnum++;
+    dir_dirty(header);
+    return fbnum;
+}
+
+//puts a node block on the free list
+static void dir_free_node(inode_t *dd, int fbnum) {
+    dir_header_t *header = dir_header(dd);
+    dir_node_t *node = dir_node(dd, fbnum);
+    node->next_free = header->free_list;
+    header->free_list = fbnum;
+    dir_dirty(node);
+    dir_dirty(header);
+}
+
+//takes a block from the reserve and sets it up as an empty node
+static int reserve_take(inode_t *dd, dir_reserve_t *res, int level) {
+    int fbnum = res->fbnum[--res->count];
+    dir_node_t *node = dir_node(dd, fbnum);
+    node->count = 0;
+    node->level = level;
+    node->next_free = 0;
+    dir_dirty(node);
+    return fbnum;
+}
+
+//inserts an entry into a node that has room for it
+static void node_add(dir_node_t *node, int pos, const void *ent) {
+    int size = entry_size(node);
+    char *ents = (char*) (node + 1);
+    memmove(ents + (pos + 1) * size, ents + pos * size,
+            (node->count - pos) * size);
+    memcpy(ents + pos * size, ent, size);
+    node->count++;
+    dir_dirty(node);
+}
+
+//removes the entry at the given position of a node
+static void node_del(dir_node_t *node, int pos) {
+    int size = entry_size(node);
+    char *ents = (char*) (node + 1);
+    memmove(ents + pos * size, ents + (pos + 1) * size,
+            (node->count - pos - 1) * size);
+    node->count--;
+    dir_dirty(node);
+}
+
+//places an entry into a node, splitting the node in half if it is full.
+//returns 1 and fills in split with the new right node on a split
+static int node_place(inode_t *dd, dir_node_t *node, int pos, const void *ent,
+                      dir_index_t *split, dir_reserve_t *res) {
+    if(node->count < node_max(node)) {
+        node_add(node, pos, ent);
+        return 0;
+    }
+
+    int fbnum = reserve_take(dd, res, node->level);
+    dir_node_t *right = dir_node(dd, fbnum);
+    int size = entry_size(node);
+    int half = node->count / 2;
+
+    memcpy(right + 1, (char*) (node + 1) + half * size,
+           (node->count - half) * size);
+    right->count = node->count - half;
+    node->count = half;
+    dir_dirty(node);
+
+    if(pos <= half) {
+        node_add(node, pos, ent);
+    } else {
+        node_add(right, pos - half, ent);
+    }
 
-    curr_inode = get_inode(next_inum);
+    split->key = node_key(right, 0);
+    split->child = fbnum;
+    split->_reserved = 0;
+    return 1;
+}
+
+//inserts an entry into the subtree at fbnum, returning 1 if it split
+static int tree_insert(inode_t *dd, int fbnum, dirent_t *ent,
+                       dir_index_t *split, dir_reserve_t *res) {
+    dir_node_t *node = dir_node(dd, fbnum);
+    if(node->level == 0) {
+        return node_place(dd, node, leaf_search(node, ent->key), ent, split,
+                          res);
+    }
+
+    int ii = index_search(node, ent->key);
+    dir_index_t child_split;
+    if(tree_insert(dd, index_entries(node)[ii].child, ent, &child_split,
+                   res) == 0) {
+        return 0;
+    }
+    return node_place(dd, node, ii + 1, &child_split, split, res);
+}
+
+//initializes a new directory inode: a header block and an empty root leaf
+//returns 0 on success and -1 if the disk is full
+int directory_init(inode_t *dd, int this_inum, int parent_inum) {
+    if(dir_grow(dd, 2 * BLOCK_SIZE) != 0) {
+        return -1;
+    }
+
+    //at the beginning, put header
+    dir_header_t *header = dir_header(dd);
+    header->magic = DIR_MAGIC;
+    header->inode_num = this_inum;
+    header->parent_inum = parent_inum;
+    header->root = 1;
+    header->depth = 0;
+    header->num_entries = 0;
+    header->free_list = 0;
+    header->next_fbnum = 2;
+
+    dir_node_t *root = dir_node(dd, 1);
+    root->count = 0;
+    root->level = 0;
+    root->next_free = 0;
+    dir_dirty(header);
+    dir_dirty(root);
+    return 0;
+}
+
+//returns the inode number for some path, starting from the root
+//returns -1 upon failure to find the path
+int tree_lookup(const char *path) {
+    const char *rest = path;
+    char name[DIR_NAME_LENGTH];
+    int next_inum = blocks_super()->root_inum;
 
     //until we reach the last name in the path, continue to search through
-    //each directory
-    while (temp->next != NULL) {
-        temp = temp->next;
+    //each directory. Names are copied out of the path one at a time, so
+    //nothing is allocated; empty names (from a leading / or //) are skipped
+    int len;
+    while(next_inum >= 0 &&
+          (len = s_next_part(&rest, '/', name, DIR_NAME_LENGTH)) != 0) {
+        //a name too long for any directory entry can't exist
+        if(len < 0) {
+            next_inum = -1;
+            break;
+        }
         //if we reach a file that isn't a directory, we can't search it
-        //so return -1 to show an error
-        if(curr_inode->type != 1) {
-            fprintf(stderr, "tried to recursively lookup into not a directory\n");
-            return -1;
+        //so return -1 to show an error. Only one directory is locked at a
+        //time, and it may have been removed since we found it
+        int curr_inum = next_inum;
+        inode_t *curr_inode = get_inode(curr_inum);
+        icache_rdlock(curr_inum);
+        if(curr_inode->refs == 0) {
+            next_inum = -1;
+        } else if(!S_ISDIR(curr_inode->mode)) {
+            next_inum = -1;
+        } else {
+            next_inum = directory_lookup(curr_inode, name);
         }
-        next_inum = directory_lookup(curr_inode, temp->data);
-        curr_inode = get_inode(next_inum);
+        icache_unlock(curr_inum);
     }
-    s_free(list);
 
+    TRACE(TRACE_DEBUG, TRACE_OP_TREE_LOOKUP, 0, 0, 0, next_inum);
     return next_inum;
 }
 
-//returns the inode number for some path in the directory
-//returns -1 upon failure
+//returns the inode number for some name in the directory
+//returns -1 upon failure. The directory must be locked by the caller, as
+//for every function below that takes a directory inode
 int directory_lookup(inode_t *dd, const char *name) {
-    dir_header_t *header = blocks_get_block(dd->block);
-    int entries = header->num_entries;
-    fprintf(stderr, "looking for %s in directory %s\n", name, header->name);
+    dir_header_t *header = dir_header(dd);
 
-    //if looking for this directory
-    if(strcmp(name, "/") == 0) {
+    if(strcmp(name, ".") == 0) {
         return header->inode_num;
     }
+    if(strcmp(name, "..") == 0) {
+        return header->parent_inum;
+    }
 
-    // increment header by size of the header 
-    header++;
-
-    direntry_t *curr_entry = (direntry_t*) header;
-    //search every entry in the directory for a name match
-    for(int i = 0; i < entries; i++){
-        if(strcmp(curr_entry->name, name) == 0){
-            return curr_entry->inum;
-        }
-        //also support entering names as "/name" instead of just "name"
-        if(strcmp(curr_entry->name, (name + 1)) == 0 && *name == '/') {
-            return curr_entry->inum;
-        }
-        curr_entry++;		
+    //most lookups are answered by the cache, including misses. The trace
+    //records which ones were (offset 1) and which searched the tree
+    int inum;
+    if(dcache_lookup(header->inode_num, name, &inum)) {
+        TRACE(TRACE_DEBUG, TRACE_OP_DIR_LOOKUP, header->inode_num, 1, 0, inum);
+        return inum;
     }
-    return -1;
+
+    dir_path_t path;
+    dirent_t *ent = dir_find(dd, name, &path);
+    inum = ent != NULL ? ent->inum : -1;
+    dcache_set(header->inode_num, name, inum);
+    TRACE(TRACE_DEBUG, TRACE_OP_DIR_LOOKUP, header->inode_num, 0, 0, inum);
+    return inum;
 }
 
-//create a link between a name and inode number within a directory
+//create a link between a name and inode number within a directory. The
+//name must not be in the directory yet
+//returns 0 on success and -1 if the directory could not grow
 int directory_put(inode_t *dd, const char *name, int inum) {
-    fprintf(stderr, "putting \n");
-    dir_header_t *header = blocks_get_block(dd->block);
-    int n = header->num_entries;
-    header->num_entries++;
+    dir_header_t *header = dir_header(dd);
+
+    //use the first key at or after the name's hash that is not taken
+    uint64_t hash = dir_hash(name);
+    uint64_t key = hash;
+    dir_path_t path;
+    for(dirent_t *ent = path_find(dd, hash, &path);
+        ent != NULL && ent->key == key; ent = path_next(dd, &path)) {
+        key++;
+    }
+    if(key >= hash + DIR_PROBE) {
+        return -1;
+    }
+
+    //every full node on the way down may split, and so may a full root
+    path_descend(dd, key, &path);
+    dir_reserve_t res;
+    res.count = 0;
+    int full = 0;
+    while(full < path.levels &&
+          path.node[path.levels - 1 - full]->count ==
+              node_max(path.node[path.levels - 1 - full])) {
+        full++;
+    }
+    int need = full == path.levels ? full + 1 : full;
+    for(int ii = 0; ii < need; ii++) {
+        int fbnum = dir_alloc_node(dd);
+        if(fbnum < 0) {
+            while(res.count > 0) {
+                dir_free_node(dd, res.fbnum[--res.count]);
+            }
+            return -1;
+        }
+        res.fbnum[res.count++] = fbnum;
+    }
+
+    dirent_t ent;
+    memset(&ent, 0, sizeof(ent));
+    ent.key = key;
+    ent.inum = inum;
+    strncpy(ent.name, name, DIR_NAME_LENGTH - 1);
+
+    dir_index_t split;
+    if(tree_insert(dd, header->root, &ent, &split, &res) == 1) {
+        //the root split: a new root points at both halves
+        int fbnum = reserve_take(dd, &res, header->depth + 1);
+        dir_node_t *root = dir_node(dd, fbnum);
+        dir_index_t left = {0, header->root, 0};
+        node_add(root, 0, &left);
+        node_add(root, 1, &split);
+        header->root = fbnum;
+        header->depth++;
+    }
 
-    //find the next available spot in the directory
-    header++;
-    direntry_t *start = (direntry_t*) header;
-    direntry_t *end = start += n;
+    while(res.count > 0) {
+        dir_free_node(dd, res.fbnum[--res.count]);
+    }
+    header->num_entries++;
+    dir_dirty(header);
+    dcache_set(header->inode_num, name, inum);
+    TRACE(TRACE_DEBUG, TRACE_OP_DIR_PUT, header->inode_num, key, 0, inum);
 
-    //set the data
-    strcpy(end->name, name);
-    end->inum = inum;
-    
     //0 on success
     return 0;
 }
 
 //delete a name from a directory, return 0 on success and -1 on failure
 int directory_delete(inode_t *dd, const char *name) {
-    //get the header of the directory
-    dir_header_t *header = blocks_get_block(dd->block);
-    fprintf(stderr, "deleting %s from %s\n", name, header->name);
-    int n = header->num_entries;
-    direntry_t *start = (direntry_t*) (header + 1);
-    direntry_t *last = start + (n - 1);
-    direntry_t *curr = start;
-
-    //iterate through all entries except the last one for a name match
-    for(int i=0; i < n - 1; i++) {
-        fprintf(stderr, "checking %s\n", curr->name);
-        if(strcmp(curr->name, name) == 0) {
-            free_inode(curr->inum);
-            //to remove, and keep the directory neat, simply replace this reference
-            //with the last reference in the directory, and decrement the number of
-            //entries
-            strcpy(curr->name, last->name);
-            curr->inum = last->inum;
-            header->num_entries--;
-            return 0;
-        }
-        curr++;
+    dir_header_t *header = dir_header(dd);
+
+    dir_path_t path;
+    if(dir_find(dd, name, &path) == NULL) {
+        //could not find in the directory, return -1
+        TRACE(TRACE_DEBUG, TRACE_OP_DIR_DELETE, header->inode_num, 0, 0, -1);
+        return -1;
     }
-    //if it's the last element that needs to be removed, simply decrement
-    //the number of entries in the directory. All searches will stop before
-    //reaching this entry
-    if(strcmp(last->name, name) == 0 ) {
-        header->num_entries--;
+
+    //remove the entry, then any nodes left empty on the way up
+    int ll = path.levels - 1;
+    node_del(path.node[ll], path.idx[ll]);
+    while(ll > 0 && path.node[ll]->count == 0) {
+        dir_free_node(dd, path.fbnum[ll]);
+        ll--;
+        node_del(path.node[ll], path.idx[ll]);
+    }
+
+    //a root with a single child is replaced by that child
+    dir_node_t *root = dir_node(dd, header->root);
+    while(header->depth > 0 && root->count == 1) {
+        int child = index_entries(root)[0].child;
+        dir_free_node(dd, header->root);
+        header->root = child;
+        header->depth--;
+        root = dir_node(dd, child);
+    }
+
+    header->num_entries--;
+    dir_dirty(header);
+    dcache_set(header->inode_num, name, -1);
+    TRACE(TRACE_DEBUG, TRACE_OP_DIR_DELETE, header->inode_num, 0, 0, 0);
+    return 0;
+}
+
+//point ".." at a new parent, after the directory was moved
+void directory_set_parent(inode_t *dd, int parent_inum) {
+    dir_header_t *header = dir_header(dd);
+    header->parent_inum = parent_inum;
+    dir_dirty(header);
+}
+
+//returns the number of entries in a directory, not counting "." and ".."
+int directory_count(inode_t *dd) {
+    return dir_header(dd)->num_entries;
+}
+
+//calls fill for each entry of the directory, starting at the given offset.
+//the offsets passed to fill stay valid while entries are added or removed
+int directory_read(inode_t *dd, off_t offset, dir_filler_t fill, void *ctx) {
+    dir_header_t *header = dir_header(dd);
+    if(offset < 1 && fill(ctx, ".", header->inode_num, 1)) {
+        return 0;
+    }
+    if(offset < 2 && fill(ctx, "..", header->parent_inum, 2)) {
         return 0;
     }
-    //could not find in the directory, return -1
-    return -1;
+
+    uint64_t from = offset < DIR_FIRST_KEY ? DIR_FIRST_KEY : offset;
+    dir_path_t path;
+    for(dirent_t *ent = path_find(dd, from, &path); ent != NULL;
+        ent = path_next(dd, &path)) {
+        if(fill(ctx, ent->name, ent->inum, ent->key + 1)) {
+            break;
+        }
+    }
+    return 0;
+}
+
+//conses each name onto the list passed as ctx
+static int list_filler(void *ctx, const char *name, int inum, off_t next) {
+    slist_t **list = ctx;
+    *list = s_cons(name, *list);
+    return 0;
 }
 
 //retruns a linked list with the names of all files in this directory
+//returns NULL if the path is not a directory
 slist_t *directory_list(const char *path) {
-    fprintf(stderr, "dir list for path: %s\n", path);
     int inum = tree_lookup(path);
-    inode_t *node = get_inode(inum);
-    dir_header_t *header = blocks_get_block(node->block);
-    
-    //get the header of the directory
-    int n = header->num_entries;
-    header++;
-
-    //get the first entry
-    direntry_t *curr_entry = (direntry_t*) header;
-    slist_t *list = NULL;
+    if(inum < 0) {
+        return NULL;
+    }
 
-    //go through each entry, and cons the name onto the list to return
-    for(int i = 0; i < n; i++) {
-        list = s_cons(curr_entry->name, list);
-        curr_entry++;
+    slist_t *list = NULL;
+    inode_t *dd = get_inode(inum);
+    icache_rdlock(inum);
+    if(dd->refs > 0 && S_ISDIR(dd->mode)) {
+        directory_read(dd, 0, list_filler, &list);
     }
+    icache_unlock(inum);
     return list;
 }
 
-//void print_directory(inode_t *dd);
+//prints one entry of a directory
+static int print_filler(void *ctx, const char *name, int inum, off_t next) {
+    printf("  %-*s -> %d (next %ld)\n", DIR_NAME_LENGTH, name, inum,
+           (long) next);
+    return 0;
+}
 
+//prints the contents of a directory
+void print_directory(inode_t *dd) {
+    dir_header_t *header = dir_header(dd);
+    printf("directory %d: %d entries, depth %d, %d blocks\n", header->inode_num,
+           header->num_entries, header->depth, header->next_fbnum);
+    directory_read(dd, 0, print_filler, NULL);
+}
@@ -8,21 +8,69 @@
 
 #define DIR_NAME_LENGTH 48
 
+#include <stdint.h>
+#include <sys/types.h>
+
 #include "blocks.h"
 #include "inode.h"
 #include "slist.h"
 
-typedef struct dirent {
-  char name[DIR_NAME_LENGTH];
+// A directory is a B+tree stored in the directory's own file blocks, keyed
+// by a hash of the entry name. File block 0 holds the header; every other
+// block is a tree node. Keys double as readdir cookies: they never change
+// while an entry exists, so a listing can be resumed from any offset.
+
+// offsets 0, 1 and 2 are "start", "after ." and "after ..", so entry keys
+// start above them
+#define DIR_FIRST_KEY 3
+
+typedef struct dir_header {
+  int magic;       // DIR_MAGIC
+  int inode_num;   // inode of this directory
+  int parent_inum; // inode of the parent directory (for "..")
+  int root;        // file block of the root node
+  int depth;       // levels of index nodes above the leaves
+  int num_entries; // entries in the tree (not counting "." and "..")
+  int free_list;   // first free node block, 0 if none
+  int next_fbnum;  // first file block that was never used
+} dir_header_t;
+
+// Every tree node starts with this header.
+typedef struct dir_node {
+  int count;     // entries in use
+  int level;     // 0 for leaves
+  int next_free; // next block on the free list (free nodes only)
+  int _reserved;
+} dir_node_t;
+
+// leaf entries
+typedef struct dir_entry {
+  uint64_t key; // hash of the name, probed forward on collisions
   int inum;
-  char _reserved[12];
+  char name[DIR_NAME_LENGTH];
+  char _reserved[4];
 } dirent_t;
 
-void directory_init();
-int directory_lookup(inode_t *di, const char *name);
-int directory_put(inode_t *di, const char *name, int inum);
-int directory_delete(inode_t *di, const char *name);
+// index entries: the child holds keys >= key (up to the next entry's key)
+typedef struct dir_index {
+  uint64_t key;
+  int child; // file block of the child node
+  int _reserved;
+} dir_index_t;
+
+// Called by directory_read() for each entry; next is the offset to resume
+// the listing after this entry. Returns nonzero to stop the listing.
+typedef int (*dir_filler_t)(void *ctx, const char *name, int inum, off_t next);
+
+int directory_init(inode_t *dd, int this_inum, int parent_inum);
+int directory_lookup(inode_t *dd, const char *name);
+int directory_put(inode_t *dd, const char *name, int inum);
+int directory_delete(inode_t *dd, const char *name);
+void directory_set_parent(inode_t *dd, int parent_inum);
+int directory_count(inode_t *dd);
+int directory_read(inode_t *dd, off_t offset, dir_filler_t fill, void *ctx);
 slist_t *directory_list(const char *path);
 void print_directory(inode_t *dd);
+int tree_lookup(const char *path);
 
 #endif
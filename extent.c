@@ -0,0 +1,386 @@
+/**
+ * @file extent.c
+ *
+ * Extent tree implementation.
+ */
+#include <assert.h>
+#include <string.h>
+
+#include "blocks.h"
+#include "extent.h"
+#include "journal.h"
+
+// A root-to-leaf path through an extent tree.
+typedef struct extent_path {
+  extent_header_t *node[EXTENT_MAX_DEPTH + 1];
+  int bnum[EXTENT_MAX_DEPTH + 1]; // block holding the node (-1 for the root)
+  int idx[EXTENT_MAX_DEPTH + 1];  // entry followed (index) or found (leaf)
+  int levels;
+} extent_path_t;
+
+// Blocks set aside before an insert so that node splits cannot fail halfway.
+typedef struct extent_reserve {
+  int bnum[EXTENT_MAX_DEPTH + 1];
+  int count;
+} extent_reserve_t;
+
+static extent_t *node_entries(extent_header_t *node) {
+  return (extent_t *) (node + 1);
+}
+
+static extent_header_t *node_get(int bnum) { return blocks_get_meta(bnum); }
+
+// Add a node (inline root or block) to the running journal transaction.
+static void node_dirty(extent_header_t *node) {
+  journal_dirty_range(node,
+                      sizeof(extent_header_t) + node->max * sizeof(extent_t));
+}
+
+// Add every node on a path to the running journal transaction.
+static void path_dirty(extent_path_t *path) {
+  for (int ll = 0; ll < path->levels; ++ll) {
+    node_dirty(path->node[ll]);
+  }
+}
+
+// Initialize the header of a block-sized node.
+static void node_init_block(extent_header_t *node, int depth) {
+  extent_init(node, (BLOCK_SIZE - sizeof(extent_header_t)) / sizeof(extent_t));
+  node->depth = depth;
+}
+
+// Index of the child of an index node that may contain fbnum.
+static int index_search(extent_header_t *node, int fbnum) {
+  extent_t *ents = node_entries(node);
+  int lo = 0;
+  int hi = node->entries - 1;
+
+  // find the last entry whose key is <= fbnum
+  while (lo < hi) {
+    int mid = (lo + hi + 1) / 2;
+    if (ents[mid].fbnum <= fbnum) {
+      lo = mid;
+    } else {
+      hi = mid - 1;
+    }
+  }
+  return lo;
+}
+
+// Index of the first extent in a leaf that ends after fbnum.
+static int leaf_search(extent_header_t *node, int fbnum) {
+  extent_t *ents = node_entries(node);
+  int lo = 0;
+  int hi = node->entries;
+
+  while (lo < hi) {
+    int mid = (lo + hi) / 2;
+    if (ents[mid].fbnum + ents[mid].len <= fbnum) {
+      lo = mid + 1;
+    } else {
+      hi = mid;
+    }
+  }
+  return lo;
+}
+
+// Walk from the root to the leaf that may contain fbnum.
+static void path_descend(extent_header_t *root, int fbnum,
+                         extent_path_t *path) {
+  extent_header_t *node = root;
+  int bnum = -1;
+
+  for (int ll = 0;; ++ll) {
+    assert(ll <= EXTENT_MAX_DEPTH);
+    path->node[ll] = node;
+    path->bnum[ll] = bnum;
+
+    if (node->depth == 0) {
+      path->idx[ll] = leaf_search(node, fbnum);
+      path->levels = ll + 1;
+      return;
+    }
+
+    int ii = index_search(node, fbnum);
+    path->idx[ll] = ii;
+    bnum = node_entries(node)[ii].bnum;
+    node = node_get(bnum);
+  }
+}
+
+// Move the path to the first entry of the next leaf.
+// Returns -1 if the path is already at the last leaf.
+static int path_next_leaf(extent_path_t *path) {
+  int ll = path->levels - 2;
+  while (ll >= 0 && path->idx[ll] + 1 >= path->node[ll]->entries) {
+    ll--;
+  }
+  if (ll < 0) {
+    return -1;
+  }
+
+  path->idx[ll]++;
+  for (; ll < path->levels - 1; ++ll) {
+    int bnum = node_entries(path->node[ll])[path->idx[ll]].bnum;
+    path->node[ll + 1] = node_get(bnum);
+    path->bnum[ll + 1] = bnum;
+    path->idx[ll + 1] = 0;
+  }
+  return 0;
+}
+
+// Find the first extent ending after fbnum, leaving the path pointing at it.
+static extent_t *path_find(extent_header_t *root, int fbnum,
+                           extent_path_t *path) {
+  path_descend(root, fbnum, path);
+
+  int leaf = path->levels - 1;
+  while (path->idx[leaf] >= path->node[leaf]->entries) {
+    if (path_next_leaf(path) != 0) {
+      return 0;
+    }
+  }
+  return &node_entries(path->node[leaf])[path->idx[leaf]];
+}
+
+// Insert an entry at the given position of a node that has room for it.
+static void node_add(extent_header_t *node, int pos, extent_t *ext) {
+  extent_t *ents = node_entries(node);
+  memmove(ents + pos + 1, ents + pos, (node->entries - pos) * sizeof(extent_t));
+  ents[pos] = *ext;
+  node->entries++;
+}
+
+// Remove the entry at the given position of a node.
+static void node_del(extent_header_t *node, int pos) {
+  extent_t *ents = node_entries(node);
+  memmove(ents + pos, ents + pos + 1,
+          (node->entries - pos - 1) * sizeof(extent_t));
+  node->entries--;
+}
+
+// Take a block from the reserve and turn it into an empty node.
+static int reserve_take(extent_reserve_t *res, int depth) {
+  assert(res->count > 0);
+  int bnum = res->bnum[--res->count];
+  node_init_block(node_get(bnum), depth);
+  node_dirty(node_get(bnum));
+  return bnum;
+}
+
+// Place an entry into a node, splitting the node if it is full.
+// Returns 0 if the entry fit, or 1 if the node split and *split holds the
+// index entry for the new right sibling. The root never splits; its
+// entries move down into a new child instead.
+static int node_place(extent_header_t *node, int pos, extent_t *ext,
+                      extent_t *split, int is_root, extent_reserve_t *res) {
+  if (node->entries < node->max) {
+    node_add(node, pos, ext);
+    return 0;
+  }
+
+  if (is_root) {
+    int bnum = reserve_take(res, node->depth);
+    extent_header_t *child = node_get(bnum);
+    memcpy(node_entries(child), node_entries(node),
+           node->entries * sizeof(extent_t));
+    child->entries = node->entries;
+    node_add(child, pos, ext);
+
+    extent_t link = {node_entries(child)[0].fbnum, bnum, 0};
+    node->depth++;
+    node->entries = 0;
+    node_add(node, 0, &link);
+    return 0;
+  }
+
+  int bnum = reserve_take(res, node->depth);
+  extent_header_t *right = node_get(bnum);
+
+  // appends leave the left node full; other inserts split it in half
+  int half = pos == node->entries ? pos : node->entries / 2;
+  memcpy(node_entries(right), node_entries(node) + half,
+         (node->entries - half) * sizeof(extent_t));
+  right->entries = node->entries - half;
+  node->entries = half;
+
+  if (pos <= half && pos < node->max) {
+    node_add(node, pos, ext);
+  } else {
+    node_add(right, pos - half, ext);
+  }
+
+  split->fbnum = node_entries(right)[0].fbnum;
+  split->bnum = bnum;
+  split->len = 0;
+  return 1;
+}
+
+// Do the runs a and b follow each other both in the file and on disk?
+static int contiguous(extent_t *a, extent_t *b) {
+  return a->fbnum + a->len == b->fbnum && a->bnum + a->len == b->bnum;
+}
+
+// Insert an extent into the subtree rooted at node.
+// Returns 0, or 1 if the node split (see node_place()).
+static int tree_insert(extent_header_t *node, extent_t *ext, extent_t *split,
+                       int is_root, extent_reserve_t *res) {
+  extent_t *ents = node_entries(node);
+
+  if (node->depth > 0) {
+    // keys are lower bounds of their subtrees and may have gone stale
+    // through removals; widen them so lookups find the new extent
+    int ii = index_search(node, ext->fbnum);
+    if (ext->fbnum < ents[ii].fbnum) {
+      ents[ii].fbnum = ext->fbnum;
+    }
+    if (ii + 1 < node->entries && ents[ii + 1].fbnum < ext->fbnum + ext->len) {
+      ents[ii + 1].fbnum = ext->fbnum + ext->len;
+    }
+
+    extent_t child_split;
+    int rv = tree_insert(node_get(ents[ii].bnum), ext, &child_split, 0, res);
+    if (rv == 0) {
+      return 0;
+    }
+    return node_place(node, ii + 1, &child_split, split, is_root, res);
+  }
+
+  int pos = leaf_search(node, ext->fbnum);
+  extent_t *prev = pos > 0 ? &ents[pos - 1] : 0;
+  extent_t *next = pos < node->entries ? &ents[pos] : 0;
+
+  if (prev && contiguous(prev, ext)) {
+    prev->len += ext->len;
+    if (next && contiguous(prev, next)) {
+      prev->len += next->len;
+      node_del(node, pos);
+    }
+    return 0;
+  }
+
+  if (next && contiguous(ext, next)) {
+    next->fbnum = ext->fbnum;
+    next->bnum = ext->bnum;
+    next->len += ext->len;
+    return 0;
+  }
+
+  return node_place(node, pos, ext, split, is_root, res);
+}
+
+// Delete the leaf entry the path points at, freeing nodes that become empty.
+static void path_delete(extent_path_t *path) {
+  int ll = path->levels - 1;
+  node_del(path->node[ll], path->idx[ll]);
+
+  while (ll > 0 && path->node[ll]->entries == 0) {
+    free_block(path->bnum[ll]);
+    ll--;
+    node_del(path->node[ll], path->idx[ll]);
+  }
+
+  // an empty root goes back to being a leaf
+  if (path->node[0]->entries == 0) {
+    path->node[0]->depth = 0;
+  }
+}
+
+// Initialize an empty extent tree root.
+void extent_init(extent_header_t *root, int max) {
+  root->entries = 0;
+  root->max = max;
+  root->depth = 0;
+  root->_reserved = 0;
+}
+
+// Find the first extent that ends after the given file block.
+int extent_find(extent_header_t *root, int fbnum, extent_t *ext) {
+  extent_path_t path;
+  extent_t *found = path_find(root, fbnum, &path);
+  if (found == 0) {
+    return -1;
+  }
+  *ext = *found;
+  return 0;
+}
+
+// Map a run of file blocks to a run of disk blocks.
+int extent_insert(extent_header_t *root, int fbnum, int bnum, int len) {
+  extent_path_t path;
+  path_descend(root, fbnum, &path);
+
+  // every full node on the way up from the leaf may need a new block
+  extent_reserve_t res;
+  res.count = 0;
+  for (int ll = path.levels - 1;
+       ll >= 0 && path.node[ll]->entries == path.node[ll]->max; --ll) {
+    int bnum = alloc_block();
+    if (bnum < 0) {
+      while (res.count > 0) {
+        free_block(res.bnum[--res.count]);
+      }
+      return -1;
+    }
+    res.bnum[res.count++] = bnum;
+  }
+
+  // the insert only changes nodes on the path and nodes from the reserve
+  path_dirty(&path);
+
+  extent_t ext = {fbnum, bnum, len};
+  extent_t split;
+  tree_insert(root, &ext, &split, 1, &res);
+
+  // the insert may have merged without splitting anything
+  while (res.count > 0) {
+    free_block(res.bnum[--res.count]);
+  }
+  return 0;
+}
+
+// Unmap a range of file blocks.
+int extent_remove(extent_header_t *root, int fbnum, int len,
+                  extent_release_t release) {
+  long end = (long) fbnum + len;
+  extent_path_t path;
+
+  for (;;) {
+    extent_t *ext = path_find(root, fbnum, &path);
+    if (ext == 0 || ext->fbnum >= end) {
+      return 0;
+    }
+    path_dirty(&path);
+
+    long ext_end = (long) ext->fbnum + ext->len;
+    int start = fbnum > ext->fbnum ? fbnum : ext->fbnum;
+    int stop = end < ext_end ? end : ext_end;
+
+    if (start > ext->fbnum && stop < ext_end) {
+      // the range is inside this extent: keep the head, re-insert the tail
+      int old_len = ext->len;
+      int head = start - ext->fbnum;
+      int tail_bnum = ext->bnum + (stop - ext->fbnum);
+      int hole_bnum = ext->bnum + head;
+      ext->len = head;
+      if (extent_insert(root, stop, tail_bnum, ext_end - stop) != 0) {
+        ext->len = old_len;
+        return -1;
+      }
+      release(hole_bnum, stop - start);
+      return 0;
+    }
+
+    release(ext->bnum + (start - ext->fbnum), stop - start);
+
+    if (start == ext->fbnum && stop == ext_end) {
+      path_delete(&path);
+    } else if (start == ext->fbnum) {
+      ext->bnum += stop - ext->fbnum;
+      ext->len = ext_end - stop;
+      ext->fbnum = stop;
+    } else {
+      ext->len = start - ext->fbnum;
+    }
+  }
+}
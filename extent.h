@@ -0,0 +1,84 @@
+/**
+ * @file extent.h
+ *
+ * Extent trees mapping file blocks to runs of disk blocks.
+ *
+ * An extent maps a run of consecutive file blocks to consecutive disk
+ * blocks. The extents of a file are kept in a B+tree ordered by file block.
+ * The root node lives inline in the inode; when it fills up, its entries
+ * are pushed down into a block and the root becomes an index node.
+ *
+ * Every node starts with an extent_header_t followed by its entries. Leaf
+ * entries (depth 0) are extents; index entries use the same layout, with
+ * fbnum the smallest file block in the child and bnum the child's block.
+ */
+#ifndef EXTENT_H
+#define EXTENT_H
+
+#define EXTENT_MAX_DEPTH 5
+
+typedef struct extent {
+  int fbnum; // first file block covered by this extent
+  int bnum;  // first disk block (or child node block for index entries)
+  int len;   // number of blocks in the run (unused for index entries)
+} extent_t;
+
+typedef struct extent_header {
+  short entries; // number of entries in use
+  short max;     // number of entries that fit in this node
+  short depth;   // 0 for leaves, height above the leaves otherwise
+  short _reserved;
+} extent_header_t;
+
+/**
+ * Callback used to hand back the disk blocks of removed extents.
+ *
+ * @param bnum First disk block of the run.
+ * @param len Number of blocks in the run.
+ */
+typedef void (*extent_release_t)(int bnum, int len);
+
+/**
+ * Initialize an empty extent tree root with room for max entries.
+ *
+ * @param root The root node (followed in memory by its entries).
+ * @param max Number of entries that fit after the header.
+ */
+void extent_init(extent_header_t *root, int max);
+
+/**
+ * Find the first extent that ends after the given file block.
+ *
+ * The returned extent contains fbnum if ext->fbnum <= fbnum; otherwise
+ * fbnum is not mapped and the extent is the next mapped run after it.
+ *
+ * @param root Root of the extent tree.
+ * @param fbnum File block number.
+ * @param ext Filled with a copy of the extent found.
+ *
+ * @return 0 if an extent was found, -1 if no extent ends after fbnum.
+ */
+int extent_find(extent_header_t *root, int fbnum, extent_t *ext);
+
+/**
+ * Map the file blocks [fbnum, fbnum + len) to the disk blocks starting at
+ * bnum. The range must not overlap an existing extent. The new extent is
+ * merged with its neighbours when both file and disk blocks are contiguous.
+ *
+ * @return 0 on success, -1 if a tree node could not be allocated.
+ */
+int extent_insert(extent_header_t *root, int fbnum, int bnum, int len);
+
+/**
+ * Unmap the file blocks [fbnum, fbnum + len).
+ *
+ * The disk blocks that were mapped in the range are passed to release.
+ * Tree nodes that become empty are freed.
+ *
+ * @return 0 on success, -1 if splitting an extent needed a new tree node
+ *         and none could be allocated (nothing is unmapped in that case).
+ */
+int extent_remove(extent_header_t *root, int fbnum, int len,
+                  extent_release_t release);
+
+#endif
@@ -26,5 +26,23 @@ int main(int argc, char **argv) {
   bitmap_put(bm, 255, 1);
   bitmap_print(bm, SIZE);
 
+  bitmap_summary_t bs;
+  bitmap_summary_init(&bs, bm, SIZE);
+  printf("\nFree bits: %d (expect %d)\n", bs.free, SIZE - 4);
+
+  printf("\nAllocating from bit 60 (expect 60): %d\n",
+         bitmap_summary_alloc(&bs, 60));
+
+  int len;
+  int start = bitmap_summary_alloc_range(&bs, 0, 100, &len);
+  printf("\nAllocating a run of 100 (expect 66+100): %d+%d\n", start, len);
+  bitmap_print(bm, SIZE);
+
+  bitmap_summary_put(&bs, 0, SIZE, 1);
+  printf("\nAllocating from a full bitmap (expect -1): %d\n",
+         bitmap_summary_alloc(&bs, 0));
+
+  bitmap_summary_destroy(&bs);
+
   return 0;
 }
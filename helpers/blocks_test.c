@@ -2,10 +2,14 @@
 
 #include "bitmap.h"
 #include "blocks.h"
+#include "inode.h"
 
 #define TEST_NAME "block_test.img"
 
 int main(int argc, char **argv) {
+  blocks_format(TEST_NAME, NUFS_DEFAULT_BLOCK_SIZE, NUFS_DEFAULT_BLOCK_COUNT,
+                NUFS_DEFAULT_INODE_COUNT, sizeof(inode_t), NUFS_DEFAULT_JOURNAL,
+                0);
   blocks_init(TEST_NAME);
 
   printf("Block bitmap at the beginning:\n");
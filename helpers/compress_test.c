@@ -0,0 +1,93 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "blocks.h"
+#include "compress.h"
+#include "inode.h"
+
+#define TEST_NAME "compress_test.img"
+
+static char text[COMPRESS_CLUSTER];
+static char noise[COMPRESS_CLUSTER];
+static char packed[COMPRESS_CLUSTER];
+
+// Copy a compressed cluster into a fresh run, returning its first block.
+static int store(const void *data, int len) {
+  int got;
+  int bnum = alloc_block_range(bytes_to_blocks(len), &got);
+  memcpy(blocks_get_block(bnum), data, len);
+  compress_forget(bnum);
+  return bnum;
+}
+
+// Decompress the run at bnum and compare it with want.
+static int matches(int bnum, const char *want, int size) {
+  int got;
+  compress_buf_t *buf;
+  const char *data = compress_get(bnum, &got, &buf);
+  if (data == NULL) {
+    return 0;
+  }
+  int same = got == size && memcmp(data, want, size) == 0;
+  compress_put(buf);
+  return same;
+}
+
+int main(int argc, char **argv) {
+  blocks_format(TEST_NAME, NUFS_DEFAULT_BLOCK_SIZE, NUFS_DEFAULT_BLOCK_COUNT,
+                NUFS_DEFAULT_INODE_COUNT, sizeof(inode_t), NUFS_DEFAULT_JOURNAL,
+                NUFS_FEATURE_COMPRESS);
+  blocks_init(TEST_NAME);
+  compress_init();
+  printf("Blocks per cluster: %d\n", compress_cluster_blocks());
+
+  int len = 0;
+  for (int ii = 0; len < COMPRESS_CLUSTER; ++ii) {
+    len += snprintf(text + len, COMPRESS_CLUSTER - len, "line %d of text\n",
+                    ii % 1000);
+  }
+  srand(42);
+  for (int ii = 0; ii < COMPRESS_CLUSTER; ++ii) {
+    noise[ii] = rand();
+  }
+  int cap = COMPRESS_CLUSTER - BLOCK_SIZE;
+
+  len = compress_pack(text, COMPRESS_CLUSTER, packed, cap);
+  printf("\nText packed into %d bytes (expect far fewer than %d)\n", len,
+         COMPRESS_CLUSTER);
+  int bnum = store(packed, len);
+  printf("Read back (expect 1): %d\n", matches(bnum, text, COMPRESS_CLUSTER));
+  printf("Read back again (expect 1): %d\n",
+         matches(bnum, text, COMPRESS_CLUSTER));
+
+  printf("\nNoise packed (expect -1): %d\n",
+         compress_pack(noise, COMPRESS_CLUSTER, packed, cap));
+
+  int short_len = compress_pack(text, 1000, packed, cap);
+  int short_bnum = store(packed, short_len);
+  printf("Part of a cluster read back (expect 1): %d\n",
+         matches(short_bnum, text, 1000));
+
+  compress_header_t *hdr = blocks_get_block(short_bnum);
+  int whole = hdr->packed;
+  hdr->packed = whole / 2;
+  compress_forget(short_bnum);
+  printf("\nRun cut short read back (expect 0): %d\n",
+         matches(short_bnum, text, 1000));
+  hdr->packed = whole;
+  hdr->size = COMPRESS_CLUSTER + 1;
+  compress_forget(short_bnum);
+  printf("Run claiming too much data read back (expect 0): %d\n",
+         matches(short_bnum, text, 1000));
+
+  compress_stats_t st;
+  compress_stats(&st);
+  printf("\nCache hits %ld (expect 1), misses %ld (expect 4)\n", st.hits,
+         st.misses);
+
+  compress_free();
+  blocks_free();
+
+  return 0;
+}
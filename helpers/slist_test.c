@@ -26,6 +26,15 @@ int main(int argc, char **argv) {
 
   print_list(list2);
 
+  // Walk a path without building a list
+  const char *path = "//usr/local//share/";
+  printf("\nParts of \"%s\":\n", path);
+  char part[16];
+  const char *rest = path;
+  while (s_next_part(&rest, '/', part, sizeof(part)) > 0) {
+    printf("%s\n", part);
+  }
+
   s_free(list1);
   s_free(list2);
   return 0;
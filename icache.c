@@ -0,0 +1,76 @@
+/**
+ * @file icache.c
+ *
+ * In-core inode table implementation.
+ */
+#include <assert.h>
+#include <stdlib.h>
+
+#include "icache.h"
+
+static icache_entry_t **icache = 0;
+static int icache_count = 0;
+
+// Set up an empty table for the given number of inodes.
+void icache_init(int count) {
+  icache = calloc(count, sizeof(icache_entry_t *));
+  assert(icache != 0);
+  icache_count = count;
+}
+
+// Free the table and every entry in it.
+void icache_free() {
+  for (int ii = 0; ii < icache_count; ++ii) {
+    if (icache[ii] != 0) {
+      pthread_rwlock_destroy(&icache[ii]->lock);
+      blocks_dirty_destroy(&icache[ii]->dirty);
+      free(icache[ii]);
+    }
+  }
+  free(icache);
+  icache = 0;
+  icache_count = 0;
+}
+
+// Get the in-core entry of an inode, allocating it on first use.
+icache_entry_t *icache_get(int inum) {
+  assert(inum >= 0 && inum < icache_count);
+  icache_entry_t *ent = __atomic_load_n(&icache[inum], __ATOMIC_ACQUIRE);
+  if (ent != 0) {
+    return ent;
+  }
+
+  icache_entry_t *fresh = malloc(sizeof(icache_entry_t));
+  assert(fresh != 0);
+  pthread_rwlock_init(&fresh->lock, 0);
+  blocks_dirty_init(&fresh->dirty);
+  fresh->opens = 0;
+  fresh->lookups = 0;
+  fresh->tail_written = 0;
+
+  // another thread may have installed an entry first; use that one
+  if (!__atomic_compare_exchange_n(&icache[inum], &ent, fresh, 0,
+                                   __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE)) {
+    pthread_rwlock_destroy(&fresh->lock);
+    blocks_dirty_destroy(&fresh->dirty);
+    free(fresh);
+    return ent;
+  }
+  return fresh;
+}
+
+// Lock an inode for reading. Locking it again while holding it for writing
+// is a bug, which would otherwise be an ignored EDEADLK.
+void icache_rdlock(int inum) {
+  int rv = pthread_rwlock_rdlock(&icache_get(inum)->lock);
+  assert(rv == 0);
+}
+
+// Lock an inode for writing. Locking it again while holding it is a bug.
+void icache_wrlock(int inum) {
+  int rv = pthread_rwlock_wrlock(&icache_get(inum)->lock);
+  assert(rv == 0);
+}
+
+// Release an inode lock.
+void icache_unlock(int inum) { pthread_rwlock_unlock(&icache_get(inum)->lock); }
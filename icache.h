@@ -0,0 +1,79 @@
+/**
+ * @file icache.h
+ *
+ * The in-core inode table: per-inode state that only exists while the
+ * filesystem is mounted.
+ *
+ * Entries are indexed by inum and allocated the first time an inode is
+ * used, so mounting a large image costs one pointer per inode up front.
+ * Entries are never freed while mounted, so a pointer to one stays valid
+ * even after its inode is deallocated and reused.
+ *
+ * Each entry holds the inode's reader-writer lock, the set of its data
+ * blocks that were written but not synced yet, how many times the file is
+ * open, and how many references to it the kernel holds (its FUSE lookup
+ * count). An inode with no links stays allocated while it is open or the
+ * kernel still knows it, so its inum is not reused under the kernel's
+ * feet. A directory's lock also protects its entries. When an operation
+ * needs more than one inode lock, it takes parents before children, and
+ * takes the two parents of a rename in inum order.
+ */
+#ifndef ICACHE_H
+#define ICACHE_H
+
+#include <pthread.h>
+
+#include "blocks.h"
+
+typedef struct icache_entry {
+  pthread_rwlock_t lock;
+  blocks_dirty_t dirty; // has its own lock; see blocks_mark_dirty()
+  int opens;            // open file handles; changed under the write lock
+  long lookups;         // the kernel's references; see storage_ref_ino()
+  int tail_written;     // last cluster written since the last close; see
+                        // storage_close_ino()
+} icache_entry_t;
+
+/**
+ * Set up an empty table for the given number of inodes.
+ *
+ * @param count Number of inodes in the mounted image.
+ */
+void icache_init(int count);
+
+/**
+ * Free the table and every entry in it.
+ */
+void icache_free();
+
+/**
+ * Get the in-core entry of an inode, allocating it on first use.
+ *
+ * @param inum Inode number.
+ *
+ * @return The entry; never NULL.
+ */
+icache_entry_t *icache_get(int inum);
+
+/**
+ * Lock an inode for reading (shared with other readers).
+ *
+ * @param inum Inode number.
+ */
+void icache_rdlock(int inum);
+
+/**
+ * Lock an inode for writing (exclusive).
+ *
+ * @param inum Inode number.
+ */
+void icache_wrlock(int inum);
+
+/**
+ * Release a lock taken by icache_rdlock() or icache_wrlock().
+ *
+ * @param inum Inode number.
+ */
+void icache_unlock(int inum);
+
+#endif
@@ -1,11 +1,36 @@
+#include <limits.h>
+#include <pthread.h>
+#include <stddef.h>
 #include <stdint.h>
 #include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <time.h>
 
 #include "inode.h"
 #include "blocks.h"
 #include "bitmap.h"
+#include "compress.h"
+#include "dedup.h"
+#include "extent.h"
+#include "journal.h"
 
-//the second block is the inode block
+//the inode table starts at the block recorded in the superblock
+
+//only one thread at a time may touch the inode bitmap and inode_hint
+static pthread_mutex_t inode_alloc_lock = PTHREAD_MUTEX_INITIALIZER;
+
+//the extent tree code expects a node's entries right after its header
+_Static_assert(offsetof(inode_t, extents) ==
+               offsetof(inode_t, emap) + sizeof(extent_header_t),
+               "inline extents must follow the extent header");
+_Static_assert(sizeof(inode_t) == INODE_SIZE,
+               "inode records have a fixed size");
+_Static_assert((INODE_SIZE & (INODE_SIZE - 1)) == 0,
+               "inode records must not straddle a page");
+_Static_assert(offsetof(inode_t, data) == INODE_HEADER,
+               "the fixed part of an inode fills its first cache line");
 
 void print_inode(inode_t *node) {
     return;
@@ -13,30 +38,786 @@ void print_inode(inode_t *node) {
 
 //gets the inode at an inum
 inode_t *get_inode(int inum) {
-    return (inode_t*) blocks_get_block(1) + (inum * sizeof(inode_t));
+    superblock_t *sb = blocks_super();
+    uint8_t *table = blocks_get_meta(sb->inode_table_start);
+    return (inode_t*) (table + (long) inum * sb->inode_size);
+}
+
+//adds the blocks holding an inode to the running journal transaction
+void inode_dirty(inode_t *node) {
+    journal_dirty_range(node, sizeof(inode_t));
+}
+
+//adds the inode bitmap block of an inum and the superblock (for
+//inode_hint) to the running journal transaction
+static void inode_bitmap_dirty(int inum) {
+    superblock_t *sb = blocks_super();
+    journal_dirty(0);
+    journal_dirty(sb->inode_bitmap_start + inum / (BLOCK_SIZE * 8));
 }
 
 //find a free inode, set it as taken, and return the inum. If can't find,
 //return -1
 int alloc_inode() {
-    int inum = 0;
-    for(int i = 0; i < 256; i++) {
-        int bit = bitmap_get(get_inode_bitmap(), i);
-        if(bit == 0) {
-            bitmap_put(get_inode_bitmap(), i, 1);
-            return i;
-        }
+    superblock_t *sb = blocks_super();
+    pthread_mutex_lock(&inode_alloc_lock);
+    int inum = bitmap_summary_alloc(get_inode_summary(), sb->inode_hint);
+    if(inum >= 0) {
+        sb->inode_hint = inum + 1;
+        inode_bitmap_dirty(inum);
     }
-    return -1;
+    pthread_mutex_unlock(&inode_alloc_lock);
+    return inum;
+}
+
+//hands the blocks of an unmapped extent back to the allocator
+static void release_blocks(int bnum, int len) {
+    free_block_range(bnum, len);
 }
 
-//given a taken inum, free it
+static int inode_unpack_range(inode_t *node, long from, long to);
+
+//given a taken inum, free it along with all of its blocks
 void free_inode(int inode_num) {
     inode_t *node = get_inode(inode_num);
-    free_block(node->block);
-    bitmap_put(get_inode_bitmap(), inode_num, 0);
+    shrink_inode(node, 0);
+    node->refs = 0;
+    inode_dirty(node);
+    pthread_mutex_lock(&inode_alloc_lock);
+    bitmap_summary_put(get_inode_summary(), inode_num, 1, 0);
+    inode_bitmap_dirty(inode_num);
+    pthread_mutex_unlock(&inode_alloc_lock);
+}
+
+//sets up a fresh, empty inode with the given mode
+void inode_init(inode_t *node, int mode) {
+    node->refs = 0;
+    node->mode = mode;
+    node->size = 0;
+    node->blocks = 0;
+    node->uid = 0;
+    node->gid = 0;
+    //tells a file apart from the earlier files that had its inum
+    node->generation++;
+    node->_reserved = 0;
+    inode_touch(node, INODE_ATIME | INODE_MTIME | INODE_CTIME);
+    if(S_ISREG(mode)) {
+        node->flags = INODE_INLINE_DATA;
+        memset(node->data, 0, INODE_INLINE);
+    } else {
+        node->flags = 0;
+        extent_init(&node->emap, INODE_EXTENTS);
+    }
+    inode_dirty(node);
+}
+
+//sets the given timestamps (INODE_ATIME, INODE_MTIME, INODE_CTIME) to now
+void inode_touch(inode_t *node, int which) {
+    struct timespec ts;
+    clock_gettime(CLOCK_REALTIME, &ts);
+    long now = ts.tv_sec * 1000000000L + ts.tv_nsec;
+    if(which & INODE_ATIME) {
+        node->atime = now;
+    }
+    if(which & INODE_MTIME) {
+        node->mtime = now;
+    }
+    if(which & INODE_CTIME) {
+        node->ctime = now;
+    }
+    inode_dirty(node);
+}
+
+//moves the inline data of a file into its first block, so the file can
+//grow past INODE_INLINE bytes. an empty file needs no block. returns 0, or
+//-1 if the disk is full (the file is unchanged then)
+static int inode_promote(inode_t *node) {
+    if(node->size == 0) {
+        node->flags &= ~INODE_INLINE_DATA;
+        extent_init(&node->emap, INODE_EXTENTS);
+        inode_dirty(node);
+        return 0;
+    }
+
+    int bnum = alloc_block();
+    if(bnum < 0) {
+        return -1;
+    }
+
+    char *block = blocks_get_block(bnum);
+    memcpy(block, node->data, INODE_INLINE);
+    memset(block + INODE_INLINE, 0, BLOCK_SIZE - INODE_INLINE);
+
+    //the data and the extent root share space in the inode
+    node->flags &= ~INODE_INLINE_DATA;
+    extent_init(&node->emap, INODE_EXTENTS);
+    if(extent_insert(&node->emap, 0, bnum, 1) != 0) {
+        memcpy(node->data, block, INODE_INLINE);
+        node->flags |= INODE_INLINE_DATA;
+        free_block(bnum);
+        return -1;
+    }
+    node->blocks = 1;
+    inode_dirty(node);
+    return 0;
 }
 
-int grow_inode(inode_t *node, int size);
-int shrink_inode(inode_t *node, int size);
-int inode_get_bnum(inode_t *node, int fbnum);
+//grow the file to the given size. the new bytes read as zeros but get no
+//blocks until they are written (see inode_fill). returns 0 on success and
+//-1 if inline data had to move to a block, or a shared last block had to
+//be copied, or a compressed last cluster had to be stored as is, and the
+//disk is full (the size is unchanged then)
+int grow_inode(inode_t *node, long size) {
+    if(size <= node->size) {
+        return 0;
+    }
+
+    if(node->flags & INODE_INLINE_DATA) {
+        if(size <= INODE_INLINE) {
+            //the bytes past the old end are already zero
+            node->size = size;
+            inode_dirty(node);
+            return 0;
+        }
+        if(inode_promote(node) != 0) {
+            return -1;
+        }
+    }
+
+    //a compressed cluster at the old end may hold data past it, left
+    //there when the file shrank, which must not come back
+    if(inode_unpack_range(node, node->size, node->size + 1) != 0) {
+        return -1;
+    }
+
+    //bytes past the old end of file in its last block must read as zeros,
+    //which takes a block of its own if it is shared
+    int tail = node->size % BLOCK_SIZE;
+    if(tail != 0 && inode_unshare(node, node->size, node->size + 1) != 0) {
+        return -1;
+    }
+    int last = inode_get_bnum(node, node->size / BLOCK_SIZE);
+    if(tail != 0 && last >= 0) {
+        memset((char*) blocks_get_block(last) + tail, 0, BLOCK_SIZE - tail);
+    }
+
+    node->size = size;
+    inode_dirty(node);
+    return 0;
+}
+
+//gives every hole in the blocks holding bytes [from, to) a zeroed block.
+//the range may go past the end of the file, to reserve space for it.
+//returns 0 on success and -1 if the disk is full; holes filled before
+//that stay filled
+int inode_fill(inode_t *node, long from, long to) {
+    if(from >= to) {
+        return 0;
+    }
+    if(node->flags & INODE_INLINE_DATA) {
+        //the inode itself has room for the first INODE_INLINE bytes
+        if(to <= INODE_INLINE) {
+            return 0;
+        }
+        if(inode_promote(node) != 0) {
+            return -1;
+        }
+    }
+    //the rest of a compressed cluster looks like a hole
+    if(inode_unpack_range(node, from, to) != 0) {
+        return -1;
+    }
+
+    int fbnum = from / BLOCK_SIZE;
+    int end = bytes_to_blocks(to);
+    while(fbnum < end) {
+        //skip past the mapped run that fbnum is in, if any
+        extent_t ext;
+        int found = extent_find(&node->emap, fbnum, &ext) == 0;
+        if(found && ext.fbnum <= fbnum) {
+            fbnum = ext.fbnum + ext.len;
+            continue;
+        }
+
+        //take the hole's blocks in as few contiguous runs as possible,
+        //starting right after the blocks before it so the extent grows
+        int hole_end = found && ext.fbnum < end ? ext.fbnum : end;
+        int goal = inode_get_bnum(node, fbnum - 1);
+        int len;
+        int bnum = alloc_block_range_near(goal < 0 ? -1 : goal + 1,
+                                          hole_end - fbnum, &len);
+        if(bnum < 0) {
+            return -1;
+        }
+        if(extent_insert(&node->emap, fbnum, bnum, len) != 0) {
+            free_block_range(bnum, len);
+            return -1;
+        }
+        memset(blocks_get_block(bnum), 0, (long) len * BLOCK_SIZE);
+        node->blocks += len;
+        fbnum += len;
+    }
+    inode_dirty(node);
+    return 0;
+}
+
+//counts the blocks mapped in file blocks [from, to)
+static int count_mapped(inode_t *node, int from, int to) {
+    int count = 0;
+    extent_t ext;
+    while(from < to && extent_find(&node->emap, from, &ext) == 0 &&
+          ext.fbnum < to) {
+        int start = ext.fbnum > from ? ext.fbnum : from;
+        int stop = ext.fbnum + ext.len < to ? ext.fbnum + ext.len : to;
+        count += stop - start;
+        from = stop;
+    }
+    return count;
+}
+
+//shrink the file to the given size, freeing the blocks past the new end
+int shrink_inode(inode_t *node, long size) {
+    if(size >= node->size) {
+        return 0;
+    }
+
+    if(node->flags & INODE_INLINE_DATA) {
+        memset(node->data + size, 0, node->size - size);
+        node->size = size;
+        inode_dirty(node);
+        return 0;
+    }
+
+    //blocks reserved past the old end go too. removing a suffix never
+    //splits an extent, so this cannot fail. a compressed cluster that the
+    //new end cuts through keeps its whole run (see grow_inode)
+    int keep = bytes_to_blocks(size);
+    int start;
+    if(keep > 0 && inode_get_cluster(node, keep - 1, &start) >= 0) {
+        int packed = count_mapped(node, start,
+                                  start + compress_cluster_blocks());
+        keep = keep > start + packed ? keep : start + packed;
+    }
+    node->blocks -= count_mapped(node, keep, INT_MAX);
+    extent_remove(&node->emap, keep, INT_MAX - keep, release_blocks);
+    node->size = size;
+
+    //a regular file truncated to nothing starts over with inline data
+    if(size == 0 && S_ISREG(node->mode)) {
+        node->flags |= INODE_INLINE_DATA;
+        memset(node->data, 0, INODE_INLINE);
+    }
+    inode_dirty(node);
+    return 0;
+}
+
+//zeroes bytes [from, to) of the file, which lie in one block, unless that
+//block is a hole
+static void zero_range(inode_t *node, long from, long to) {
+    int bnum = inode_get_bnum(node, from / BLOCK_SIZE);
+    if(bnum >= 0 && from < to) {
+        char *block = blocks_get_block(bnum);
+        memset(block + from % BLOCK_SIZE, 0, to - from);
+    }
+}
+
+//turns bytes [from, to) of the file into a hole without changing its size:
+//the whole blocks in the range are freed and the partial blocks at either
+//end are zeroed. returns 0 on success and -1 if splitting an extent needed
+//a tree node, or a shared partial block had to be copied, or a compressed
+//cluster at an end had to be stored as is, and the disk is full (nothing
+//is freed then)
+int inode_punch(inode_t *node, long from, long to) {
+    if(from >= to) {
+        return 0;
+    }
+    if(node->flags & INODE_INLINE_DATA) {
+        if(from < INODE_INLINE) {
+            memset(node->data + from, 0,
+                   (to < INODE_INLINE ? to : INODE_INLINE) - from);
+            inode_dirty(node);
+        }
+        return 0;
+    }
+
+    //so must the clusters at the ends, if they are compressed. a cluster
+    //the range covers goes with its run
+    if(inode_unpack_range(node, from, from + 1) != 0 ||
+       inode_unpack_range(node, to - 1, to) != 0) {
+        return -1;
+    }
+
+    //the partial blocks at the ends get zeroed, so they must not be shared
+    int first = bytes_to_blocks(from);
+    int last = to / BLOCK_SIZE;
+    long head_end = (long) first * BLOCK_SIZE;
+    if(inode_unshare(node, from, to < head_end ? to : head_end) != 0 ||
+       (last >= first && inode_unshare(node, (long) last * BLOCK_SIZE, to))) {
+        return -1;
+    }
+    if(first < last) {
+        int count = count_mapped(node, first, last);
+        int len = last - first;
+        if(extent_remove(&node->emap, first, len, release_blocks) != 0) {
+            return -1;
+        }
+        node->blocks -= count;
+    }
+
+    zero_range(node, from, to < head_end ? to : head_end);
+    if(last >= first) {
+        zero_range(node, (long) last * BLOCK_SIZE, to);
+    }
+    inode_dirty(node);
+    return 0;
+}
+
+//gives the blocks holding bytes [from, to) that other files share a copy
+//of their own, so that writing them leaves the other files alone, and
+//stores the compressed clusters they are in as is. returns 0 on success
+//and -1 if the disk is full; blocks copied before that stay copied
+int inode_unshare(inode_t *node, long from, long to) {
+    if(from >= to || (node->flags & INODE_INLINE_DATA)) {
+        return 0;
+    }
+    if(inode_unpack_range(node, from, to) != 0) {
+        return -1;
+    }
+    if(blocks_shared() == 0) {
+        return 0;
+    }
+
+    int fbnum = from / BLOCK_SIZE;
+    int end = bytes_to_blocks(to);
+    while(fbnum < end) {
+        int run;
+        int bnum = inode_get_run(node, fbnum, &run);
+        if(run > end - fbnum) {
+            run = end - fbnum;
+        }
+        int len = 0;
+        while(bnum >= 0 && len < run && blocks_refs(bnum + len) > 1) {
+            len++;
+        }
+        if(len == 0) {
+            fbnum += bnum < 0 ? run : 1;
+            continue;
+        }
+
+        //copy the shared run next to the blocks before it
+        int goal = inode_get_bnum(node, fbnum - 1);
+        int copy = alloc_block_range_near(goal < 0 ? -1 : goal + 1, len,
+                                          &len);
+        if(copy < 0) {
+            return -1;
+        }
+        memcpy(blocks_get_block(copy), blocks_get_block(bnum),
+               (long) len * BLOCK_SIZE);
+
+        //keep a reference to the old blocks until the copy is mapped, so
+        //they can be mapped again if that fails
+        blocks_ref_range(bnum, len);
+        if(extent_remove(&node->emap, fbnum, len, release_blocks) != 0) {
+            free_block_range(bnum, len);
+            free_block_range(copy, len);
+            return -1;
+        }
+        if(extent_insert(&node->emap, fbnum, copy, len) != 0) {
+            free_block_range(copy, len);
+            //putting back what was just removed merges with its neighbours
+            if(extent_insert(&node->emap, fbnum, bnum, len) != 0) {
+                free_block_range(bnum, len);
+                node->blocks -= len;
+                inode_dirty(node);
+            }
+            return -1;
+        }
+        free_block_range(bnum, len);
+        fbnum += len;
+    }
+    inode_dirty(node);
+    return 0;
+}
+
+//swaps each whole block in bytes [from, to), which were just written, for
+//a block elsewhere in the image with the same contents, if the dedup index
+//knows one (see dedup.h). blocks that cannot be swapped stay as they are
+void inode_dedup(inode_t *node, long from, long to) {
+    if(!dedup_enabled() || (node->flags & INODE_INLINE_DATA)) {
+        return;
+    }
+
+    for(int fbnum = bytes_to_blocks(from); fbnum < to / BLOCK_SIZE; ++fbnum) {
+        int bnum = inode_get_bnum(node, fbnum);
+        int same = bnum < 0 ? -1 : dedup_block(bnum);
+        if(same < 0) {
+            continue;
+        }
+
+        //as in inode_unshare, keep the written block until the other one
+        //is mapped in its place
+        blocks_ref_range(bnum, 1);
+        if(extent_remove(&node->emap, fbnum, 1, release_blocks) != 0) {
+            free_block(bnum);
+            free_block(same);
+            continue;
+        }
+        if(extent_insert(&node->emap, fbnum, same, 1) != 0) {
+            free_block(same);
+            if(extent_insert(&node->emap, fbnum, bnum, 1) != 0) {
+                free_block(bnum);
+                node->blocks--;
+            }
+            continue;
+        }
+        free_block(bnum);
+    }
+    inode_dirty(node);
+}
+
+//stores the compressed cluster that starts at file block start, in the run
+//at bnum, as is again, in blocks of its own. only the data below the end of
+//the file is kept. returns 0 on success and -1 if the disk is full or the
+//run is corrupt (the cluster is unchanged then, unless mapping the new
+//blocks needed a tree node: what could not be mapped is a hole)
+static int inode_unpack(inode_t *node, int start, int bnum) {
+    int size;
+    compress_buf_t *buf;
+    const char *data = compress_get(bnum, &size, &buf);
+    if(data == 0) {
+        return -1;
+    }
+
+    long keep = node->size - (long) start * BLOCK_SIZE;
+    keep = keep < size ? keep : size;
+    int want = keep > 0 ? bytes_to_blocks(keep) : 0;
+    int packed = count_mapped(node, start, start + compress_cluster_blocks());
+
+    //take the blocks before changing anything, in as few runs as possible
+    int runs[2 * (COMPRESS_CLUSTER / 512)];
+    int count = 0;
+    int got = 0;
+    while(got < want) {
+        int goal = count > 0 ? runs[2 * count - 2] + runs[2 * count - 1] : -1;
+        int len;
+        int run = alloc_block_range_near(goal, want - got, &len);
+        if(run < 0) {
+            while(count > 0) {
+                count--;
+                free_block_range(runs[2 * count], runs[2 * count + 1]);
+            }
+            compress_put(buf);
+            return -1;
+        }
+
+        long at = (long) got * BLOCK_SIZE;
+        long bytes = (long) len * BLOCK_SIZE;
+        long copy = keep - at < bytes ? keep - at : bytes;
+        char *block = blocks_get_block(run);
+        memcpy(block, data + at, copy);
+        memset(block + copy, 0, bytes - copy);
+        runs[2 * count] = run;
+        runs[2 * count + 1] = len;
+        count++;
+        got += len;
+    }
+    compress_put(buf);
+
+    if(extent_remove(&node->emap, start, packed, release_blocks) != 0) {
+        while(count > 0) {
+            count--;
+            free_block_range(runs[2 * count], runs[2 * count + 1]);
+        }
+        return -1;
+    }
+    node->blocks -= packed;
+
+    int rv = 0;
+    int fbnum = start;
+    for(int ii = 0; ii < count; ++ii) {
+        int len = runs[2 * ii + 1];
+        if(rv != 0 ||
+           extent_insert(&node->emap, fbnum, runs[2 * ii], len) != 0) {
+            free_block_range(runs[2 * ii], len);
+            rv = -1;
+        } else {
+            node->blocks += len;
+        }
+        fbnum += len;
+    }
+    compress_count(want, packed, 1);
+    inode_dirty(node);
+    return rv;
+}
+
+//stores the compressed clusters that bytes [from, to) are in as is, so
+//that they can be written. returns 0 on success and -1 if the disk is
+//full; clusters stored as is before that stay so
+static int inode_unpack_range(inode_t *node, long from, long to) {
+    long size = compress_cluster_blocks();
+    if(size == 0 || from >= to || (node->flags & INODE_INLINE_DATA)) {
+        return 0;
+    }
+
+    long fbnum = from / BLOCK_SIZE / size * size;
+    long end = bytes_to_blocks(to);
+    while(fbnum < end) {
+        int run;
+        int bnum = inode_get_run(node, fbnum, &run);
+        if(bnum >= 0 && blocks_compressed(bnum) &&
+           inode_unpack(node, fbnum, bnum) != 0) {
+            return -1;
+        }
+        //a cluster that starts in a hole is stored as is
+        long next = bnum < 0 ? fbnum + run : fbnum + 1;
+        fbnum = (next + size - 1) / size * size;
+    }
+    return 0;
+}
+
+//compresses the cluster that starts at file block start, holding the
+//given number of bytes of the file, if that saves a block. work has room
+//for two clusters. returns 0, or -1 if the disk is full
+static int pack_cluster(inode_t *node, int start, long bytes, char *work) {
+    int size = compress_cluster_blocks();
+    int want = bytes_to_blocks(bytes);
+    int first;
+    if(want < 2 || inode_get_cluster(node, start, &first) >= 0 ||
+       count_mapped(node, start, start + want) != want ||
+       count_mapped(node, start + want, start + size) != 0) {
+        return 0;
+    }
+
+    //the blocks are usually one run; otherwise they are gathered first
+    int runs[2 * (COMPRESS_CLUSTER / 512)];
+    int count = 0;
+    for(int fbnum = start; fbnum < start + want; ++count) {
+        int len;
+        runs[2 * count] = inode_get_run(node, fbnum, &len);
+        len = len < start + want - fbnum ? len : start + want - fbnum;
+        runs[2 * count + 1] = len;
+        fbnum += len;
+    }
+    const char *data = blocks_get_block(runs[0]);
+    if(count > 1) {
+        char *gather = work + COMPRESS_CLUSTER;
+        for(int ii = 0; ii < count; ++ii) {
+            long len = (long) runs[2 * ii + 1] * BLOCK_SIZE;
+            memcpy(gather, blocks_get_block(runs[2 * ii]), len);
+            gather += len;
+        }
+        data = work + COMPRESS_CLUSTER;
+    }
+
+    int len = compress_pack(data, bytes, work, (want - 1) * BLOCK_SIZE);
+    if(len < 0) {
+        return 0;
+    }
+    int need = bytes_to_blocks(len);
+    int got;
+    int dst = alloc_block_range_near(runs[0], need, &got);
+    if(dst < 0) {
+        return -1;
+    }
+    if(got < need) {
+        free_block_range(dst, got);
+        return 0;
+    }
+    char *block = blocks_get_block(dst);
+    memcpy(block, work, len);
+    memset(block + len, 0, (long) need * BLOCK_SIZE - len);
+    compress_forget(dst);
+    blocks_set_compressed(dst);
+
+    //as in inode_unshare, keep the old blocks until the run is mapped
+    for(int ii = 0; ii < count; ++ii) {
+        blocks_ref_range(runs[2 * ii], runs[2 * ii + 1]);
+    }
+    if(extent_remove(&node->emap, start, want, release_blocks) != 0) {
+        for(int ii = 0; ii < count; ++ii) {
+            free_block_range(runs[2 * ii], runs[2 * ii + 1]);
+        }
+        free_block_range(dst, need);
+        return 0;
+    }
+    if(extent_insert(&node->emap, start, dst, need) != 0) {
+        free_block_range(dst, need);
+        int fbnum = start;
+        for(int ii = 0; ii < count; ++ii) {
+            int run = runs[2 * ii];
+            int len = runs[2 * ii + 1];
+            if(extent_insert(&node->emap, fbnum, run, len) != 0) {
+                free_block_range(run, len);
+                node->blocks -= len;
+            }
+            fbnum += len;
+        }
+        return 0;
+    }
+    for(int ii = 0; ii < count; ++ii) {
+        free_block_range(runs[2 * ii], runs[2 * ii + 1]);
+    }
+    node->blocks += need - want;
+    compress_count(want, need, 0);
+    return 0;
+}
+
+//compresses each cluster in bytes [from, to) that takes fewer blocks that
+//way (see compress.h). the last cluster of the file ends at the end of the
+//file, and is only compressed if nothing is mapped past that
+void inode_compress(inode_t *node, long from, long to) {
+    int size = compress_cluster_blocks();
+    if(size == 0 || (node->flags & INODE_INLINE_DATA)) {
+        return;
+    }
+
+    long cluster = (long) size * BLOCK_SIZE;
+    char *work = 0;
+    for(long pos = (from + cluster - 1) / cluster * cluster;
+        pos < to && pos < node->size; pos += cluster) {
+        long bytes = node->size - pos < cluster ? node->size - pos : cluster;
+        if(pos + bytes > to) {
+            break;
+        }
+        if(work == 0 && (work = malloc(2 * COMPRESS_CLUSTER)) == 0) {
+            break;
+        }
+        if(pack_cluster(node, pos / BLOCK_SIZE, bytes, work) != 0) {
+            break;
+        }
+    }
+    free(work);
+    inode_dirty(node);
+}
+
+//maps file blocks [fbnum, fbnum + count) to the blocks that src maps at
+//[src_fbnum, src_fbnum + count), sharing them instead of copying them;
+//the holes of src become holes. whatever the range held before is
+//dropped. the ranges must not overlap if node is src, and must cover whole
+//clusters if the image compresses data, so that compressed clusters are
+//shared as they are. returns 0 on success and -1 if the disk is full,
+//which may leave part of the range shared and the rest a hole
+int inode_clone(inode_t *node, int fbnum, inode_t *src, int src_fbnum,
+                int count) {
+    if((node->flags & INODE_INLINE_DATA) && inode_promote(node) != 0) {
+        return -1;
+    }
+
+    int mapped = count_mapped(node, fbnum, fbnum + count);
+    if(extent_remove(&node->emap, fbnum, count, release_blocks) != 0) {
+        return -1;
+    }
+    node->blocks -= mapped;
+
+    int rv = 0;
+    int done = 0;
+    while(rv == 0 && done < count) {
+        int len;
+        int bnum = inode_get_run(src, src_fbnum + done, &len);
+        if(len > count - done) {
+            len = count - done;
+        }
+        if(bnum >= 0) {
+            blocks_ref_range(bnum, len);
+            if(extent_insert(&node->emap, fbnum + done, bnum, len) != 0) {
+                free_block_range(bnum, len);
+                rv = -1;
+                break;
+            }
+            node->blocks += len;
+        }
+        done += len;
+    }
+    inode_dirty(node);
+    return rv;
+}
+
+//finds the first byte of data (or of a hole) at or after offset. the end
+//of the file counts as a hole. returns -1 if offset is past the end, or
+//if looking for data and there is none
+long inode_seek(inode_t *node, long offset, int hole) {
+    if(offset >= node->size) {
+        return -1;
+    }
+    if(node->flags & INODE_INLINE_DATA) {
+        return hole ? node->size : offset;
+    }
+
+    //the rest of a compressed cluster is data, not a hole
+    int fbnum = offset / BLOCK_SIZE;
+    int start;
+    extent_t ext;
+    if(!hole) {
+        if(inode_get_cluster(node, fbnum, &start) >= 0) {
+            return offset;
+        }
+        if(extent_find(&node->emap, fbnum, &ext) != 0) {
+            return -1;
+        }
+        long pos = (long) ext.fbnum * BLOCK_SIZE;
+        pos = pos > offset ? pos : offset;
+        return pos < node->size ? pos : -1;
+    }
+
+    //walk the runs of data that follow each other without a gap
+    for(;;) {
+        if(inode_get_cluster(node, fbnum, &start) >= 0) {
+            fbnum = start + compress_cluster_blocks();
+        } else if(extent_find(&node->emap, fbnum, &ext) == 0 &&
+                  ext.fbnum <= fbnum) {
+            fbnum = ext.fbnum + ext.len;
+        } else {
+            break;
+        }
+    }
+    long pos = (long) fbnum * BLOCK_SIZE;
+    pos = pos > offset ? pos : offset;
+    return pos < node->size ? pos : node->size;
+}
+
+//like inode_get_bnum, and also sets len to the number of file blocks from
+//fbnum on that are contiguous on disk, or that the hole at fbnum spans, so
+//a caller can copy a whole run at once
+int inode_get_run(inode_t *node, int fbnum, int *len) {
+    extent_t ext;
+    if(node->flags & INODE_INLINE_DATA) {
+        *len = 1;
+        return -1;
+    }
+    if(extent_find(&node->emap, fbnum, &ext) != 0) {
+        *len = INT_MAX - fbnum;
+        return -1;
+    }
+    if(ext.fbnum > fbnum) {
+        *len = ext.fbnum - fbnum;
+        return -1;
+    }
+    *len = ext.fbnum + ext.len - fbnum;
+    return ext.bnum + (fbnum - ext.fbnum);
+}
+
+//returns the first block of the run holding the compressed cluster that
+//file block fbnum is in, setting start to the first file block of the
+//cluster, or -1 if that cluster is stored as is (see compress.h)
+int inode_get_cluster(inode_t *node, int fbnum, int *start) {
+    int size = compress_cluster_blocks();
+    if(size == 0 || (node->flags & INODE_INLINE_DATA)) {
+        return -1;
+    }
+    *start = fbnum - fbnum % size;
+    int bnum = inode_get_bnum(node, *start);
+    return bnum >= 0 && blocks_compressed(bnum) ? bnum : -1;
+}
+
+//returns the disk block holding the given block of the file, or -1 if
+//that block is not mapped
+int inode_get_bnum(inode_t *node, int fbnum) {
+    if(node->flags & INODE_INLINE_DATA) {
+        return -1;
+    }
+    extent_t ext;
+    if(extent_find(&node->emap, fbnum, &ext) != 0 || ext.fbnum > fbnum) {
+        return -1;
+    }
+    return ext.bnum + (fbnum - ext.fbnum);
+}
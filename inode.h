@@ -7,20 +7,69 @@
 #define INODE_H
 
 #include "blocks.h"
+#include "extent.h"
 
+#define INODE_SIZE 256  // bytes per inode record on disk; a power of two
+#define INODE_HEADER 64 // bytes before the extents or inline data
+#define INODE_INLINE (INODE_SIZE - INODE_HEADER) // file bytes in the inode
+#define INODE_EXTENTS \
+  ((INODE_INLINE - sizeof(extent_header_t)) / sizeof(extent_t))
+
+#define INODE_INLINE_DATA 1 // flags: the data is in the inode, not in blocks
+
+// timestamps for inode_touch()
+#define INODE_ATIME 1
+#define INODE_MTIME 2
+#define INODE_CTIME 4
+
+// A regular file starts out with its data in the inode itself and moves
+// to blocks mapped by the extent tree once it grows past INODE_INLINE
+// bytes. Directories always use blocks.
+//
+// Records are INODE_SIZE bytes in a block-aligned table, so none straddles
+// a page, and everything stat reports sits in the first INODE_HEADER bytes:
+// a single cache line.
 typedef struct inode {
-  int refs;  // reference count
-  int mode;  // permission & type
-  int size;  // bytes
-  int block; // single block pointer (if max file size <= 4K)
+  int refs;   // reference count
+  int mode;   // permission & type
+  long size;  // bytes
+  int flags;  // INODE_INLINE_DATA
+  int blocks; // data blocks mapped; files may have holes
+  int uid;    // owner
+  int gid;
+  long atime; // nanoseconds since the epoch
+  long mtime;
+  long ctime;
+  int generation; // bumped each time the inum is handed out again
+  int _reserved;
+  union {
+    struct {
+      extent_header_t emap;           // root of the extent tree mapping the
+      extent_t extents[INODE_EXTENTS]; // file's blocks, then its entries
+    };
+    char data[INODE_INLINE]; // inline data; zero past size
+  };
 } inode_t;
 
 void print_inode(inode_t *node);
 inode_t *get_inode(int inum);
+void inode_dirty(inode_t *node);
 int alloc_inode();
-void free_inode();
-int grow_inode(inode_t *node, int size);
-int shrink_inode(inode_t *node, int size);
+void free_inode(int inum);
+void inode_init(inode_t *node, int mode);
+void inode_touch(inode_t *node, int which);
+int grow_inode(inode_t *node, long size);
+int inode_fill(inode_t *node, long from, long to);
+int shrink_inode(inode_t *node, long size);
+int inode_punch(inode_t *node, long from, long to);
+int inode_unshare(inode_t *node, long from, long to);
+void inode_dedup(inode_t *node, long from, long to);
+void inode_compress(inode_t *node, long from, long to);
+int inode_clone(inode_t *node, int fbnum, inode_t *src, int src_fbnum,
+                int count);
 int inode_get_bnum(inode_t *node, int file_bnum);
+int inode_get_run(inode_t *node, int file_bnum, int *len);
+int inode_get_cluster(inode_t *node, int fbnum, int *start);
+long inode_seek(inode_t *node, long offset, int hole);
 
 #endif
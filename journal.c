@@ -0,0 +1,553 @@
+/**
+ * @file journal.c
+ *
+ * Metadata journal implementation.
+ */
+#define _GNU_SOURCE
+#include <assert.h>
+#include <errno.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "blocks.h"
+#include "journal.h"
+
+#define JOURNAL_DESCRIPTOR 1
+#define JOURNAL_COMMIT 2
+
+// Starts every descriptor block (followed by the home block numbers of the
+// images it describes) and the commit block.
+typedef struct journal_header {
+  int magic;         // JOURNAL_MAGIC
+  int type;          // JOURNAL_DESCRIPTOR or JOURNAL_COMMIT
+  int seq;           // transaction sequence number
+  int count;         // blocks in the transaction
+  uint32_t checksum; // commit block only: of the descriptors and images
+  int _reserved[3];
+} journal_header_t;
+
+static int journal_fd = -1;
+static int journal_on = 0;
+static int journal_started = 0; // the commit thread is running
+static int journal_first;    // first block of the journal region
+static int journal_capacity; // blocks in the journal region
+static int journal_high;     // transactions this large commit early
+
+// Everything below is protected by journal_lock. journal_cond is broadcast
+// whenever any of it changes.
+static pthread_mutex_t journal_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t journal_cond = PTHREAD_COND_INITIALIZER;
+static pthread_t journal_thread;
+
+static uint64_t *running; // bitset: blocks in the running transaction
+static int *dirty_list;   // blocks in the order they were dirtied; blocks
+static int dirty_len;     // forgotten since are still listed
+static int dirty_cap;
+static int dirty_count;   // bits set in running
+
+static uint64_t *committing; // bitset: blocks not yet checkpointed
+static int checkpointing;
+
+static int handles;    // open handles
+static int barrier;    // a commit is copying out the running transaction
+static int kick;       // a commit was asked for
+static int stopping;
+static int error;      // a commit failed to write the image
+static int running_seq;
+static int durable_seq;      // last transaction that survives a crash
+static int checkpointed_seq; // last transaction written home
+
+static int bit_get(uint64_t *set, int bnum) {
+  uint64_t word = __atomic_load_n(&set[bnum / 64], __ATOMIC_RELAXED);
+  return (word >> (bnum % 64)) & 1;
+}
+
+static void bit_put(uint64_t *set, int bnum, int value) {
+  uint64_t bit = 1ULL << (bnum % 64);
+  if (value) {
+    __atomic_fetch_or(&set[bnum / 64], bit, __ATOMIC_RELAXED);
+  } else {
+    __atomic_fetch_and(&set[bnum / 64], ~bit, __ATOMIC_RELAXED);
+  }
+}
+
+// FNV-1a, continued from hash.
+static uint32_t checksum(uint32_t hash, const void *data, long len) {
+  const uint8_t *bytes = data;
+  for (long ii = 0; ii < len; ++ii) {
+    hash = (hash ^ bytes[ii]) * 16777619u;
+  }
+  return hash;
+}
+
+// Number of block numbers that fit in a descriptor block.
+static int descriptor_slots(int block_size) {
+  return (block_size - sizeof(journal_header_t)) / sizeof(int);
+}
+
+static int write_all(int fd, const void *buf, long len, off_t off) {
+  const char *ptr = buf;
+  while (len > 0) {
+    ssize_t rv = pwrite(fd, ptr, len, off);
+    if (rv < 0) {
+      if (errno == EINTR) {
+        continue;
+      }
+      return -1;
+    }
+    ptr += rv;
+    off += rv;
+    len -= rv;
+  }
+  return 0;
+}
+
+static int read_all(int fd, void *buf, long len, off_t off) {
+  char *ptr = buf;
+  while (len > 0) {
+    ssize_t rv = pread(fd, ptr, len, off);
+    if (rv <= 0) {
+      if (rv < 0 && errno == EINTR) {
+        continue;
+      }
+      return -1;
+    }
+    ptr += rv;
+    off += rv;
+    len -= rv;
+  }
+  return 0;
+}
+
+// Replay the last committed transaction of an image, if needed.
+void journal_replay(int fd, superblock_t *sb) {
+  if (sb->journal_blocks <= 0) {
+    return;
+  }
+
+  int bs = sb->block_size;
+  off_t start = (off_t) sb->journal_start * bs;
+  journal_header_t head;
+  if (read_all(fd, &head, sizeof(head), start) != 0 ||
+      head.magic != JOURNAL_MAGIC || head.type != JOURNAL_DESCRIPTOR ||
+      head.seq <= sb->journal_seq || head.count <= 0) {
+    return;
+  }
+
+  int slots = descriptor_slots(bs);
+  long ndesc = (head.count + slots - 1) / slots;
+  long total = ndesc + head.count + 1;
+  if (total > sb->journal_blocks) {
+    return;
+  }
+
+  char *buf = malloc(total * bs);
+  assert(buf != 0);
+  if (read_all(fd, buf, total * bs, start) != 0) {
+    free(buf);
+    return;
+  }
+
+  // only a transaction whose commit block made it to disk is replayed
+  journal_header_t *commit = (journal_header_t *) (buf + (total - 1) * bs);
+  int valid = commit->magic == JOURNAL_MAGIC &&
+              commit->type == JOURNAL_COMMIT && commit->seq == head.seq &&
+              commit->count == head.count &&
+              commit->checksum ==
+                  checksum(2166136261u ^ head.seq, buf, (total - 1) * bs);
+  for (long ii = 0; valid && ii < ndesc; ++ii) {
+    journal_header_t *desc = (journal_header_t *) (buf + ii * bs);
+    valid = desc->magic == JOURNAL_MAGIC &&
+            desc->type == JOURNAL_DESCRIPTOR && desc->seq == head.seq;
+  }
+  for (int kk = 0; valid && kk < head.count; ++kk) {
+    int *bnums = (int *) (buf + (kk / slots) * bs + sizeof(journal_header_t));
+    int bnum = bnums[kk % slots];
+    valid = bnum >= 0 && bnum < sb->block_count &&
+            (bnum < sb->journal_start ||
+             bnum >= sb->journal_start + sb->journal_blocks);
+  }
+  if (!valid) {
+    free(buf);
+    return;
+  }
+
+  for (int kk = 0; kk < head.count; ++kk) {
+    int *bnums = (int *) (buf + (kk / slots) * bs + sizeof(journal_header_t));
+    char *image = buf + (ndesc + kk) * bs;
+    int rv = write_all(fd, image, bs, (off_t) bnums[kk % slots] * bs);
+    assert(rv == 0);
+  }
+  free(buf);
+
+  // the replayed superblock says which transaction was checkpointed before
+  // this one; record that this one is home now
+  int rv = fdatasync(fd);
+  assert(rv == 0);
+  rv = read_all(fd, sb, sizeof(*sb), 0);
+  assert(rv == 0);
+  sb->journal_seq = head.seq;
+  rv = write_all(fd, sb, sizeof(*sb), 0);
+  assert(rv == 0);
+  rv = fdatasync(fd);
+  assert(rv == 0);
+
+  fprintf(stderr, "nufs: replayed journal transaction %d (%d blocks)\n",
+          head.seq, head.count);
+}
+
+// Add a block to the running transaction. Called with journal_lock held.
+static void dirty_locked(int bnum) {
+  if (bit_get(running, bnum)) {
+    return;
+  }
+  bit_put(running, bnum, 1);
+  dirty_count++;
+
+  if (dirty_len == dirty_cap) {
+    dirty_cap = dirty_cap ? dirty_cap * 2 : 64;
+    dirty_list = realloc(dirty_list, dirty_cap * sizeof(int));
+    assert(dirty_list != 0);
+  }
+  dirty_list[dirty_len++] = bnum;
+}
+
+// Write a transaction to the journal region and wait until it is on disk.
+// buf holds ndesc empty descriptor blocks, then the n images, then an
+// empty commit block.
+static int journal_write(int seq, char *buf, int *bnums, int n, int ndesc) {
+  int slots = descriptor_slots(BLOCK_SIZE);
+  for (int ii = 0; ii < ndesc; ++ii) {
+    journal_header_t *desc = (journal_header_t *) (buf + ii * BLOCK_SIZE);
+    desc->magic = JOURNAL_MAGIC;
+    desc->type = JOURNAL_DESCRIPTOR;
+    desc->seq = seq;
+    desc->count = n;
+    int first = ii * slots;
+    int count = n - first < slots ? n - first : slots;
+    memcpy(desc + 1, bnums + first, count * sizeof(int));
+  }
+
+  long total = ndesc + n + 1;
+  journal_header_t *commit =
+      (journal_header_t *) (buf + (total - 1) * BLOCK_SIZE);
+  commit->magic = JOURNAL_MAGIC;
+  commit->type = JOURNAL_COMMIT;
+  commit->seq = seq;
+  commit->count = n;
+  commit->checksum =
+      checksum(2166136261u ^ seq, buf, (total - 1) * BLOCK_SIZE);
+
+  off_t start = (off_t) journal_first * BLOCK_SIZE;
+  if (write_all(journal_fd, buf, total * BLOCK_SIZE, start) != 0) {
+    return -1;
+  }
+  return fdatasync(journal_fd);
+}
+
+// Commit the running transaction. Called with journal_lock held, which is
+// dropped while the transaction is written out.
+static void journal_do_commit() {
+  barrier = 1;
+  while (handles > 0) {
+    pthread_cond_wait(&journal_cond, &journal_lock);
+  }
+
+  // replay must not go back further than this transaction
+  int seq = running_seq;
+  blocks_super()->journal_seq = checkpointed_seq;
+  dirty_locked(0);
+
+  int n = dirty_count;
+  int slots = descriptor_slots(BLOCK_SIZE);
+  int ndesc = (n + slots - 1) / slots;
+  long total = ndesc + n + 1;
+  char *buf = calloc(total, BLOCK_SIZE);
+  int *bnums = malloc(n * sizeof(int));
+  assert(buf != 0 && bnums != 0);
+
+  int kk = 0;
+  for (int ii = 0; ii < dirty_len; ++ii) {
+    int bnum = dirty_list[ii];
+    if (!bit_get(running, bnum)) {
+      continue; // forgotten, or listed twice
+    }
+    bit_put(running, bnum, 0);
+    bit_put(committing, bnum, 1);
+    memcpy(buf + (long) (ndesc + kk) * BLOCK_SIZE, blocks_get_meta(bnum),
+           BLOCK_SIZE);
+    bnums[kk++] = bnum;
+  }
+  assert(kk == n);
+
+  dirty_len = 0;
+  dirty_count = 0;
+  running_seq++;
+  checkpointing = 1;
+  barrier = 0;
+  pthread_cond_broadcast(&journal_cond);
+  pthread_mutex_unlock(&journal_lock);
+
+  int rv = 0;
+  if (total <= journal_capacity) {
+    rv = journal_write(seq, buf, bnums, n, ndesc);
+    if (rv == 0) {
+      pthread_mutex_lock(&journal_lock);
+      durable_seq = seq;
+      pthread_cond_broadcast(&journal_cond);
+      pthread_mutex_unlock(&journal_lock);
+    }
+  } else {
+    fprintf(stderr,
+            "nufs: transaction %d (%d blocks) does not fit in the journal; "
+            "writing it home unprotected\n",
+            seq, n);
+  }
+
+  // checkpoint: the journal copy is safe, so the home blocks can be written
+  for (int ii = 0; rv == 0 && ii < n; ++ii) {
+    rv = write_all(journal_fd, buf + (long) (ndesc + ii) * BLOCK_SIZE,
+                   BLOCK_SIZE, (off_t) bnums[ii] * BLOCK_SIZE);
+  }
+  if (rv == 0) {
+    rv = fdatasync(journal_fd);
+  }
+  if (rv != 0) {
+    perror("nufs: journal commit");
+  }
+
+  pthread_mutex_lock(&journal_lock);
+  for (int ii = 0; ii < n; ++ii) {
+    bit_put(committing, bnums[ii], 0);
+  }
+  checkpointing = 0;
+  if (rv == 0) {
+    checkpointed_seq = seq;
+    durable_seq = seq;
+  } else {
+    error = 1;
+  }
+  pthread_cond_broadcast(&journal_cond);
+
+  free(buf);
+  free(bnums);
+}
+
+// The commit thread: commits every JOURNAL_INTERVAL seconds, and sooner
+// when asked to or when the running transaction grows too large.
+static void *journal_main(void *arg) {
+  pthread_mutex_lock(&journal_lock);
+  for (;;) {
+    struct timespec deadline;
+    clock_gettime(CLOCK_REALTIME, &deadline);
+    deadline.tv_sec += JOURNAL_INTERVAL;
+
+    int timeout = 0;
+    while (!kick && !stopping && dirty_count < journal_high && !timeout) {
+      timeout = pthread_cond_timedwait(&journal_cond, &journal_lock,
+                                       &deadline) == ETIMEDOUT;
+    }
+
+    // a shutdown asked for during a commit still gets a commit of its own
+    if (kick || dirty_count > 0) {
+      kick = 0;
+      journal_do_commit();
+    } else if (stopping) {
+      break;
+    }
+  }
+  pthread_mutex_unlock(&journal_lock);
+  return 0;
+}
+
+// Ask for the running transaction to be committed. Until the commit thread
+// is started, the caller commits it. Called with journal_lock held.
+static void journal_kick() {
+  if (journal_started) {
+    kick = 1;
+    pthread_cond_broadcast(&journal_cond);
+  } else {
+    journal_do_commit();
+  }
+}
+
+// Start journaling the mounted image.
+void journal_init(int fd) {
+  superblock_t *sb = blocks_super();
+  journal_fd = fd;
+  journal_first = sb->journal_start;
+  journal_capacity = sb->journal_blocks;
+  journal_high = journal_capacity / 2;
+
+  long words = (BLOCK_COUNT + 63) / 64;
+  running = calloc(words, sizeof(uint64_t));
+  committing = calloc(words, sizeof(uint64_t));
+  assert(running != 0 && committing != 0);
+  dirty_len = 0;
+  dirty_count = 0;
+
+  handles = 0;
+  barrier = 0;
+  kick = 0;
+  stopping = 0;
+  error = 0;
+  checkpointed_seq = sb->journal_seq;
+  durable_seq = sb->journal_seq;
+  running_seq = sb->journal_seq + 1;
+
+  journal_on = 1;
+}
+
+// Start the commit thread.
+void journal_start() {
+  if (!journal_on || journal_started) {
+    return;
+  }
+  int rv = pthread_create(&journal_thread, 0, journal_main, 0);
+  assert(rv == 0);
+  journal_started = 1;
+}
+
+// Commit everything that is still running and stop journaling.
+void journal_shutdown() {
+  if (!journal_on) {
+    return;
+  }
+
+  pthread_mutex_lock(&journal_lock);
+  if (journal_started) {
+    stopping = 1;
+    pthread_cond_broadcast(&journal_cond);
+    pthread_mutex_unlock(&journal_lock);
+    pthread_join(journal_thread, 0);
+    journal_started = 0;
+  } else {
+    if (dirty_count > 0) {
+      journal_do_commit();
+    }
+    pthread_mutex_unlock(&journal_lock);
+  }
+
+  // everything is home, so the next mount has nothing to replay
+  if (error == 0) {
+    superblock_t *sb = blocks_super();
+    sb->journal_seq = checkpointed_seq;
+    if (write_all(journal_fd, sb, sizeof(*sb), 0) != 0 ||
+        fdatasync(journal_fd) != 0) {
+      perror("nufs: journal shutdown");
+    }
+  }
+
+  journal_on = 0;
+  free(running);
+  free(committing);
+  free(dirty_list);
+  running = 0;
+  committing = 0;
+  dirty_list = 0;
+  dirty_cap = 0;
+}
+
+// Start a handle.
+void journal_begin() {
+  if (!journal_on) {
+    return;
+  }
+
+  pthread_mutex_lock(&journal_lock);
+  while (barrier || dirty_count >= journal_high) {
+    if (!barrier) {
+      journal_kick();
+      if (!journal_started) {
+        continue;
+      }
+    }
+    pthread_cond_wait(&journal_cond, &journal_lock);
+  }
+  handles++;
+  pthread_mutex_unlock(&journal_lock);
+}
+
+// End a handle.
+void journal_end() {
+  if (!journal_on) {
+    return;
+  }
+
+  pthread_mutex_lock(&journal_lock);
+  handles--;
+  if (handles == 0 && barrier) {
+    pthread_cond_broadcast(&journal_cond);
+  }
+  pthread_mutex_unlock(&journal_lock);
+}
+
+// Add a metadata block to the running transaction.
+void journal_dirty(int bnum) {
+  // a set bit stays set until the next commit, which waits for this handle
+  if (!journal_on || bit_get(running, bnum)) {
+    return;
+  }
+
+  pthread_mutex_lock(&journal_lock);
+  dirty_locked(bnum);
+  pthread_mutex_unlock(&journal_lock);
+}
+
+// Add the blocks covering a byte range to the running transaction.
+void journal_dirty_range(const void *ptr, size_t len) {
+  int first = blocks_meta_bnum(ptr);
+  int last = blocks_meta_bnum((const char *) ptr + len - 1);
+  for (int bnum = first; bnum <= last; ++bnum) {
+    journal_dirty(bnum);
+  }
+}
+
+// Drop freed blocks from the journal.
+void journal_forget(int bnum, int len) {
+  if (!journal_on) {
+    return;
+  }
+
+  pthread_mutex_lock(&journal_lock);
+  for (int ii = bnum; ii < bnum + len; ++ii) {
+    if (bit_get(running, ii)) {
+      bit_put(running, ii, 0);
+      dirty_count--;
+    }
+  }
+
+  // the checkpoint in progress may still write these blocks home, over
+  // whatever they are reused for
+  for (int ii = bnum; checkpointing && ii < bnum + len; ++ii) {
+    if (bit_get(committing, ii)) {
+      pthread_cond_wait(&journal_cond, &journal_lock);
+      ii = bnum - 1;
+    }
+  }
+  pthread_mutex_unlock(&journal_lock);
+}
+
+// Commit the running transaction and wait until it is on disk.
+int journal_commit() {
+  if (!journal_on) {
+    return 0;
+  }
+
+  pthread_mutex_lock(&journal_lock);
+  int target = dirty_count > 0 ? running_seq : running_seq - 1;
+  if (dirty_count > 0) {
+    journal_kick();
+  }
+  while (durable_seq < target && !error) {
+    pthread_cond_wait(&journal_cond, &journal_lock);
+  }
+  int rv = error ? -1 : 0;
+  pthread_mutex_unlock(&journal_lock);
+  return rv;
+}
@@ -0,0 +1,117 @@
+/**
+ * @file journal.h
+ *
+ * A write-ahead journal for metadata blocks.
+ *
+ * Metadata (the superblock, both bitmaps, the inode table, extent tree
+ * nodes and directory blocks) is read and written through a private
+ * mapping of the image (see blocks_get_meta()), so changes to it never
+ * reach the image file on their own. Code that changes a metadata block
+ * marks it with journal_dirty() inside a handle (journal_begin() and
+ * journal_end()); every operation that starts between two commits joins
+ * the same running transaction.
+ *
+ * A commit waits for open handles to finish, copies the transaction's
+ * blocks, and lets new handles start again. It then writes the copies to
+ * the journal region, syncs, and writes them to their home locations
+ * (a checkpoint). Commits happen every few seconds, when the running
+ * transaction fills half the journal, and when journal_commit() asks for
+ * one. Mounting an image replays the last transaction if its checkpoint
+ * may not have completed.
+ *
+ * On disk, a transaction of n blocks is laid out from the start of the
+ * journal region as descriptor blocks (listing the home block numbers),
+ * the n block images, and a commit block whose checksum covers the
+ * descriptors and the images.
+ *
+ * File data is not journaled; it is written through the shared mapping.
+ */
+#ifndef JOURNAL_H
+#define JOURNAL_H
+
+#include <stddef.h>
+
+#include "blocks.h"
+
+#define JOURNAL_MAGIC 0x4c4e524a // "JRNL"
+#define JOURNAL_INTERVAL 5       // seconds between periodic commits
+
+/**
+ * Replay the last committed transaction of an image, if needed.
+ *
+ * Called by blocks_init() before the image is mapped. Updates the
+ * journal_seq field of the superblock on disk and in sb.
+ *
+ * @param fd Open file descriptor of the image.
+ * @param sb The superblock, as read from the image.
+ */
+void journal_replay(int fd, superblock_t *sb);
+
+/**
+ * Start journaling the mounted image. Until journal_start() is called,
+ * transactions are only committed when journal_commit() or a full journal
+ * asks for it, by the thread that asked.
+ *
+ * @param fd Open file descriptor of the image.
+ */
+void journal_init(int fd);
+
+/**
+ * Start the thread that commits every JOURNAL_INTERVAL seconds. A process
+ * that daemonizes must call this afterwards, since the thread does not
+ * survive the fork.
+ */
+void journal_start();
+
+/**
+ * Commit everything that is still running and stop journaling.
+ */
+void journal_shutdown();
+
+/**
+ * Start a handle: the caller is about to change metadata.
+ *
+ * Blocks while a commit is copying out the running transaction. Handles do
+ * not nest, and a thread must not wait for a commit while it holds one.
+ */
+void journal_begin();
+
+/**
+ * End a handle started by journal_begin().
+ */
+void journal_end();
+
+/**
+ * Add a metadata block to the running transaction.
+ *
+ * @param bnum Block number.
+ */
+void journal_dirty(int bnum);
+
+/**
+ * Add the metadata blocks covering a byte range to the running transaction.
+ *
+ * @param ptr Start of the range, in the metadata mapping.
+ * @param len Length of the range in bytes.
+ */
+void journal_dirty_range(const void *ptr, size_t len);
+
+/**
+ * Drop freed blocks from the journal, so that stale metadata is never
+ * written over a block that has been reused for file data.
+ *
+ * @param bnum First block of the run.
+ * @param len Number of blocks in the run.
+ */
+void journal_forget(int bnum, int len);
+
+/**
+ * Commit the running transaction and wait until it is on disk.
+ *
+ * Must not be called while holding a handle.
+ *
+ * @return 0 on success, -1 if the image could not be written.
+ */
+int journal_commit();
+
+#endif
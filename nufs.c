@@ -1,205 +1,856 @@
 // based on cs3650 starter code
 
 #include <assert.h>
-#include <bsd/string.h>
-#include <dirent.h>
 #include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
 #include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
 #include <sys/stat.h>
 #include <sys/types.h>
 #include <unistd.h>
 
-#define FUSE_USE_VERSION 26
-#include <fuse.h>
+#define FUSE_USE_VERSION 35
+#include <fuse_lowlevel.h>
 
-// implementation for: man 2 access
-// Checks if a file exists.
-int nufs_access(const char *path, int mask) {
-  int rv = 0;
+#include "blocks.h"
+#include "stats.h"
+#include "storage.h"
+#include "trace.h"
+
+// This is a FUSE low-level file system: the kernel refers to files by inode
+// number, and our inode numbers are used as FUSE inode numbers unchanged.
+// The root directory is inode 1, which is also FUSE_ROOT_ID. Every entry
+// handed to the kernel is counted with storage_ref_ino() until the kernel
+// forgets it, so an inum is never reused while the kernel still uses it.
+
+// How long the kernel may cache names and attributes, in seconds. Every
+// change to the file system goes through the kernel, so its caches can
+// only go stale if the image is changed behind our back.
+#define NUFS_ENTRY_TIMEOUT 1.0
+#define NUFS_ATTR_TIMEOUT 1.0
+
+// Largest read or write request we ask the kernel for. Each one is copied a
+// run of contiguous blocks at a time, so bigger requests mean fewer calls
+// and fewer copies.
+#define NUFS_MAX_IO (1 << 20)
+
+// The read-only /.nufs/stats file shows the counters from stats.h. Neither
+// it nor its directory is in the image: they get inode numbers above any
+// inum, and .nufs is not listed in the root directory.
+#define NUFS_STATS_DIR ".nufs"
+#define NUFS_STATS_FILE "stats"
+#define NUFS_STATS_DIR_INO ((fuse_ino_t) INT_MAX + 1)
+#define NUFS_STATS_FILE_INO ((fuse_ino_t) INT_MAX + 2)
+#define NUFS_STATS_SIZE 8192 // room for the text of the stats file
+
+// Is ino the stats directory or file?
+static int nufs_is_stats(fuse_ino_t ino) {
+  return ino == NUFS_STATS_DIR_INO || ino == NUFS_STATS_FILE_INO;
+}
+
+// Does a name in a directory belong to the stats directory? Such names
+// cannot be created, removed or renamed.
+static int nufs_stats_name(fuse_ino_t parent, const char *name) {
+  return parent == NUFS_STATS_DIR_INO ||
+         (parent == FUSE_ROOT_ID && strcmp(name, NUFS_STATS_DIR) == 0);
+}
 
-  // Only the root directory and our simulated file are accessible for now...
-  if (strcmp(path, "/") == 0 || strcmp(path, "/hello.txt") == 0) {
-    rv = 0;
-  } else { // ...others do not exist
-    rv = -ENOENT;
+// Fills in the attributes of any inode, including the stats directory and
+// file.
+static int nufs_getattr_ino(fuse_ino_t ino, struct stat *st) {
+  if (!nufs_is_stats(ino)) {
+    return storage_getattr(ino, st);
   }
 
-  printf("access(%s, %04o) -> %d\n", path, mask, rv);
-  return rv;
+  // the stats file is read with direct I/O, so its size does not matter
+  memset(st, 0, sizeof(struct stat));
+  st->st_ino = ino;
+  st->st_mode = ino == NUFS_STATS_DIR_INO ? 040555 : 0100444;
+  st->st_nlink = ino == NUFS_STATS_DIR_INO ? 2 : 1;
+  st->st_uid = getuid();
+  st->st_gid = getgid();
+  return 0;
+}
+
+// Fills in the reply to a lookup (or create) of inode ino.
+static int nufs_entry(fuse_ino_t ino, struct fuse_entry_param *e) {
+  memset(e, 0, sizeof(struct fuse_entry_param));
+  e->ino = ino;
+  e->attr_timeout = NUFS_ATTR_TIMEOUT;
+  e->entry_timeout = NUFS_ENTRY_TIMEOUT;
+  if (!nufs_is_stats(ino)) {
+    e->generation = storage_generation_ino(ino);
+  }
+  return nufs_getattr_ino(ino, &e->attr);
+}
+
+// Counts a reference the kernel takes to ino by getting an entry for it.
+static void nufs_ref(fuse_ino_t ino) {
+  if (!nufs_is_stats(ino)) {
+    storage_ref_ino(ino);
+  }
+}
+
+// Drops references the kernel no longer holds.
+static void nufs_unref(fuse_ino_t ino, uint64_t count) {
+  if (!nufs_is_stats(ino)) {
+    storage_forget_ino(ino, count);
+  }
+}
+
+// Replies to a request that created or found inode ino (or failed with a
+// negative errno).
+static void nufs_reply_entry(fuse_req_t req, long ino) {
+  struct fuse_entry_param e;
+  int rv = ino < 0 ? ino : nufs_entry(ino, &e);
+  if (rv < 0) {
+    fuse_reply_err(req, -rv);
+    return;
+  }
+  // counted first, since the kernel may forget it as soon as it has it
+  nufs_ref(ino);
+  if (fuse_reply_entry(req, &e) != 0) {
+    nufs_unref(ino, 1);
+  }
+}
+
+// Negotiates the connection with the kernel.
+static void nufs_init(void *userdata, struct fuse_conn_info *conn) {
+  // let the kernel cache writes and fetch attributes along with readdir
+  if (conn->capable & FUSE_CAP_WRITEBACK_CACHE) {
+    conn->want |= FUSE_CAP_WRITEBACK_CACHE;
+  }
+  if (conn->capable & FUSE_CAP_READDIRPLUS) {
+    conn->want |= FUSE_CAP_READDIRPLUS;
+  }
+  // move file data between /dev/fuse and the image with splice, not copies
+  if (conn->capable & FUSE_CAP_SPLICE_WRITE) {
+    conn->want |= FUSE_CAP_SPLICE_WRITE;
+  }
+  if (conn->capable & FUSE_CAP_SPLICE_READ) {
+    conn->want |= FUSE_CAP_SPLICE_READ;
+  }
+
+  // max_read is a mount option, set in main(); here we raise the write
+  // size and readahead window
+  conn->max_write = NUFS_MAX_IO;
+  conn->max_readahead = NUFS_MAX_IO;
+  TRACE(TRACE_OPS, TRACE_OP_INIT, 0, conn->max_read, conn->max_write,
+        conn->want);
+}
+
+// implementation for: man 2 lookup
+// Finds a name in a directory. Misses are cached by the kernel too.
+static void nufs_lookup(fuse_req_t req, fuse_ino_t parent, const char *name) {
+  uint64_t start = stats_now();
+  long inum;
+  if (parent == NUFS_STATS_DIR_INO) {
+    inum = strcmp(name, NUFS_STATS_FILE) == 0 ? NUFS_STATS_FILE_INO : -ENOENT;
+  } else if (nufs_stats_name(parent, name)) {
+    inum = NUFS_STATS_DIR_INO;
+  } else {
+    inum = storage_lookup(parent, name);
+  }
+  stats_record(STATS_OP_LOOKUP, start, inum);
+  TRACE(TRACE_OPS, TRACE_OP_LOOKUP, parent, 0, 0, inum);
+
+  if (inum == -ENOENT) {
+    struct fuse_entry_param e;
+    memset(&e, 0, sizeof(e));
+    e.entry_timeout = NUFS_ENTRY_TIMEOUT;
+    fuse_reply_entry(req, &e);
+    return;
+  }
+  nufs_reply_entry(req, inum);
+}
+
+// implementation for: man 2 access
+// Checks if a file exists.
+static void nufs_access(fuse_req_t req, fuse_ino_t ino, int mask) {
+  struct stat st;
+  int rv = nufs_getattr_ino(ino, &st);
+  if (rv == 0 && nufs_is_stats(ino) && (mask & W_OK)) {
+    rv = -EACCES;
+  }
+  TRACE(TRACE_OPS, TRACE_OP_ACCESS, ino, 0, mask, rv);
+  fuse_reply_err(req, -rv);
 }
 
 // Gets an object's attributes (type, permissions, size, etc).
 // Implementation for: man 2 stat
 // This is a crucial function.
-int nufs_getattr(const char *path, struct stat *st) {
+static void nufs_getattr(fuse_req_t req, fuse_ino_t ino,
+                         struct fuse_file_info *fi) {
+  uint64_t start = stats_now();
+  struct stat st;
+  int rv = nufs_getattr_ino(ino, &st);
+  stats_record(STATS_OP_GETATTR, start, rv);
+  TRACE(TRACE_OPS, TRACE_OP_GETATTR, ino, 0, 0, rv);
+  if (rv < 0) {
+    fuse_reply_err(req, -rv);
+  } else {
+    fuse_reply_attr(req, &st, NUFS_ATTR_TIMEOUT);
+  }
+}
+
+// Changes attributes: chmod, truncate and utimens all end up here.
+static void nufs_setattr(fuse_req_t req, fuse_ino_t ino, struct stat *attr,
+                         int to_set, struct fuse_file_info *fi) {
   int rv = 0;
+  if (nufs_is_stats(ino)) {
+    rv = -EPERM;
+  }
+  if (rv == 0 && (to_set & (FUSE_SET_ATTR_UID | FUSE_SET_ATTR_GID))) {
+    rv = storage_chown_ino(ino,
+                           to_set & FUSE_SET_ATTR_UID ? attr->st_uid : -1,
+                           to_set & FUSE_SET_ATTR_GID ? attr->st_gid : -1);
+  }
+  if (rv == 0 && (to_set & FUSE_SET_ATTR_MODE)) {
+    rv = storage_chmod_ino(ino, attr->st_mode);
+  }
+  if (rv == 0 && (to_set & FUSE_SET_ATTR_SIZE)) {
+    rv = storage_truncate_ino(ino, attr->st_size);
+  }
+  // utimensat: each time is left alone, set to now, or set as given
+  int set[2] = {FUSE_SET_ATTR_ATIME, FUSE_SET_ATTR_MTIME};
+  int now[2] = {FUSE_SET_ATTR_ATIME_NOW, FUSE_SET_ATTR_MTIME_NOW};
+  if (rv == 0 && (to_set & (set[0] | set[1] | now[0] | now[1]))) {
+    struct timespec ts[2] = {attr->st_atim, attr->st_mtim};
+    for (int ii = 0; ii < 2; ++ii) {
+      if (to_set & now[ii]) {
+        ts[ii].tv_nsec = UTIME_NOW;
+      } else if (!(to_set & set[ii])) {
+        ts[ii].tv_nsec = UTIME_OMIT;
+      }
+    }
+    rv = storage_utimens_ino(ino, ts);
+  }
 
-  // Return some metadata for the root directory...
-  if (strcmp(path, "/") == 0) {
-    st->st_mode = 040755; // directory
-    st->st_size = 0;
-    st->st_uid = getuid();
-  }
-  // ...and the simulated file...
-  else if (strcmp(path, "/hello.txt") == 0) {
-    st->st_mode = 0100644; // regular file
-    st->st_size = 6;
-    st->st_uid = getuid();
-  } else { // ...other files do not exist on this filesystem
-    rv = -ENOENT;
-  }
-  printf("getattr(%s) -> (%d) {mode: %04o, size: %ld}\n", path, rv, st->st_mode,
-         st->st_size);
-  return rv;
+  struct stat st;
+  if (rv == 0) {
+    rv = storage_getattr(ino, &st);
+  }
+  TRACE(TRACE_OPS, TRACE_OP_SETATTR, ino, attr->st_size, to_set, rv);
+  if (rv < 0) {
+    fuse_reply_err(req, -rv);
+  } else {
+    fuse_reply_attr(req, &st, NUFS_ATTR_TIMEOUT);
+  }
 }
 
-// implementation for: man 2 readdir
-// lists the contents of a directory
-int nufs_readdir(const char *path, void *buf, fuse_fill_dir_t filler,
-                 off_t offset, struct fuse_file_info *fi) {
-  struct stat st;
-  int rv;
+// state passed through storage_readdir_ino to nufs_readdir_fill
+typedef struct readdir_ctx {
+  fuse_req_t req;
+  char *buf;
+  size_t size;      // bytes available in buf
+  size_t used;      // bytes filled in so far
+  int plus;         // readdirplus: include full attributes
+  fuse_ino_t *refs; // readdirplus: entries counted with nufs_ref()
+  int nrefs;
+  int refs_cap;
+} readdir_ctx_t;
 
-  rv = nufs_getattr("/", &st);
-  assert(rv == 0);
+// adds one directory entry, with the attributes of its inode, to the reply,
+// returning 1 once the buffer is full
+static int nufs_readdir_add(readdir_ctx_t *rc, const char *name,
+                            const struct stat *st, off_t next) {
+  char *buf = rc->buf + rc->used;
+  size_t left = rc->size - rc->used;
+  size_t len;
 
-  filler(buf, ".", &st, 0);
+  if (rc->plus) {
+    struct fuse_entry_param e;
+    memset(&e, 0, sizeof(e));
+    e.ino = st->st_ino;
+    e.attr = *st;
+    e.attr_timeout = NUFS_ATTR_TIMEOUT;
+    e.entry_timeout = NUFS_ENTRY_TIMEOUT;
+    if (!nufs_is_stats(e.ino)) {
+      e.generation = storage_generation_ino(e.ino);
+    }
+    len = fuse_add_direntry_plus(rc->req, buf, left, name, &e, next);
+  } else {
+    len = fuse_add_direntry(rc->req, buf, left, name, st, next);
+  }
 
-  rv = nufs_getattr("/hello.txt", &st);
-  assert(rv == 0);
-  filler(buf, "hello.txt", &st, 0);
+  if (len > left) {
+    return 1;
+  }
 
-  printf("readdir(%s) -> %d\n", path, rv);
+  // the kernel takes a reference to each entry but "." and ".."
+  if (rc->plus && strcmp(name, ".") != 0 && strcmp(name, "..") != 0) {
+    if (rc->nrefs == rc->refs_cap) {
+      int cap = rc->refs_cap ? rc->refs_cap * 2 : 64;
+      fuse_ino_t *refs = realloc(rc->refs, cap * sizeof(fuse_ino_t));
+      if (refs == NULL) {
+        return 1;
+      }
+      rc->refs = refs;
+      rc->refs_cap = cap;
+    }
+    rc->refs[rc->nrefs++] = st->st_ino;
+    nufs_ref(st->st_ino);
+  }
+  rc->used += len;
   return 0;
 }
 
+// storage_readdir_ino() callback: adds an entry of an image directory
+static int nufs_readdir_fill(void *ctx, const char *name,
+                             const struct stat *st, off_t next) {
+  return nufs_readdir_add(ctx, name, st, next);
+}
+
+// Lists the stats directory; offset n resumes after its nth entry.
+static int nufs_readdir_stats(readdir_ctx_t *rc, off_t offset) {
+  const char *names[] = {".", "..", NUFS_STATS_FILE};
+  fuse_ino_t inos[] = {NUFS_STATS_DIR_INO, FUSE_ROOT_ID, NUFS_STATS_FILE_INO};
+  for (off_t ii = offset; ii < 3; ++ii) {
+    struct stat st;
+    if (nufs_getattr_ino(inos[ii], &st) == 0 &&
+        nufs_readdir_add(rc, names[ii], &st, ii + 1)) {
+      break;
+    }
+  }
+  return 0;
+}
+
+// Lists a directory, starting at offset, for readdir and readdirplus.
+static void nufs_readdir_common(fuse_req_t req, fuse_ino_t ino, size_t size,
+                                off_t offset, int plus) {
+  char *buf = malloc(size);
+  if (buf == NULL) {
+    fuse_reply_err(req, ENOMEM);
+    return;
+  }
+
+  uint64_t start = stats_now();
+  readdir_ctx_t ctx = {req, buf, size, 0, plus, NULL, 0, 0};
+  int rv;
+  if (ino == NUFS_STATS_DIR_INO) {
+    rv = nufs_readdir_stats(&ctx, offset);
+  } else if (ino == NUFS_STATS_FILE_INO) {
+    rv = -ENOTDIR;
+  } else {
+    rv = storage_readdir_ino(ino, offset, nufs_readdir_fill, &ctx);
+  }
+  stats_record(STATS_OP_READDIR, start, rv);
+  TRACE(TRACE_OPS, plus ? TRACE_OP_READDIRPLUS : TRACE_OP_READDIR, ino, offset,
+        ctx.used, rv);
+  int failed;
+  if (rv < 0) {
+    failed = 1;
+    fuse_reply_err(req, -rv);
+  } else {
+    failed = fuse_reply_buf(req, buf, ctx.used) != 0;
+  }
+  if (failed) { // the kernel never saw these entries
+    for (int ii = 0; ii < ctx.nrefs; ++ii) {
+      nufs_unref(ctx.refs[ii], 1);
+    }
+  }
+  free(ctx.refs);
+  free(buf);
+}
+
+// implementation for: man 2 readdir
+// lists the contents of a directory, resuming at offset
+static void nufs_readdir(fuse_req_t req, fuse_ino_t ino, size_t size,
+                         off_t offset, struct fuse_file_info *fi) {
+  nufs_readdir_common(req, ino, size, offset, 0);
+}
+
+// readdir that also returns the attributes of each entry, saving the
+// kernel a lookup per entry
+static void nufs_readdirplus(fuse_req_t req, fuse_ino_t ino, size_t size,
+                             off_t offset, struct fuse_file_info *fi) {
+  nufs_readdir_common(req, ino, size, offset, 1);
+}
+
+// Makes name in parent, owned by the process that asked for it.
+static int nufs_mknod_as(fuse_req_t req, fuse_ino_t parent, const char *name,
+                         mode_t mode) {
+  if (nufs_stats_name(parent, name)) {
+    return -EPERM;
+  }
+  const struct fuse_ctx *ctx = fuse_req_ctx(req);
+  return storage_mknod_at(parent, name, mode, ctx->uid, ctx->gid);
+}
+
 // mknod makes a filesystem object like a file or directory
-// called for: man 2 open, man 2 link
-// Note, for this assignment, you can alternatively implement the create
-// function.
-int nufs_mknod(const char *path, mode_t mode, dev_t rdev) {
-  int rv = -1;
-  printf("mknod(%s, %04o) -> %d\n", path, mode, rv);
-  return rv;
+// called for: man 2 mknod
+static void nufs_mknod(fuse_req_t req, fuse_ino_t parent, const char *name,
+                       mode_t mode, dev_t rdev) {
+  uint64_t start = stats_now();
+  int inum = nufs_mknod_as(req, parent, name, mode);
+  stats_record(STATS_OP_MKNOD, start, inum);
+  TRACE(TRACE_OPS, TRACE_OP_MKNOD, parent, 0, mode, inum);
+  nufs_reply_entry(req, inum);
 }
 
 // most of the following callbacks implement
 // another system call; see section 2 of the manual
-int nufs_mkdir(const char *path, mode_t mode) {
-  int rv = nufs_mknod(path, mode | 040000, 0);
-  printf("mkdir(%s) -> %d\n", path, rv);
-  return rv;
+static void nufs_mkdir(fuse_req_t req, fuse_ino_t parent, const char *name,
+                       mode_t mode) {
+  uint64_t start = stats_now();
+  int inum = nufs_mknod_as(req, parent, name, mode | 040000);
+  stats_record(STATS_OP_MKNOD, start, inum);
+  TRACE(TRACE_OPS, TRACE_OP_MKDIR, parent, 0, mode, inum);
+  nufs_reply_entry(req, inum);
 }
 
-int nufs_unlink(const char *path) {
-  int rv = -1;
-  printf("unlink(%s) -> %d\n", path, rv);
-  return rv;
+// creates and opens a file in one step (open with O_CREAT)
+static void nufs_create(fuse_req_t req, fuse_ino_t parent, const char *name,
+                        mode_t mode, struct fuse_file_info *fi) {
+  uint64_t start = stats_now();
+  int inum = nufs_mknod_as(req, parent, name, mode);
+  stats_record(STATS_OP_MKNOD, start, inum);
+  TRACE(TRACE_OPS, TRACE_OP_CREATE, parent, 0, mode, inum);
+
+  struct fuse_entry_param e;
+  int rv = inum < 0 ? inum : nufs_entry(inum, &e);
+  if (rv == 0) {
+    rv = storage_open_ino(inum);
+  }
+  if (rv < 0) {
+    fuse_reply_err(req, -rv);
+    return;
+  }
+  fi->keep_cache = 1;
+  nufs_ref(inum);
+  if (fuse_reply_create(req, &e, fi) != 0) {
+    storage_close_ino(inum); // the kernel will not release it
+    nufs_unref(inum, 1);
+  }
 }
 
-int nufs_link(const char *from, const char *to) {
-  int rv = -1;
-  printf("link(%s => %s) -> %d\n", from, to, rv);
-  return rv;
+static void nufs_unlink(fuse_req_t req, fuse_ino_t parent, const char *name) {
+  uint64_t start = stats_now();
+  int rv = nufs_stats_name(parent, name) ? -EPERM
+                                         : storage_unlink_at(parent, name);
+  stats_record(STATS_OP_UNLINK, start, rv);
+  TRACE(TRACE_OPS, TRACE_OP_UNLINK, parent, 0, 0, rv);
+  fuse_reply_err(req, -rv);
 }
 
-int nufs_rmdir(const char *path) {
-  int rv = -1;
-  printf("rmdir(%s) -> %d\n", path, rv);
-  return rv;
+static void nufs_link(fuse_req_t req, fuse_ino_t ino, fuse_ino_t newparent,
+                      const char *newname) {
+  int rv = nufs_is_stats(ino) || nufs_stats_name(newparent, newname)
+               ? -EPERM
+               : storage_link_at(ino, newparent, newname);
+  TRACE(TRACE_OPS, TRACE_OP_LINK, ino, newparent, 0, rv);
+  nufs_reply_entry(req, rv < 0 ? rv : (int) ino);
+}
+
+static void nufs_rmdir(fuse_req_t req, fuse_ino_t parent, const char *name) {
+  uint64_t start = stats_now();
+  int rv = nufs_stats_name(parent, name) ? -EPERM
+                                         : storage_rmdir_at(parent, name);
+  stats_record(STATS_OP_UNLINK, start, rv);
+  TRACE(TRACE_OPS, TRACE_OP_RMDIR, parent, 0, 0, rv);
+  fuse_reply_err(req, -rv);
 }
 
 // implements: man 2 rename
 // called to move a file within the same filesystem
-int nufs_rename(const char *from, const char *to) {
-  int rv = -1;
-  printf("rename(%s => %s) -> %d\n", from, to, rv);
-  return rv;
+static void nufs_rename(fuse_req_t req, fuse_ino_t parent, const char *name,
+                        fuse_ino_t newparent, const char *newname,
+                        unsigned int flags) {
+  // RENAME_NOREPLACE and RENAME_EXCHANGE are not supported
+  uint64_t start = stats_now();
+  int rv;
+  if (flags) {
+    rv = -EINVAL;
+  } else if (nufs_stats_name(parent, name) ||
+             nufs_stats_name(newparent, newname)) {
+    rv = -EPERM;
+  } else {
+    rv = storage_rename_at(parent, name, newparent, newname);
+  }
+  stats_record(STATS_OP_RENAME, start, rv);
+  TRACE(TRACE_OPS, TRACE_OP_RENAME, parent, newparent, flags, rv);
+  fuse_reply_err(req, -rv);
 }
 
-int nufs_chmod(const char *path, mode_t mode) {
-  int rv = -1;
-  printf("chmod(%s, %04o) -> %d\n", path, mode, rv);
-  return rv;
+// The text of the stats file, as of when it was opened.
+typedef struct stats_text {
+  size_t len;
+  char buf[NUFS_STATS_SIZE];
+} stats_text_t;
+
+// Opens the stats file, taking a snapshot of the counters so that reads
+// see consistent text.
+static void nufs_open_stats(fuse_req_t req, struct fuse_file_info *fi) {
+  if ((fi->flags & O_ACCMODE) != O_RDONLY) {
+    fuse_reply_err(req, EACCES);
+    return;
+  }
+  stats_text_t *text = malloc(sizeof(stats_text_t));
+  if (text == NULL) {
+    fuse_reply_err(req, ENOMEM);
+    return;
+  }
+  text->len = stats_format(text->buf, sizeof(text->buf));
+  fi->fh = (uintptr_t) text;
+  fi->direct_io = 1;
+  fuse_reply_open(req, fi);
 }
 
-int nufs_truncate(const char *path, off_t size) {
-  int rv = -1;
-  printf("truncate(%s, %ld bytes) -> %d\n", path, size, rv);
-  return rv;
+// Requests name files by inode number, so an open file needs no handle of
+// its own. Opening only counts the open, which keeps the file alive if its
+// last name is removed while it is open, as POSIX requires.
+static void nufs_open(fuse_req_t req, fuse_ino_t ino,
+                      struct fuse_file_info *fi) {
+  if (ino == NUFS_STATS_FILE_INO) {
+    TRACE(TRACE_OPS, TRACE_OP_OPEN, ino, 0, fi->flags, 0);
+    nufs_open_stats(req, fi);
+    return;
+  }
+  int rv = nufs_is_stats(ino) ? -EISDIR : storage_open_ino(ino);
+  TRACE(TRACE_OPS, TRACE_OP_OPEN, ino, 0, fi->flags, rv);
+  if (rv < 0) {
+    fuse_reply_err(req, -rv);
+    return;
+  }
+
+  // only we change files, so cached pages stay valid across opens
+  fi->keep_cache = 1;
+  if (fuse_reply_open(req, fi) != 0) {
+    storage_close_ino(ino); // the kernel will not release it
+  }
 }
 
-// This is called on open, but doesn't need to do much
-// since FUSE doesn't assume you maintain state for
-// open files.
-// You can just check whether the file is accessible.
-int nufs_open(const char *path, struct fuse_file_info *fi) {
-  int rv = 0;
-  printf("open(%s) -> %d\n", path, rv);
+// Holes are sent from here, NUFS_MAX_IO bytes at a time.
+static char nufs_zeros[NUFS_MAX_IO];
+
+// Describe the pieces of a file as a fuse_bufvec. Blocks are given as
+// ranges of the image file, so libfuse can splice them straight between
+// the image and the kernel; inline data and holes are given as memory.
+// Returns NULL if out of memory.
+static struct fuse_bufvec *nufs_bufvec(int fd, const storage_seg_t *segs,
+                                       int count) {
+  size_t bufs = 1;
+  for (int ii = 0; ii < count; ++ii) {
+    bufs += segs[ii].mem == NULL ? segs[ii].len / NUFS_MAX_IO + 1 : 1;
+  }
+  struct fuse_bufvec *bufv =
+      calloc(1, sizeof(struct fuse_bufvec) + bufs * sizeof(struct fuse_buf));
+  if (bufv == NULL) {
+    return NULL;
+  }
+
+  for (int ii = 0; ii < count; ++ii) {
+    const storage_seg_t *seg = &segs[ii];
+    for (size_t done = 0; done < seg->len;) {
+      struct fuse_buf *buf = &bufv->buf[bufv->count++];
+      buf->size = seg->len - done;
+      if (seg->pos >= 0) {
+        buf->flags = FUSE_BUF_IS_FD | FUSE_BUF_FD_SEEK;
+        buf->fd = fd;
+        buf->pos = seg->pos;
+      } else if (seg->mem != NULL) {
+        buf->mem = seg->mem;
+      } else {
+        buf->mem = nufs_zeros;
+        if (buf->size > NUFS_MAX_IO) {
+          buf->size = NUFS_MAX_IO;
+        }
+      }
+      done += buf->size;
+    }
+  }
+  return bufv;
+}
+
+// state passed through storage_read_buf_ino to nufs_read_segs
+typedef struct nufs_read_reply {
+  fuse_req_t req;
+  int sent; // the read has been replied to
+} nufs_read_reply_t;
+
+// Reply to a read with the pieces of the file it covers.
+static ssize_t nufs_read_segs(void *ctx, int fd, const storage_seg_t *segs,
+                              int count) {
+  nufs_read_reply_t *reply = ctx;
+  struct fuse_bufvec *bufv = nufs_bufvec(fd, segs, count);
+  if (bufv == NULL) {
+    return -ENOMEM;
+  }
+  size_t size = fuse_buf_size(bufv);
+  int rv = fuse_reply_data(reply->req, bufv, 0);
+  reply->sent = 1;
+  free(bufv);
+  return rv < 0 ? rv : (ssize_t) size;
+}
+
+// Copy the data of a write into the pieces of the file it covers.
+static ssize_t nufs_write_segs(void *ctx, int fd, const storage_seg_t *segs,
+                               int count) {
+  struct fuse_bufvec *dst = nufs_bufvec(fd, segs, count);
+  if (dst == NULL) {
+    return -ENOMEM;
+  }
+  ssize_t rv = fuse_buf_copy(dst, ctx, 0);
+  free(dst);
   return rv;
 }
 
 // Actually read data
-int nufs_read(const char *path, char *buf, size_t size, off_t offset,
-              struct fuse_file_info *fi) {
-  int rv = 6;
-  strcpy(buf, "hello\n");
-  printf("read(%s, %ld bytes, @+%ld) -> %d\n", path, size, offset, rv);
-  return rv;
+static void nufs_read(fuse_req_t req, fuse_ino_t ino, size_t size,
+                      off_t offset, struct fuse_file_info *fi) {
+  if (ino == NUFS_STATS_FILE_INO) {
+    stats_text_t *text = (stats_text_t *) (uintptr_t) fi->fh;
+    size_t off = offset < text->len ? offset : text->len;
+    size_t len = size < text->len - off ? size : text->len - off;
+    fuse_reply_buf(req, text->buf + off, len);
+    return;
+  }
+
+  nufs_read_reply_t reply = {req, 0};
+  uint64_t start = stats_now();
+  ssize_t rv = storage_read_buf_ino(ino, size, offset, nufs_read_segs, &reply);
+  stats_record(STATS_OP_READ, start, rv);
+  TRACE(TRACE_OPS, TRACE_OP_READ, ino, offset, size, rv);
+  if (reply.sent) {
+    return;
+  }
+  if (rv < 0) {
+    fuse_reply_err(req, -rv);
+  } else {
+    fuse_reply_buf(req, NULL, 0); // at or past the end of the file
+  }
 }
 
-// Actually write data
-int nufs_write(const char *path, const char *buf, size_t size, off_t offset,
-               struct fuse_file_info *fi) {
-  int rv = -1;
-  printf("write(%s, %ld bytes, @+%ld) -> %d\n", path, size, offset, rv);
-  return rv;
+// Actually write data. The data may still be in the pipe libfuse spliced it
+// into from the kernel, and goes from there into the image file.
+static void nufs_write_buf(fuse_req_t req, fuse_ino_t ino,
+                           struct fuse_bufvec *bufv, off_t offset,
+                           struct fuse_file_info *fi) {
+  size_t size = fuse_buf_size(bufv);
+  uint64_t start = stats_now();
+  ssize_t rv = storage_write_buf_ino(ino, size, offset, nufs_write_segs, bufv);
+  stats_record(STATS_OP_WRITE, start, rv);
+  TRACE(TRACE_OPS, TRACE_OP_WRITE, ino, offset, size, rv);
+  if (rv < 0) {
+    fuse_reply_err(req, -rv);
+  } else {
+    fuse_reply_write(req, rv);
+  }
 }
 
-// Update the timestamps on a file or directory.
-int nufs_utimens(const char *path, const struct timespec ts[2]) {
-  int rv = -1;
-  printf("utimens(%s, [%ld, %ld; %ld %ld]) -> %d\n", path, ts[0].tv_sec,
-         ts[0].tv_nsec, ts[1].tv_sec, ts[1].tv_nsec, rv);
-  return rv;
+// Called on every close of a file: start writing its data back, but leave
+// waiting for it to fsync.
+static void nufs_flush(fuse_req_t req, fuse_ino_t ino,
+                       struct fuse_file_info *fi) {
+  int rv = nufs_is_stats(ino) ? 0 : storage_flush_ino(ino);
+  TRACE(TRACE_OPS, TRACE_OP_FLUSH, ino, 0, 0, rv);
+  fuse_reply_err(req, -rv);
+}
+
+// implementation for: man 2 fsync
+// Writes back only this file's dirty blocks, then commits the metadata
+// journal. Metadata is always committed, even for fdatasync, since it is
+// what makes newly written blocks part of the file.
+static void nufs_fsync(fuse_req_t req, fuse_ino_t ino, int datasync,
+                       struct fuse_file_info *fi) {
+  int rv = nufs_is_stats(ino) ? 0 : storage_fsync_ino(ino);
+  TRACE(TRACE_OPS, TRACE_OP_FSYNC, ino, 0, datasync, rv);
+  fuse_reply_err(req, -rv);
+}
+
+// Directories are metadata, so syncing one only needs a journal commit.
+static void nufs_fsyncdir(fuse_req_t req, fuse_ino_t ino, int datasync,
+                          struct fuse_file_info *fi) {
+  int rv = nufs_is_stats(ino) ? 0 : storage_fsync_ino(ino);
+  TRACE(TRACE_OPS, TRACE_OP_FSYNCDIR, ino, 0, datasync, rv);
+  fuse_reply_err(req, -rv);
+}
+
+// Called when the last reference to an open file goes away.
+static void nufs_release(fuse_req_t req, fuse_ino_t ino,
+                         struct fuse_file_info *fi) {
+  if (ino == NUFS_STATS_FILE_INO) {
+    free((stats_text_t *) (uintptr_t) fi->fh);
+  } else {
+    storage_close_ino(ino);
+  }
+  fuse_reply_err(req, 0);
+}
+
+// The kernel dropped nlookup references to ino, taken by entries it was
+// given. No reply is sent.
+static void nufs_forget(fuse_req_t req, fuse_ino_t ino, uint64_t nlookup) {
+  nufs_unref(ino, nlookup);
+  fuse_reply_none(req);
+}
+
+// forget for many inodes at once
+static void nufs_forget_multi(fuse_req_t req, size_t count,
+                              struct fuse_forget_data *forgets) {
+  for (size_t ii = 0; ii < count; ++ii) {
+    nufs_unref(forgets[ii].ino, forgets[ii].nlookup);
+  }
+  fuse_reply_none(req);
+}
+
+// implementation for: man 2 fallocate
+// Supports reserving space (with or without FALLOC_FL_KEEP_SIZE) and
+// FALLOC_FL_PUNCH_HOLE.
+static void nufs_fallocate(fuse_req_t req, fuse_ino_t ino, int mode,
+                           off_t offset, off_t length,
+                           struct fuse_file_info *fi) {
+  int rv = -EOPNOTSUPP;
+  if (!nufs_is_stats(ino)) {
+    rv = storage_fallocate_ino(ino, mode, offset, length);
+  }
+  TRACE(TRACE_OPS, TRACE_OP_FALLOCATE, ino, offset, length, rv);
+  fuse_reply_err(req, -rv);
+}
+
+// implementation for: man 2 copy_file_range
+// The data never leaves the image: whole blocks end up shared by both files
+// where the offsets allow it, and are copied otherwise. cp --reflink ends up
+// here too, since the kernel does not pass FICLONE on to FUSE.
+static void nufs_copy_file_range(fuse_req_t req, fuse_ino_t ino_in,
+                                 off_t off_in, struct fuse_file_info *fi_in,
+                                 fuse_ino_t ino_out, off_t off_out,
+                                 struct fuse_file_info *fi_out, size_t len,
+                                 int flags) {
+  ssize_t rv;
+  if (flags != 0) {
+    rv = -EINVAL;
+  } else if (nufs_is_stats(ino_in) || nufs_is_stats(ino_out)) {
+    rv = -EOPNOTSUPP; // the kernel falls back to reading and writing
+  } else {
+    rv = storage_copy_range_ino(ino_in, off_in, ino_out, off_out, len);
+  }
+  TRACE(TRACE_OPS, TRACE_OP_COPY_RANGE, ino_out, off_out, len, rv);
+  if (rv < 0) {
+    fuse_reply_err(req, -rv);
+  } else {
+    fuse_reply_write(req, rv);
+  }
+}
+
+// implementation for: man 2 lseek, for SEEK_DATA and SEEK_HOLE only; the
+// kernel handles the other kinds of seek itself.
+static void nufs_lseek(fuse_req_t req, fuse_ino_t ino, off_t off, int whence,
+                       struct fuse_file_info *fi) {
+  off_t rv = nufs_is_stats(ino) ? -EINVAL : storage_lseek_ino(ino, off, whence);
+  TRACE(TRACE_OPS, TRACE_OP_LSEEK, ino, off, whence, rv);
+  if (rv < 0) {
+    fuse_reply_err(req, -rv);
+  } else {
+    fuse_reply_lseek(req, rv);
+  }
 }
 
 // Extended operations
-int nufs_ioctl(const char *path, int cmd, void *arg, struct fuse_file_info *fi,
-               unsigned int flags, void *data) {
-  int rv = -1;
-  printf("ioctl(%s, %d, ...) -> %d\n", path, cmd, rv);
-  return rv;
+// NUFS_IOC_STATS (see stats.h) works on any file or directory.
+static void nufs_ioctl(fuse_req_t req, fuse_ino_t ino, unsigned int cmd,
+                       void *arg, struct fuse_file_info *fi, unsigned flags,
+                       const void *in_buf, size_t in_bufsz, size_t out_bufsz) {
+  int rv = -ENOTTY;
+  if (flags & FUSE_IOCTL_COMPAT) {
+    rv = -ENOSYS;
+  } else if (cmd == NUFS_IOC_STATS) {
+    rv = out_bufsz < sizeof(nufs_stats_t) ? -EINVAL : 0;
+  }
+  TRACE(TRACE_OPS, TRACE_OP_IOCTL, ino, 0, cmd, rv);
+  if (rv < 0) {
+    fuse_reply_err(req, -rv);
+    return;
+  }
+
+  nufs_stats_t st;
+  stats_get(&st);
+  fuse_reply_ioctl(req, 0, &st, sizeof(st));
 }
 
-void nufs_init_ops(struct fuse_operations *ops) {
-  memset(ops, 0, sizeof(struct fuse_operations));
-  ops->access = nufs_access;
-  ops->getattr = nufs_getattr;
-  ops->readdir = nufs_readdir;
-  ops->mknod = nufs_mknod;
-  // ops->create   = nufs_create; // alternative to mknod
-  ops->mkdir = nufs_mkdir;
-  ops->link = nufs_link;
-  ops->unlink = nufs_unlink;
-  ops->rmdir = nufs_rmdir;
-  ops->rename = nufs_rename;
-  ops->chmod = nufs_chmod;
-  ops->truncate = nufs_truncate;
-  ops->open = nufs_open;
-  ops->read = nufs_read;
-  ops->write = nufs_write;
-  ops->utimens = nufs_utimens;
-  ops->ioctl = nufs_ioctl;
+static const struct fuse_lowlevel_ops nufs_ops = {
+    .init = nufs_init,
+    .lookup = nufs_lookup,
+    .forget = nufs_forget,
+    .forget_multi = nufs_forget_multi,
+    .access = nufs_access,
+    .getattr = nufs_getattr,
+    .setattr = nufs_setattr,
+    .readdir = nufs_readdir,
+    .readdirplus = nufs_readdirplus,
+    .mknod = nufs_mknod,
+    .mkdir = nufs_mkdir,
+    .create = nufs_create,
+    .link = nufs_link,
+    .unlink = nufs_unlink,
+    .rmdir = nufs_rmdir,
+    .rename = nufs_rename,
+    .open = nufs_open,
+    .read = nufs_read,
+    .write_buf = nufs_write_buf,
+    .flush = nufs_flush,
+    .fsync = nufs_fsync,
+    .fsyncdir = nufs_fsyncdir,
+    .release = nufs_release,
+    .ioctl = nufs_ioctl,
+    .lseek = nufs_lseek,
+    .fallocate = nufs_fallocate,
+    .copy_file_range = nufs_copy_file_range,
 };
 
-struct fuse_operations nufs_ops;
-
 int main(int argc, char *argv[]) {
   assert(argc > 2 && argc < 6);
-  printf("TODO: mount %s as data file\n", argv[--argc]);
-  // storage_init(argv[--argc]);
-  nufs_init_ops(&nufs_ops);
-  return fuse_main(argc, argv, &nufs_ops, NULL);
+  const char *image = argv[--argc];
+  trace_init();
+
+  struct fuse_args args = FUSE_ARGS_INIT(argc, argv);
+  struct fuse_cmdline_opts opts;
+  if (fuse_parse_cmdline(&args, &opts) != 0 || opts.mountpoint == NULL) {
+    fprintf(stderr, "usage: %s [-s] [-f] [-d] mountpoint image\n", argv[0]);
+    return 1;
+  }
+
+  // ahead of the user's options, so an explicit -o max_read still wins
+  char max_read[32];
+  snprintf(max_read, sizeof(max_read), "-omax_read=%d", NUFS_MAX_IO);
+  fuse_opt_insert_arg(&args, 1, max_read);
+
+  // a bad image is reported, and the journal replayed, before mounting
+  storage_init(image);
+  assert(blocks_super()->root_inum == FUSE_ROOT_ID);
+
+  int rv = 1;
+  struct fuse_session *se =
+      fuse_session_new(&args, &nufs_ops, sizeof(nufs_ops), NULL);
+  if (se != NULL && fuse_set_signal_handlers(se) == 0) {
+    if (fuse_session_mount(se, opts.mountpoint) == 0) {
+      fuse_daemonize(opts.foreground);
+
+      // threads do not survive daemonizing, so they start afterwards
+      storage_start();
+      stats_init();
+
+      if (opts.singlethread) {
+        rv = fuse_session_loop(se);
+      } else {
+        struct fuse_loop_config config;
+        memset(&config, 0, sizeof(config));
+        config.clone_fd = opts.clone_fd;
+        config.max_idle_threads = opts.max_idle_threads;
+        rv = fuse_session_loop_mt(se, &config);
+      }
+      fuse_session_unmount(se);
+    }
+    fuse_remove_signal_handlers(se);
+  }
+  if (se != NULL) {
+    fuse_session_destroy(se);
+  }
+  storage_free();
+  trace_dump();
+
+  free(opts.mountpoint);
+  fuse_opt_free_args(&args);
+  return rv == 0 ? 0 : 1;
 }
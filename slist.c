@@ -7,7 +7,6 @@
  * This might be useful for directory listings and for manipulating paths.
  */
 
-#include <alloca.h>
 #include <stdlib.h>
 #include <string.h>
 
@@ -36,24 +35,48 @@ void s_free(slist_t *xs) {
 }
 
 slist_t *s_explode(const char *text, char delim) {
-  if (*text == 0) {
-    return 0;
+  slist_t *head = 0;
+  slist_t **tail = &head;
+
+  // build the list front to back, so long strings cannot exhaust the stack
+  while (*text != 0) {
+    int plen = 0;
+    while (text[plen] != 0 && text[plen] != delim) {
+      plen += 1;
+    }
+
+    slist_t *xs = malloc(sizeof(slist_t));
+    xs->data = strndup(text, plen);
+    xs->refs = 1;
+    xs->next = 0;
+    *tail = xs;
+    tail = &xs->next;
+
+    text += plen;
+    if (*text == delim) {
+      text += 1;
+    }
+  }
+
+  return head;
+}
+
+int s_next_part(const char **text, char delim, char *buf, int size) {
+  const char *pos = *text;
+  while (*pos == delim) {
+    pos += 1;
   }
 
   int plen = 0;
-  while (text[plen] != 0 && text[plen] != delim) {
+  while (pos[plen] != 0 && pos[plen] != delim) {
     plen += 1;
   }
+  *text = pos + plen;
 
-  int skip = 0;
-  if (text[plen] == delim) {
-    skip = 1;
+  if (plen >= size) {
+    return -1;
   }
-
-  slist_t *rest = s_explode(text + plen + skip, delim);
-  char *part = alloca(plen + 2);
-  memcpy(part, text, plen);
-  part[plen] = 0;
-
-  return s_cons(part, rest);
+  memcpy(buf, pos, plen);
+  buf[plen] = 0;
+  return plen;
 }
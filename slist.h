@@ -23,14 +23,14 @@ typedef struct slist {
  *
  * @return List starting with the given string in front of the original list.
  */
-slist_t *slist_cons(const char *text, slist_t *rest);
+slist_t *s_cons(const char *text, slist_t *rest);
 
 /** 
  * Free the given string list.
  *
  * @param xs List of strings to free.
  */
-void slist_free(slist_t *xs);
+void s_free(slist_t *xs);
 
 /**
  * Split the given on the given delimiter into a list of strings.
@@ -42,6 +42,26 @@ void slist_free(slist_t *xs);
  *
  * @return a list containing all the substrings
  */
-slist_t *slist_explode(const char *text, char delim);
+slist_t *s_explode(const char *text, char delim);
+
+/**
+ * Copy the next non-empty part of a delimited string into a buffer.
+ *
+ * This walks the string in place, without allocating, so it suits hot
+ * paths like resolving a path one component at a time:
+ *
+ *   const char *rest = path;
+ *   char part[SIZE];
+ *   while (s_next_part(&rest, '/', part, SIZE) > 0) { ... }
+ *
+ * @param text Position in the string; advanced past the part returned.
+ * @param delim A single character to use as the delimiter.
+ * @param buf Buffer the part is copied into (NUL terminated).
+ * @param size Size of buf in bytes.
+ *
+ * @return Length of the part, 0 if no parts are left, or -1 if the part
+ *         does not fit in buf.
+ */
+int s_next_part(const char **text, char delim, char *buf, int size);
 
 #endif
@@ -0,0 +1,199 @@
+/**
+ * @file stats.c
+ *
+ * Operation counters and latency histograms.
+ */
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+
+#include "blocks.h"
+#include "compress.h"
+#include "dedup.h"
+#include "stats.h"
+
+// Counters are updated with relaxed atomics: every request adds to them,
+// and readers only need each counter to be whole, not a consistent set.
+static nufs_op_stats_t stats_ops[STATS_OP_COUNT];
+static uint64_t stats_start;
+
+static const char *stats_op_names[STATS_OP_COUNT] = {
+    [STATS_OP_GETATTR] = "getattr", [STATS_OP_LOOKUP] = "lookup",
+    [STATS_OP_READ] = "read",       [STATS_OP_WRITE] = "write",
+    [STATS_OP_MKNOD] = "mknod",     [STATS_OP_UNLINK] = "unlink",
+    [STATS_OP_RENAME] = "rename",   [STATS_OP_READDIR] = "readdir",
+};
+
+// Start counting.
+void stats_init() {
+  memset(stats_ops, 0, sizeof(stats_ops));
+  stats_start = stats_now();
+}
+
+// Read the clock used to time requests.
+uint64_t stats_now() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t) ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+// Index of the bucket counting a latency.
+static int stats_bucket(uint64_t ns) {
+  if (ns < STATS_SUB_BUCKETS) {
+    return ns;
+  }
+  int msb = 63 - __builtin_clzll(ns);
+  int shift = msb - STATS_SUB_BITS;
+  int bucket = (shift + 1) * STATS_SUB_BUCKETS +
+               ((ns >> shift) & (STATS_SUB_BUCKETS - 1));
+  return bucket < STATS_BUCKETS ? bucket : STATS_BUCKETS - 1;
+}
+
+// Return the smallest latency counted in a bucket.
+uint64_t stats_bucket_min(int bucket) {
+  if (bucket < STATS_SUB_BUCKETS) {
+    return bucket;
+  }
+  int shift = bucket / STATS_SUB_BUCKETS - 1;
+  return (uint64_t) (STATS_SUB_BUCKETS + bucket % STATS_SUB_BUCKETS) << shift;
+}
+
+// Count a finished request.
+void stats_record(stats_op_t op, uint64_t start, long result) {
+  uint64_t ns = stats_now() - start;
+  nufs_op_stats_t *st = &stats_ops[op];
+
+  __atomic_fetch_add(&st->count, 1, __ATOMIC_RELAXED);
+  if (result < 0) {
+    __atomic_fetch_add(&st->errors, 1, __ATOMIC_RELAXED);
+  } else if (op == STATS_OP_READ || op == STATS_OP_WRITE) {
+    __atomic_fetch_add(&st->bytes, result, __ATOMIC_RELAXED);
+  }
+  __atomic_fetch_add(&st->total_ns, ns, __ATOMIC_RELAXED);
+  __atomic_fetch_add(&st->buckets[stats_bucket(ns)], 1, __ATOMIC_RELAXED);
+
+  uint64_t max = __atomic_load_n(&st->max_ns, __ATOMIC_RELAXED);
+  while (ns > max && !__atomic_compare_exchange_n(&st->max_ns, &max, ns, 1,
+                                                  __ATOMIC_RELAXED,
+                                                  __ATOMIC_RELAXED)) {
+  }
+}
+
+// Copy the counters.
+void stats_get(nufs_stats_t *st) {
+  memset(st, 0, sizeof(nufs_stats_t));
+  st->version = STATS_VERSION;
+  st->ops = STATS_OP_COUNT;
+  st->uptime_ns = stats_now() - stats_start;
+
+  for (int op = 0; op < STATS_OP_COUNT; ++op) {
+    uint64_t *from = (uint64_t *) &stats_ops[op];
+    uint64_t *to = (uint64_t *) &st->op[op];
+    for (size_t ii = 0; ii < sizeof(nufs_op_stats_t) / sizeof(uint64_t);
+         ++ii) {
+      to[ii] = __atomic_load_n(&from[ii], __ATOMIC_RELAXED);
+    }
+  }
+
+  blocks_stats_t bs;
+  blocks_stats(&bs);
+  st->alloc.allocs = bs.allocs;
+  st->alloc.alloc_blocks = bs.alloc_blocks;
+  st->alloc.frees = bs.frees;
+  st->alloc.freed_blocks = bs.freed_blocks;
+  st->alloc.scanned = bs.scanned;
+  st->alloc.free_blocks = bs.free_blocks;
+  st->alloc.free_runs = bs.free_runs;
+  st->alloc.free_longest = bs.free_longest;
+  st->alloc.block_size = BLOCK_SIZE;
+  st->alloc.block_count = BLOCK_COUNT;
+  st->alloc.shared_blocks = bs.shared_blocks;
+
+  dedup_stats_t ds;
+  dedup_stats(&ds);
+  st->alloc.dedup_lookups = ds.lookups;
+  st->alloc.dedup_hits = ds.hits;
+
+  compress_stats_t cs;
+  compress_stats(&cs);
+  st->alloc.compress_packed = cs.packed;
+  st->alloc.compress_unpacked = cs.unpacked;
+  st->alloc.compress_saved = cs.saved;
+  st->alloc.compress_hits = cs.hits;
+  st->alloc.compress_misses = cs.misses;
+}
+
+// The latency below which the given fraction of requests finished, rounded
+// up to the end of its bucket.
+static uint64_t stats_percentile(nufs_op_stats_t *st, double fraction) {
+  uint64_t want = st->count * fraction;
+  uint64_t seen = 0;
+  for (int bb = 0; bb < STATS_BUCKETS - 1; ++bb) {
+    seen += st->buckets[bb];
+    if (seen > want) {
+      uint64_t end = stats_bucket_min(bb + 1);
+      return end < st->max_ns ? end : st->max_ns;
+    }
+  }
+  return st->max_ns;
+}
+
+// Write the counters as text.
+size_t stats_format(char *buf, size_t size) {
+  nufs_stats_t st;
+  stats_get(&st);
+
+  size_t len = 0;
+#define STATS_PRINT(...)                                                       \
+  len += snprintf(buf + len, len < size ? size - len : 0, __VA_ARGS__)
+
+  STATS_PRINT("uptime %.3f s\n", st.uptime_ns / 1e9);
+  STATS_PRINT("%-8s %10s %8s %14s %10s %10s %10s %10s %10s\n", "op", "count",
+              "errors", "bytes", "avg_us", "p50_us", "p99_us", "p999_us",
+              "max_us");
+  for (int op = 0; op < STATS_OP_COUNT; ++op) {
+    nufs_op_stats_t *os = &st.op[op];
+    double avg = os->count ? (double) os->total_ns / os->count : 0;
+    STATS_PRINT("%-8s %10lu %8lu %14lu %10.1f %10.1f %10.1f %10.1f %10.1f\n",
+                stats_op_names[op], (unsigned long) os->count,
+                (unsigned long) os->errors, (unsigned long) os->bytes,
+                avg / 1e3, stats_percentile(os, 0.5) / 1e3,
+                stats_percentile(os, 0.99) / 1e3,
+                stats_percentile(os, 0.999) / 1e3, os->max_ns / 1e3);
+  }
+
+  nufs_alloc_stats_t *as = &st.alloc;
+  STATS_PRINT("alloc_calls %lu\nalloc_blocks %lu\n",
+              (unsigned long) as->allocs, (unsigned long) as->alloc_blocks);
+  STATS_PRINT("alloc_scanned_per_call %.1f\n",
+              as->allocs ? (double) as->scanned / as->allocs : 0);
+  STATS_PRINT("free_calls %lu\nfreed_blocks %lu\n", (unsigned long) as->frees,
+              (unsigned long) as->freed_blocks);
+  STATS_PRINT("block_count %lu\nfree_blocks %lu\n",
+              (unsigned long) as->block_count, (unsigned long) as->free_blocks);
+  STATS_PRINT("free_runs %lu\nfree_longest %lu\n",
+              (unsigned long) as->free_runs, (unsigned long) as->free_longest);
+  STATS_PRINT("shared_blocks %lu\n", (unsigned long) as->shared_blocks);
+  if (dedup_enabled()) {
+    STATS_PRINT("dedup_lookups %lu\ndedup_hits %lu\n",
+                (unsigned long) as->dedup_lookups,
+                (unsigned long) as->dedup_hits);
+  }
+  if (compress_enabled()) {
+    STATS_PRINT("compress_packed %lu\ncompress_unpacked %lu\n",
+                (unsigned long) as->compress_packed,
+                (unsigned long) as->compress_unpacked);
+    STATS_PRINT("compress_saved_blocks %ld\n", (long) as->compress_saved);
+    STATS_PRINT("compress_cache_hits %lu\ncompress_cache_misses %lu\n",
+                (unsigned long) as->compress_hits,
+                (unsigned long) as->compress_misses);
+  }
+  // 0 when all free space is one run, approaching 1 as it scatters
+  STATS_PRINT("fragmentation %.3f\n",
+              as->free_blocks
+                  ? 1 - (double) as->free_longest / as->free_blocks
+                  : 0.0);
+#undef STATS_PRINT
+
+  return len < size ? len : size - 1;
+}
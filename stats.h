@@ -0,0 +1,140 @@
+/**
+ * @file stats.h
+ *
+ * Operation counters and latency histograms.
+ *
+ * The FUSE callbacks time the requests listed in stats_op_t and record
+ * them with stats_record(). Counters only ever grow while the file system
+ * is mounted, so a monitor computes rates from the difference of two
+ * readings.
+ *
+ * Latencies go into log-linear buckets, like an HDR histogram: each power
+ * of two is split into STATS_SUB_BUCKETS equal buckets, so a bucket is
+ * never wider than a quarter of the values it holds.
+ *
+ * The counters are read either as text, from the read-only file
+ * /.nufs/stats in the mounted file system, or as a nufs_stats_t, with the
+ * NUFS_IOC_STATS ioctl on any file or directory of the mount. This header
+ * only needs the C library, so monitoring tools can include it.
+ */
+#ifndef STATS_H
+#define STATS_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/ioctl.h>
+
+#define STATS_VERSION 4
+#define STATS_SUB_BITS 2
+#define STATS_SUB_BUCKETS (1 << STATS_SUB_BITS)
+#define STATS_BUCKETS 140 // up to 2^36 ns (about 69 s); longer goes in the last
+
+typedef enum stats_op {
+  STATS_OP_GETATTR,
+  STATS_OP_LOOKUP,
+  STATS_OP_READ,
+  STATS_OP_WRITE,
+  STATS_OP_MKNOD,   // also mkdir and create
+  STATS_OP_UNLINK,  // also rmdir
+  STATS_OP_RENAME,
+  STATS_OP_READDIR, // also readdirplus
+  STATS_OP_COUNT
+} stats_op_t;
+
+typedef struct nufs_op_stats {
+  uint64_t count;
+  uint64_t errors;   // requests that failed
+  uint64_t bytes;    // bytes read or written
+  uint64_t total_ns; // sum of latencies
+  uint64_t max_ns;
+  uint64_t buckets[STATS_BUCKETS]; // see stats_bucket_min()
+} nufs_op_stats_t;
+
+typedef struct nufs_alloc_stats {
+  uint64_t allocs;       // block allocations
+  uint64_t alloc_blocks; // blocks allocated
+  uint64_t frees;        // block frees
+  uint64_t freed_blocks; // blocks freed
+  uint64_t scanned;      // bitmap words read while allocating
+  uint64_t free_blocks;
+  uint64_t free_runs;    // runs of free blocks: 1 when not fragmented
+  uint64_t free_longest; // longest run of free blocks
+  uint64_t block_size;
+  uint64_t block_count;
+  uint64_t shared_blocks; // blocks used by more than one file
+  uint64_t dedup_lookups; // written blocks looked up in the dedup index
+  uint64_t dedup_hits;    // written blocks replaced by an indexed block
+  uint64_t compress_packed;   // clusters compressed
+  uint64_t compress_unpacked; // compressed clusters stored as is again
+  int64_t compress_saved;     // blocks saved by both since mounting
+  uint64_t compress_hits;     // cluster reads served by the cache
+  uint64_t compress_misses;   // cluster reads that decompressed it
+} nufs_alloc_stats_t;
+
+/**
+ * What NUFS_IOC_STATS returns.
+ */
+typedef struct nufs_stats {
+  uint32_t version; // STATS_VERSION
+  uint32_t ops;     // STATS_OP_COUNT
+  uint64_t uptime_ns;
+  nufs_op_stats_t op[STATS_OP_COUNT];
+  nufs_alloc_stats_t alloc;
+} nufs_stats_t;
+
+#define NUFS_IOC_STATS _IOR('N', 1, nufs_stats_t)
+
+// an ioctl's size field only has room for 16K
+_Static_assert(sizeof(nufs_stats_t) < (1 << _IOC_SIZEBITS),
+               "nufs_stats_t is too large for an ioctl");
+
+/**
+ * Start counting; called once at mount.
+ */
+void stats_init();
+
+/**
+ * Read the clock used to time requests.
+ *
+ * @return Nanoseconds since some fixed point.
+ */
+uint64_t stats_now();
+
+/**
+ * Count a finished request.
+ *
+ * @param op The kind of request.
+ * @param start stats_now() when the request started.
+ * @param result The request's result: a negative errno on failure, or
+ *               the number of bytes for reads and writes.
+ */
+void stats_record(stats_op_t op, uint64_t start, long result);
+
+/**
+ * Copy the counters.
+ *
+ * @param st Filled in with the counters and the allocator state.
+ */
+void stats_get(nufs_stats_t *st);
+
+/**
+ * Write the counters as text: one line per operation with its count and
+ * latency percentiles, then the allocator counters.
+ *
+ * @param buf Buffer for the text.
+ * @param size Size of the buffer.
+ *
+ * @return The length of the text, which is cut short if it would not fit.
+ */
+size_t stats_format(char *buf, size_t size);
+
+/**
+ * Return the smallest latency, in nanoseconds, counted in a bucket: b for
+ * the first STATS_SUB_BUCKETS buckets, and (4 + b % 4) << (b / 4 - 1) for
+ * the others.
+ *
+ * @param bucket Index of a bucket.
+ */
+uint64_t stats_bucket_min(int bucket);
+
+#endif
@@ -0,0 +1,1440 @@
+// Disk storage abstraction.
+//
+// Implements the storage_* interface from storage.h on top of the block,
+// inode and directory layers. Errors are returned as negative errno values
+// so that the FUSE callbacks can pass them straight through.
+//
+// Objects are addressed by inode number (and directory entries by parent
+// inum and name), which is how the FUSE low-level API refers to them. The
+// path-based functions at the end resolve the path and call those.
+
+#define _GNU_SOURCE // SEEK_DATA, SEEK_HOLE and the fallocate flags
+#include <assert.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "bitmap.h"
+#include "blocks.h"
+#include "compress.h"
+#include "dcache.h"
+#include "dedup.h"
+#include "directory.h"
+#include "icache.h"
+#include "inode.h"
+#include "journal.h"
+#include "storage.h"
+
+// Held by operations that lock more than one directory (rename and rmdir),
+// so that they cannot deadlock with each other.
+static pthread_mutex_t rename_lock = PTHREAD_MUTEX_INITIALIZER;
+
+// Owner of the files made through the path-based functions: whoever
+// mounted the image.
+static uid_t storage_uid;
+static gid_t storage_gid;
+
+// Free the orphans a crash left behind: allocated inodes with no links.
+static void storage_free_orphans() {
+  superblock_t *sb = blocks_super();
+  if (sb->orphans == 0) {
+    return;
+  }
+
+  journal_begin();
+  int freed = 0;
+  for (int inum = 1; inum < sb->inode_count; ++inum) {
+    if (bitmap_get(get_inode_bitmap(), inum) && get_inode(inum)->refs == 0) {
+      free_inode(inum);
+      freed++;
+    }
+  }
+  sb->orphans = 0;
+  journal_dirty(0);
+  journal_end();
+  fprintf(stderr, "nufs: freed %d orphaned inodes\n", freed);
+}
+
+// Mount the disk image at the given path, formatting a new image with the
+// default geometry if none exists yet. Exits if it is not a nufs image. No
+// threads are started until storage_start().
+void storage_init(const char *path) {
+  if (access(path, F_OK) != 0) {
+    int rv = blocks_format(path, NUFS_DEFAULT_BLOCK_SIZE,
+                           NUFS_DEFAULT_BLOCK_COUNT, NUFS_DEFAULT_INODE_COUNT,
+                           sizeof(inode_t), NUFS_DEFAULT_JOURNAL, 0);
+    assert(rv == 0);
+  }
+
+  blocks_init(path);
+  icache_init(blocks_super()->inode_count);
+  dedup_init();
+  compress_init();
+  storage_uid = getuid();
+  storage_gid = getgid();
+  dcache_clear();
+
+  // a freshly formatted image still needs its root directory
+  superblock_t *sb = blocks_super();
+  if (!bitmap_get(get_inode_bitmap(), sb->root_inum)) {
+    journal_begin();
+    bitmap_summary_put(get_inode_summary(), sb->root_inum, 1, 1);
+    journal_dirty(sb->inode_bitmap_start + sb->root_inum / (BLOCK_SIZE * 8));
+    inode_t *root = get_inode(sb->root_inum);
+    inode_init(root, 040755);
+    root->refs = 1;
+    root->uid = storage_uid;
+    root->gid = storage_gid;
+    int rv = directory_init(root, sb->root_inum, sb->root_inum);
+    assert(rv == 0);
+    journal_end();
+
+    rv = journal_commit();
+    assert(rv == 0);
+  }
+  storage_free_orphans();
+}
+
+// Start the background work of the mounted image: the journal's commits.
+void storage_start() { journal_start(); }
+
+// Write out everything that is still in memory and close the disk image.
+void storage_free() {
+  compress_free();
+  dedup_free();
+  blocks_free();
+  icache_free();
+  dcache_clear();
+}
+
+// Lock an inode for reading or writing. Returns 0, or -ENOENT if the inode
+// is not in use (it may have been freed after it was looked up); the lock
+// is not held then.
+static int storage_lock(int inum, int write) {
+  if (inum <= 0 || inum >= blocks_super()->inode_count) {
+    return -ENOENT;
+  }
+  if (write) {
+    icache_wrlock(inum);
+  } else {
+    icache_rdlock(inum);
+  }
+  // an open file outlives its last link until it is closed
+  if (get_inode(inum)->refs == 0 && icache_get(inum)->opens == 0) {
+    icache_unlock(inum);
+    return -ENOENT;
+  }
+  return 0;
+}
+
+// Lock a directory for changing its entries, checking that name is a valid
+// entry name. Returns 0 or a negative errno (the lock is not held then).
+static int storage_lock_dir(int pinum, const char *name) {
+  if (strlen(name) >= DIR_NAME_LENGTH) {
+    return -ENAMETOOLONG;
+  }
+  int rv = storage_lock(pinum, 1);
+  if (rv < 0) {
+    return rv;
+  }
+  if (!S_ISDIR(get_inode(pinum)->mode)) {
+    icache_unlock(pinum);
+    return -ENOTDIR;
+  }
+  return 0;
+}
+
+// Count an inode that lost its last link while in use (+1), or such an
+// inode being freed (-1). The count lets the next mount skip looking for
+// orphans left by a crash when there are none.
+static void storage_orphans(int delta) {
+  superblock_t *sb = blocks_super();
+  __atomic_fetch_add(&sb->orphans, delta, __ATOMIC_RELAXED);
+  journal_dirty(0);
+}
+
+// Is an inode still in use: open, or known to the kernel? Called with the
+// inode locked for writing.
+static int storage_in_use(int inum) {
+  icache_entry_t *ent = icache_get(inum);
+  return ent->opens > 0 ||
+         __atomic_load_n(&ent->lookups, __ATOMIC_ACQUIRE) > 0;
+}
+
+// Free an inode that has no links left, unless it is still in use; then it
+// becomes an orphan, freed by storage_close_ino() or storage_forget_ino().
+// Called with the inode locked for writing.
+static void storage_unlinked(int inum) {
+  if (storage_in_use(inum)) {
+    storage_orphans(1);
+  } else {
+    free_inode(inum);
+  }
+}
+
+// Drop one reference to a file, freeing it when the last one goes away.
+static void storage_release(int inum) {
+  icache_wrlock(inum);
+  inode_t *node = get_inode(inum);
+  node->refs--;
+  inode_touch(node, INODE_CTIME);
+  if (node->refs == 0) {
+    storage_unlinked(inum);
+  }
+  icache_unlock(inum);
+}
+
+// Find the inode named name in directory pinum.
+int storage_lookup(int pinum, const char *name) {
+  if (strlen(name) >= DIR_NAME_LENGTH) {
+    return -ENAMETOOLONG;
+  }
+  int rv = storage_lock(pinum, 0);
+  if (rv < 0) {
+    return rv;
+  }
+
+  inode_t *parent = get_inode(pinum);
+  int inum = -ENOTDIR;
+  if (S_ISDIR(parent->mode)) {
+    inum = directory_lookup(parent, name);
+    if (inum < 0) {
+      inum = -ENOENT;
+    }
+  }
+  icache_unlock(pinum);
+  return inum;
+}
+
+// Convert an inode timestamp to a timespec.
+static struct timespec storage_timespec(long ns) {
+  struct timespec ts = {ns / 1000000000L, ns % 1000000000L};
+  return ts;
+}
+
+// Fill in the attributes of a locked inode.
+static void storage_stat_locked(int inum, struct stat *st) {
+  inode_t *node = get_inode(inum);
+  memset(st, 0, sizeof(struct stat));
+  st->st_ino = inum;
+  st->st_mode = node->mode;
+  st->st_nlink = node->refs;
+  st->st_uid = node->uid;
+  st->st_gid = node->gid;
+  st->st_size = node->size;
+  st->st_blksize = BLOCK_SIZE;
+  // holes take no space, so this can be less than the size
+  st->st_blocks = (long) node->blocks * (BLOCK_SIZE / 512);
+  st->st_atim = storage_timespec(node->atime);
+  st->st_mtim = storage_timespec(node->mtime);
+  st->st_ctim = storage_timespec(node->ctime);
+}
+
+// Fill in the attributes of an inode.
+int storage_getattr(int inum, struct stat *st) {
+  int rv = storage_lock(inum, 0);
+  if (rv < 0) {
+    return rv;
+  }
+  storage_stat_locked(inum, st);
+  icache_unlock(inum);
+  return 0;
+}
+
+// Bytes in a cluster of file data, or 0 if the image does not compress it.
+static long storage_cluster() {
+  return (long) compress_cluster_blocks() * BLOCK_SIZE;
+}
+
+// Record the data blocks holding bytes [from, to) of a file as written, so
+// that syncing the file writes them back.
+static void storage_dirty(int inum, inode_t *node, off_t from, off_t to) {
+  if (node->flags & INODE_INLINE_DATA) {
+    return; // inline data is journaled with the inode
+  }
+  // clusters are compressed, and stored as is again, whole
+  long cluster = storage_cluster();
+  if (cluster > 0 && from < to) {
+    from -= from % cluster;
+    to = (to + cluster - 1) / cluster * cluster;
+  }
+  blocks_dirty_t *set = &icache_get(inum)->dirty;
+  long end = bytes_to_blocks(to);
+  for (long fbnum = from / BLOCK_SIZE; fbnum < end;) {
+    int len;
+    int bnum = inode_get_run(node, fbnum, &len);
+    if (len > end - fbnum) {
+      len = end - fbnum;
+    }
+    if (bnum >= 0) {
+      blocks_mark_dirty(set, bnum, len); // holes have nothing to write
+    }
+    fbnum += len;
+  }
+}
+
+// Pieces held on the stack; longer requests allocate their list.
+#define STORAGE_LOCAL_SEGS 16
+
+// Split bytes [offset, offset + size) of a locked file, all below its size,
+// into inline data, runs of contiguous blocks, holes and compressed
+// clusters, which are read from the cache (see compress.h) and so have no
+// pos. segs has room for storage_seg_count(size) pieces, and bufs for as
+// many clusters, which the caller releases; *nbufs is how many there are.
+// Returns the number of pieces, or -EIO if a compressed cluster is corrupt.
+static int storage_segs(inode_t *node, size_t size, off_t offset,
+                        storage_seg_t *segs, compress_buf_t **bufs,
+                        int *nbufs) {
+  if (node->flags & INODE_INLINE_DATA) {
+    segs[0] = (storage_seg_t){-1, node->data + offset, size};
+    return 1;
+  }
+
+  long cluster = storage_cluster();
+  int count = 0;
+  size_t done = 0;
+  while (done < size) {
+    off_t pos = offset + done;
+    int start;
+    int packed = cluster > 0 ? inode_get_cluster(node, pos / BLOCK_SIZE, &start)
+                             : -1;
+    if (packed >= 0) {
+      int bytes;
+      const char *data = compress_get(packed, &bytes, &bufs[*nbufs]);
+      if (data == NULL) {
+        return -EIO;
+      }
+      (*nbufs)++;
+      // past the data it holds, a cluster reads as zeros
+      long at = pos - (long) start * BLOCK_SIZE;
+      size_t n = (at < bytes ? bytes : cluster) - at;
+      n = n < size - done ? n : size - done;
+      void *mem = at < bytes ? (void *) (data + at) : NULL;
+      segs[count++] = (storage_seg_t){-1, mem, n};
+      done += n;
+      continue;
+    }
+
+    int run;
+    int bnum = inode_get_run(node, pos / BLOCK_SIZE, &run);
+    size_t n = (long) run * BLOCK_SIZE - pos % BLOCK_SIZE;
+    // the next cluster may be compressed, even if its run carries on
+    if (bnum >= 0 && cluster > 0 && n > cluster - pos % cluster) {
+      n = cluster - pos % cluster;
+    }
+    if (n > size - done) {
+      n = size - done;
+    }
+
+    if (bnum < 0) {
+      segs[count++] = (storage_seg_t){-1, NULL, n};
+    } else {
+      char *mem = (char *) blocks_get_block(bnum) + pos % BLOCK_SIZE;
+      off_t at = (off_t) bnum * BLOCK_SIZE + pos % BLOCK_SIZE;
+      segs[count++] = (storage_seg_t){at, mem, n};
+    }
+    done += n;
+  }
+  return count;
+}
+
+// The most pieces storage_segs() can split size bytes into: one per block,
+// plus one for a partial block at the start.
+static int storage_seg_count(size_t size) {
+  return size / BLOCK_SIZE + 2;
+}
+
+// Pass bytes [offset, offset + size) of a locked file, all below its size,
+// to io in the pieces storage_segs() splits them into. Returns what io
+// returns, or a negative errno if it was not called.
+static ssize_t storage_io(inode_t *node, size_t size, off_t offset,
+                          storage_io_t io, void *ctx) {
+  int max = storage_seg_count(size);
+  storage_seg_t local[STORAGE_LOCAL_SEGS];
+  compress_buf_t *local_bufs[STORAGE_LOCAL_SEGS];
+  storage_seg_t *segs = local;
+  compress_buf_t **bufs = local_bufs;
+  if (max > STORAGE_LOCAL_SEGS) {
+    segs = malloc(max * sizeof(storage_seg_t));
+    bufs = malloc(max * sizeof(compress_buf_t *));
+  }
+
+  ssize_t done = -ENOMEM;
+  int nbufs = 0;
+  if (segs != NULL && bufs != NULL) {
+    int count = storage_segs(node, size, offset, segs, bufs, &nbufs);
+    done = count < 0 ? count : io(ctx, blocks_image_fd(), segs, count);
+  }
+  while (nbufs > 0) {
+    compress_put(bufs[--nbufs]);
+  }
+  if (segs != local) {
+    free(segs);
+    free(bufs);
+  }
+  return done;
+}
+
+// Read from a file locked for reading; see storage_read_buf_ino().
+static ssize_t storage_read_locked(inode_t *node, size_t size, off_t offset,
+                                   storage_io_t io, void *ctx) {
+  if (offset >= node->size) {
+    return 0;
+  }
+  if (offset + size > node->size) {
+    size = node->size - offset;
+  }
+  return storage_io(node, size, offset, io, ctx);
+}
+
+// Read up to size bytes at offset, passing the pieces they are in to io
+// while the file is locked. Returns what io returns, or 0 at the end of the
+// file without calling it.
+ssize_t storage_read_buf_ino(int inum, size_t size, off_t offset,
+                             storage_io_t io, void *ctx) {
+  int rv = storage_lock(inum, 0);
+  if (rv < 0) {
+    return rv;
+  }
+
+  inode_t *node = get_inode(inum);
+  ssize_t done = S_ISDIR(node->mode)
+                     ? -EISDIR
+                     : storage_read_locked(node, size, offset, io, ctx);
+  icache_unlock(inum);
+  return done;
+}
+
+// Write to a file locked for writing; see storage_write_buf_ino().
+static ssize_t storage_write_locked(int inum, inode_t *node, size_t size,
+                                    off_t offset, storage_io_t io,
+                                    void *ctx) {
+  off_t old_size = node->size;
+  // only the blocks written get allocated; any gap before them is a hole.
+  // blocks shared with other files get copied before they are written
+  if (grow_inode(node, offset + size) != 0 ||
+      inode_fill(node, offset, offset + size) != 0 ||
+      inode_unshare(node, offset, offset + size) != 0) {
+    shrink_inode(node, old_size);
+    return -ENOSPC;
+  }
+
+  // the write's clusters were stored as is by inode_fill()
+  ssize_t done = storage_io(node, size, offset, io, ctx);
+
+  off_t end = offset + (done > 0 ? done : 0);
+  shrink_inode(node, end > old_size ? end : old_size);
+  inode_dedup(node, offset, end);
+  // the clusters the write finished get compressed. the last cluster of the
+  // file waits until it is closed, so that appends do not compress it again
+  // and again
+  long cluster = storage_cluster();
+  if (cluster > 0 && done > 0) {
+    inode_compress(node, offset - offset % cluster, end - end % cluster);
+    if (end > node->size - node->size % cluster) {
+      icache_get(inum)->tail_written = 1;
+    }
+  }
+  if (done > 0) {
+    inode_touch(node, INODE_MTIME | INODE_CTIME); // also journals inline data
+  }
+  // growing the file zeroed the rest of its old last block
+  storage_dirty(inum, node, old_size < offset ? old_size : offset, end);
+  return done;
+}
+
+// Write size bytes at offset, growing the file as needed, and pass the
+// pieces of the file they go in to io, which fills them in. Returns what io
+// returns; if that is short, the file keeps only what io wrote.
+ssize_t storage_write_buf_ino(int inum, size_t size, off_t offset,
+                              storage_io_t io, void *ctx) {
+  journal_begin();
+  int rv = storage_lock(inum, 1);
+  if (rv < 0) {
+    journal_end();
+    return rv;
+  }
+
+  inode_t *node = get_inode(inum);
+  ssize_t done = S_ISDIR(node->mode)
+                     ? -EISDIR
+                     : storage_write_locked(inum, node, size, offset, io, ctx);
+  icache_unlock(inum);
+  journal_end();
+  return done;
+}
+
+// storage_io_t that copies the pieces of a file to a buffer.
+static ssize_t storage_copy_out(void *ctx, int fd, const storage_seg_t *segs,
+                                int count) {
+  char *buf = ctx;
+  size_t done = 0;
+  for (int ii = 0; ii < count; ++ii) {
+    if (segs[ii].mem == NULL) {
+      memset(buf + done, 0, segs[ii].len); // a hole reads as zeros
+    } else {
+      memcpy(buf + done, segs[ii].mem, segs[ii].len);
+    }
+    done += segs[ii].len;
+  }
+  return done;
+}
+
+// storage_io_t that copies a buffer into the pieces of a file.
+static ssize_t storage_copy_in(void *ctx, int fd, const storage_seg_t *segs,
+                               int count) {
+  const char *buf = ctx;
+  size_t done = 0;
+  for (int ii = 0; ii < count; ++ii) {
+    memcpy(segs[ii].mem, buf + done, segs[ii].len);
+    done += segs[ii].len;
+  }
+  return done;
+}
+
+// Read up to size bytes at offset, returning the number of bytes read.
+int storage_read_ino(int inum, char *buf, size_t size, off_t offset) {
+  return storage_read_buf_ino(inum, size, offset, storage_copy_out, buf);
+}
+
+// Write size bytes at offset, growing the file as needed.
+int storage_write_ino(int inum, const char *buf, size_t size, off_t offset) {
+  return storage_write_buf_ino(inum, size, offset, storage_copy_in,
+                               (void *) buf);
+}
+
+// Bytes storage_copy_range_ino() copies under one journal handle, so that
+// a large copy neither holds both files the whole time nor fills the
+// journal with reference counts.
+#define STORAGE_COPY_CHUNK (1 << 22)
+
+// Lock the source of a copy for reading and its destination for writing,
+// in inum order so that two copies between the same files cannot deadlock.
+// Returns 0 or a negative errno (no lock is held then).
+static int storage_lock_copy(int src, int dst) {
+  if (src == dst) {
+    return storage_lock(dst, 1);
+  }
+  int first = src < dst ? src : dst;
+  int second = src < dst ? dst : src;
+  int rv = storage_lock(first, first == dst);
+  if (rv < 0) {
+    return rv;
+  }
+  rv = storage_lock(second, second == dst);
+  if (rv < 0) {
+    icache_unlock(first);
+  }
+  return rv;
+}
+
+// Copy size bytes between two locked files through memory.
+static ssize_t storage_copy_bytes(inode_t *snode, off_t src_off, int dst,
+                                  inode_t *dnode, off_t dst_off, size_t size) {
+  if (size == 0) {
+    return 0;
+  }
+  char *buf = malloc(size);
+  if (buf == NULL) {
+    return -ENOMEM;
+  }
+  ssize_t done =
+      storage_read_locked(snode, size, src_off, storage_copy_out, buf);
+  if (done > 0) {
+    done = storage_write_locked(dst, dnode, done, dst_off, storage_copy_in,
+                                buf);
+  }
+  free(buf);
+  return done;
+}
+
+// Copy bytes [src_off, src_off + size) of a locked src, which it holds in
+// full, to dst_off of a locked dst. Whole blocks are shared when both
+// offsets are the same distance into a block, and so is the last block of
+// src if nothing in dst follows it; the rest is copied. In images that
+// compress data, only whole clusters are shared, when both offsets are the
+// same distance into a cluster. Returns the bytes copied or a negative
+// errno.
+static ssize_t storage_copy_locked(int src, inode_t *snode, off_t src_off,
+                                   int dst, inode_t *dnode, off_t dst_off,
+                                   size_t size) {
+  long unit = storage_cluster() > 0 ? storage_cluster() : BLOCK_SIZE;
+  size_t head = size;
+  long blocks = 0;
+  if (!(snode->flags & INODE_INLINE_DATA) &&
+      src_off % unit == dst_off % unit) {
+    head = (unit - src_off % unit) % unit;
+    head = head < size ? head : size;
+    blocks = (size - head) / unit * (unit / BLOCK_SIZE);
+    off_t end = src_off + size;
+    if (unit == BLOCK_SIZE && end == snode->size && end % BLOCK_SIZE != 0 &&
+        dst_off + size >= dnode->size && head < size) {
+      blocks++;
+    }
+    head = blocks > 0 ? head : size;
+  }
+
+  ssize_t done = storage_copy_bytes(snode, src_off, dst, dnode, dst_off, head);
+  if (done < (ssize_t) head || blocks == 0) {
+    return done;
+  }
+
+  // the shared blocks must be on disk for dst's fsync to cover them
+  size_t shared = (size_t) blocks * BLOCK_SIZE;
+  shared = shared < size - head ? shared : size - head;
+  if (blocks_sync(&icache_get(src)->dirty, 1) != 0) {
+    return head > 0 ? (ssize_t) head : -EIO;
+  }
+  off_t old_size = dnode->size;
+  if (grow_inode(dnode, dst_off + head + shared) != 0 ||
+      inode_clone(dnode, (dst_off + head) / BLOCK_SIZE, snode,
+                  (src_off + head) / BLOCK_SIZE, blocks) != 0) {
+    shrink_inode(dnode, old_size > dst_off + head ? old_size
+                                                  : dst_off + head);
+    return head > 0 ? (ssize_t) head : -ENOSPC;
+  }
+  // growing dst may have zeroed the end of its last block
+  storage_dirty(dst, dnode, old_size, old_size + 1);
+  inode_touch(dnode, INODE_MTIME | INODE_CTIME);
+
+  done = head + shared;
+  ssize_t tail = storage_copy_bytes(snode, src_off + done, dst, dnode,
+                                    dst_off + done, size - done);
+  return tail < 0 ? done : done + tail;
+}
+
+// Copy one chunk of storage_copy_range_ino().
+static ssize_t storage_copy_chunk(int src, off_t src_off, int dst,
+                                  off_t dst_off, size_t size) {
+  journal_begin();
+  int rv = storage_lock_copy(src, dst);
+  if (rv < 0) {
+    journal_end();
+    return rv;
+  }
+
+  inode_t *snode = get_inode(src);
+  inode_t *dnode = get_inode(dst);
+  if (src_off + size > snode->size) {
+    size = src_off < snode->size ? snode->size - src_off : 0;
+  }
+  ssize_t done;
+  if (S_ISDIR(snode->mode) || S_ISDIR(dnode->mode)) {
+    done = -EISDIR;
+  } else if (src == dst && src_off < dst_off + size &&
+             dst_off < src_off + size) {
+    done = -EINVAL;
+  } else {
+    done = storage_copy_locked(src, snode, src_off, dst, dnode, dst_off, size);
+  }
+
+  icache_unlock(src);
+  if (dst != src) {
+    icache_unlock(dst);
+  }
+  journal_end();
+  return done;
+}
+
+// Copy len bytes at src_off of src to dst_off of dst, stopping at the end
+// of src (man 2 copy_file_range). Where the offsets line up, the files
+// share the blocks instead, and a block is copied only when one of them
+// writes it. Returns the number of bytes copied, or a negative errno if
+// there were none.
+ssize_t storage_copy_range_ino(int src, off_t src_off, int dst, off_t dst_off,
+                               size_t len) {
+  if (src_off < 0 || dst_off < 0) {
+    return -EINVAL;
+  }
+  if ((dst_off + (off_t) len) / BLOCK_SIZE >= INT_MAX) {
+    return -EFBIG;
+  }
+
+  ssize_t total = 0;
+  while (len > 0) {
+    size_t size = len < STORAGE_COPY_CHUNK ? len : STORAGE_COPY_CHUNK;
+    ssize_t done = storage_copy_chunk(src, src_off, dst, dst_off, size);
+    if (done <= 0) {
+      return total > 0 ? total : done;
+    }
+    total += done;
+    src_off += done;
+    dst_off += done;
+    len -= done;
+    if (done < (ssize_t) size) {
+      break; // the end of src
+    }
+  }
+  return total;
+}
+
+// Set the size of a file. Growing it leaves a hole; shrinking it frees the
+// blocks past the new end.
+int storage_truncate_ino(int inum, off_t size) {
+  journal_begin();
+  int rv = storage_lock(inum, 1);
+  if (rv < 0) {
+    journal_end();
+    return rv;
+  }
+
+  inode_t *node = get_inode(inum);
+  if (S_ISDIR(node->mode)) {
+    rv = -EISDIR;
+  } else if (size < node->size) {
+    rv = shrink_inode(node, size);
+  } else {
+    off_t old_size = node->size;
+    rv = grow_inode(node, size) == 0 ? 0 : -ENOSPC;
+    if (rv == 0) {
+      storage_dirty(inum, node, old_size, size);
+    }
+  }
+  if (rv == 0) {
+    inode_touch(node, INODE_MTIME | INODE_CTIME);
+  }
+  icache_unlock(inum);
+  journal_end();
+  return rv;
+}
+
+// Write the data of a file back to the image and commit the metadata, so
+// that both survive a crash. Only the file's own dirty blocks are written.
+int storage_fsync_ino(int inum) {
+  int rv = storage_lock(inum, 0);
+  if (rv < 0) {
+    return rv;
+  }
+  icache_unlock(inum);
+
+  // the data goes first, so committed metadata never points at stale blocks
+  if (blocks_sync(&icache_get(inum)->dirty, 1) != 0 || journal_commit() != 0) {
+    return -EIO;
+  }
+  return 0;
+}
+
+// Start writing the data of a file back to the image, without waiting.
+int storage_flush_ino(int inum) {
+  int rv = storage_lock(inum, 0);
+  if (rv < 0) {
+    return rv;
+  }
+  icache_unlock(inum);
+  return blocks_sync(&icache_get(inum)->dirty, 0) == 0 ? 0 : -EIO;
+}
+
+// Reserve or free space in a file (man 2 fallocate). Mode 0 allocates the
+// blocks of [offset, offset + len) and grows the file to cover them;
+// FALLOC_FL_KEEP_SIZE allocates them without changing the size, and
+// FALLOC_FL_PUNCH_HOLE (which must come with KEEP_SIZE) frees them.
+int storage_fallocate_ino(int inum, int mode, off_t offset, off_t len) {
+  if (mode & ~(FALLOC_FL_KEEP_SIZE | FALLOC_FL_PUNCH_HOLE) ||
+      mode == FALLOC_FL_PUNCH_HOLE) {
+    return -EOPNOTSUPP;
+  }
+  if (offset < 0 || len <= 0) {
+    return -EINVAL;
+  }
+  off_t end = offset + len;
+  if (end / BLOCK_SIZE >= INT_MAX) {
+    return -EFBIG;
+  }
+
+  journal_begin();
+  int rv = storage_lock(inum, 1);
+  if (rv < 0) {
+    journal_end();
+    return rv;
+  }
+
+  inode_t *node = get_inode(inum);
+  off_t old_size = node->size;
+  if (S_ISDIR(node->mode)) {
+    rv = -EISDIR;
+  } else if (mode & FALLOC_FL_PUNCH_HOLE) {
+    rv = inode_punch(node, offset, end) == 0 ? 0 : -ENOSPC;
+    // only the partial blocks at the ends still hold anything
+    if (rv == 0) {
+      storage_dirty(inum, node, offset, offset + 1);
+      storage_dirty(inum, node, end - 1, end);
+    }
+  } else {
+    if (!(mode & FALLOC_FL_KEEP_SIZE) && grow_inode(node, end) != 0) {
+      rv = -ENOSPC;
+    } else if (inode_fill(node, offset, end) != 0) {
+      shrink_inode(node, old_size);
+      rv = -ENOSPC;
+    } else {
+      storage_dirty(inum, node, old_size < offset ? old_size : offset, end);
+    }
+  }
+  if (rv == 0) {
+    inode_touch(node, INODE_MTIME | INODE_CTIME);
+  }
+  icache_unlock(inum);
+  journal_end();
+  return rv;
+}
+
+// Note that a file was opened, so that it stays readable and writable
+// after its last link is removed, until storage_close_ino().
+int storage_open_ino(int inum) {
+  int rv = storage_lock(inum, 1);
+  if (rv < 0) {
+    return rv;
+  }
+  icache_get(inum)->opens++;
+  icache_unlock(inum);
+  return 0;
+}
+
+// Note that an open of a file was closed, freeing the file if it has no
+// links left and is no longer in use. Otherwise the last cluster of the
+// file is compressed, if it was written since the last close.
+void storage_close_ino(int inum) {
+  journal_begin();
+  icache_wrlock(inum);
+  icache_entry_t *ent = icache_get(inum);
+  inode_t *node = get_inode(inum);
+  ent->opens--;
+  if (node->refs == 0) {
+    if (!storage_in_use(inum)) {
+      free_inode(inum);
+      storage_orphans(-1);
+    }
+  } else if (ent->opens == 0 && ent->tail_written) {
+    long cluster = storage_cluster();
+    if (cluster > 0 && S_ISREG(node->mode) && node->size > 0) {
+      inode_compress(node, node->size - 1 - (node->size - 1) % cluster,
+                     node->size);
+      storage_dirty(inum, node, node->size - 1, node->size);
+    }
+    ent->tail_written = 0;
+  }
+  icache_unlock(inum);
+  journal_end();
+}
+
+// Count a reference to an inode that the kernel took: a lookup, or an entry
+// it was given by a create or a readdirplus. The kernel holds the lock of
+// the directory the entry is in while it asks, so the entry cannot be
+// removed before it is counted.
+void storage_ref_ino(int inum) {
+  __atomic_fetch_add(&icache_get(inum)->lookups, 1, __ATOMIC_ACQ_REL);
+}
+
+// Drop count references to an inode that the kernel has forgotten, freeing
+// it if it has no links left and is no longer in use.
+void storage_forget_ino(int inum, unsigned long count) {
+  if (inum <= 0 || inum >= blocks_super()->inode_count) {
+    return;
+  }
+  journal_begin();
+  icache_wrlock(inum);
+  icache_entry_t *ent = icache_get(inum);
+  __atomic_fetch_sub(&ent->lookups, count, __ATOMIC_ACQ_REL);
+  if (bitmap_get(get_inode_bitmap(), inum) && get_inode(inum)->refs == 0 &&
+      !storage_in_use(inum)) {
+    free_inode(inum);
+    storage_orphans(-1);
+  }
+  icache_unlock(inum);
+  journal_end();
+}
+
+// Return the generation of an inode, which tells it apart from the earlier
+// inodes with the same inum.
+int storage_generation_ino(int inum) { return get_inode(inum)->generation; }
+
+// Find the next data (SEEK_DATA) or hole (SEEK_HOLE) at or after offset.
+// Returns the offset found, or -ENXIO if there is none.
+off_t storage_lseek_ino(int inum, off_t offset, int whence) {
+  if (whence != SEEK_DATA && whence != SEEK_HOLE) {
+    return -EINVAL;
+  }
+  int rv = storage_lock(inum, 0);
+  if (rv < 0) {
+    return rv;
+  }
+
+  long pos = inode_seek(get_inode(inum), offset, whence == SEEK_HOLE);
+  icache_unlock(inum);
+  return pos < 0 ? -ENXIO : pos;
+}
+
+// Change the permission bits of an inode.
+int storage_chmod_ino(int inum, int mode) {
+  journal_begin();
+  int rv = storage_lock(inum, 1);
+  if (rv < 0) {
+    journal_end();
+    return rv;
+  }
+
+  inode_t *node = get_inode(inum);
+  node->mode = (node->mode & S_IFMT) | (mode & 07777);
+  inode_touch(node, INODE_CTIME);
+  icache_unlock(inum);
+  journal_end();
+  return 0;
+}
+
+// Change the owner and group of an inode; -1 leaves either unchanged.
+int storage_chown_ino(int inum, uid_t uid, gid_t gid) {
+  journal_begin();
+  int rv = storage_lock(inum, 1);
+  if (rv < 0) {
+    journal_end();
+    return rv;
+  }
+
+  inode_t *node = get_inode(inum);
+  if (uid != (uid_t) -1) {
+    node->uid = uid;
+  }
+  if (gid != (gid_t) -1) {
+    node->gid = gid;
+  }
+  inode_touch(node, INODE_CTIME);
+  icache_unlock(inum);
+  journal_end();
+  return 0;
+}
+
+// Set the access and modification times of an inode, as utimensat does:
+// UTIME_NOW means the current time and UTIME_OMIT leaves a time alone.
+int storage_utimens_ino(int inum, const struct timespec ts[2]) {
+  journal_begin();
+  int rv = storage_lock(inum, 1);
+  if (rv < 0) {
+    journal_end();
+    return rv;
+  }
+
+  inode_t *node = get_inode(inum);
+  long *times[2] = {&node->atime, &node->mtime};
+  int now[2] = {INODE_ATIME, INODE_MTIME};
+  int touch = INODE_CTIME;
+  for (int ii = 0; ii < 2; ++ii) {
+    if (ts[ii].tv_nsec == UTIME_NOW) {
+      touch |= now[ii];
+    } else if (ts[ii].tv_nsec != UTIME_OMIT) {
+      *times[ii] = ts[ii].tv_sec * 1000000000L + ts[ii].tv_nsec;
+    }
+  }
+  inode_touch(node, touch);
+  icache_unlock(inum);
+  journal_end();
+  return 0;
+}
+
+// Create a file or directory (depending on mode) named name in pinum, owned
+// by uid and gid. Returns the new inum.
+int storage_mknod_at(int pinum, const char *name, int mode, uid_t uid,
+                     gid_t gid) {
+  journal_begin();
+  int rv = storage_lock_dir(pinum, name);
+  if (rv < 0) {
+    journal_end();
+    return rv;
+  }
+
+  inode_t *parent = get_inode(pinum);
+  int inum = -1;
+  if (directory_lookup(parent, name) >= 0) {
+    rv = -EEXIST;
+  } else if ((inum = alloc_inode()) < 0) {
+    rv = -ENOSPC;
+  }
+  if (rv < 0) {
+    icache_unlock(pinum);
+    journal_end();
+    return rv;
+  }
+
+  // nobody else can reach the new inode until it has a name
+  inode_t *node = get_inode(inum);
+  inode_init(node, mode);
+  node->refs = 1;
+  node->uid = uid;
+  node->gid = gid;
+  // a set-group-ID directory passes its group (and, to directories, the
+  // set-group-ID bit) on to what is made in it
+  if (parent->mode & S_ISGID) {
+    node->gid = parent->gid;
+    if (S_ISDIR(mode)) {
+      node->mode |= S_ISGID;
+    }
+  }
+  inode_dirty(node);
+  if (S_ISDIR(mode) && directory_init(node, inum, pinum) != 0) {
+    rv = -ENOSPC;
+  } else if (directory_put(parent, name, inum) != 0) {
+    rv = -ENOSPC;
+  }
+  if (rv < 0) {
+    free_inode(inum);
+  } else {
+    inode_touch(parent, INODE_MTIME | INODE_CTIME);
+  }
+  icache_unlock(pinum);
+  journal_end();
+  return rv < 0 ? rv : inum;
+}
+
+// Remove the name of a file, freeing the file when its last name goes away.
+int storage_unlink_at(int pinum, const char *name) {
+  journal_begin();
+  int rv = storage_lock_dir(pinum, name);
+  if (rv < 0) {
+    journal_end();
+    return rv;
+  }
+
+  inode_t *parent = get_inode(pinum);
+  int inum = directory_lookup(parent, name);
+  if (inum < 0) {
+    icache_unlock(pinum);
+    journal_end();
+    return -ENOENT;
+  }
+
+  // the type of an inode never changes while it has a name
+  if (S_ISDIR(get_inode(inum)->mode)) {
+    icache_unlock(pinum);
+    journal_end();
+    return -EISDIR;
+  }
+
+  directory_delete(parent, name);
+  inode_touch(parent, INODE_MTIME | INODE_CTIME);
+  icache_unlock(pinum);
+  storage_release(inum);
+  journal_end();
+  return 0;
+}
+
+// Remove the empty directory inum, named name in the locked directory
+// parent. Returns 0 or a negative errno.
+static int storage_remove_dir(inode_t *parent, const char *name, int inum) {
+  inode_t *node = get_inode(inum);
+  icache_wrlock(inum);
+
+  int rv = 0;
+  if (!S_ISDIR(node->mode)) {
+    rv = -ENOTDIR;
+  } else if (directory_count(node) > 0) {
+    rv = -ENOTEMPTY;
+  } else {
+    directory_delete(parent, name);
+    inode_touch(parent, INODE_MTIME | INODE_CTIME);
+    node->refs = 0;
+    inode_touch(node, INODE_CTIME);
+    storage_unlinked(inum);
+  }
+  icache_unlock(inum);
+  return rv;
+}
+
+// Remove the empty directory named name in pinum.
+int storage_rmdir_at(int pinum, const char *name) {
+  journal_begin();
+  if (strcmp(name, ".") == 0 || strcmp(name, "..") == 0) {
+    journal_end();
+    return -EINVAL;
+  }
+
+  pthread_mutex_lock(&rename_lock);
+  int rv = storage_lock_dir(pinum, name);
+  if (rv < 0) {
+    pthread_mutex_unlock(&rename_lock);
+    journal_end();
+    return rv;
+  }
+
+  inode_t *parent = get_inode(pinum);
+  int inum = directory_lookup(parent, name);
+  if (inum < 0) {
+    rv = -ENOENT;
+  } else {
+    rv = storage_remove_dir(parent, name, inum);
+  }
+
+  icache_unlock(pinum);
+  pthread_mutex_unlock(&rename_lock);
+  journal_end();
+  return rv;
+}
+
+// Add the name name in pinum for the existing file inum.
+int storage_link_at(int inum, int pinum, const char *name) {
+  journal_begin();
+  int rv = storage_lock(inum, 1);
+  if (rv < 0) {
+    journal_end();
+    return rv;
+  }
+
+  // take the new reference first, so the file cannot be freed under us
+  inode_t *node = get_inode(inum);
+  if (S_ISDIR(node->mode)) {
+    icache_unlock(inum);
+    journal_end();
+    return -EPERM;
+  }
+  if (node->refs == 0) {
+    icache_unlock(inum); // an open file whose last link is gone
+    journal_end();
+    return -ENOENT;
+  }
+  node->refs++;
+  inode_touch(node, INODE_CTIME);
+  icache_unlock(inum);
+
+  rv = storage_lock_dir(pinum, name);
+  if (rv < 0) {
+    storage_release(inum);
+    journal_end();
+    return rv;
+  }
+
+  inode_t *parent = get_inode(pinum);
+  if (directory_lookup(parent, name) >= 0) {
+    rv = -EEXIST;
+  } else if (directory_put(parent, name, inum) != 0) {
+    rv = -ENOSPC;
+  } else {
+    inode_touch(parent, INODE_MTIME | INODE_CTIME);
+  }
+  icache_unlock(pinum);
+
+  if (rv < 0) {
+    storage_release(inum);
+  }
+  journal_end();
+  return rv;
+}
+
+// Is directory dir the same as, or an ancestor of, directory inum?
+// Must be called with rename_lock held, which keeps ".." entries stable.
+static int storage_is_ancestor(int dir, int inum) {
+  int root = blocks_super()->root_inum;
+  while (inum != dir && inum != root) {
+    inum = directory_lookup(get_inode(inum), "..");
+  }
+  return inum == dir;
+}
+
+// Move the entry from_name in from_parent to to_name in to_parent, with
+// both directories locked. Returns 0 or a negative errno.
+static int storage_move(int from_pinum, const char *from_name, int to_pinum,
+                        const char *to_name) {
+  inode_t *from_parent = get_inode(from_pinum);
+  inode_t *to_parent = get_inode(to_pinum);
+  int inum = directory_lookup(from_parent, from_name);
+  if (inum < 0) {
+    return -ENOENT;
+  }
+
+  inode_t *node = get_inode(inum);
+  int is_dir = S_ISDIR(node->mode);
+
+  int old = directory_lookup(to_parent, to_name);
+  if (old == inum) {
+    return 0;
+  }
+  if (old >= 0) {
+    int rv;
+    if (S_ISDIR(get_inode(old)->mode)) {
+      rv = is_dir ? storage_remove_dir(to_parent, to_name, old) : -EISDIR;
+    } else if (is_dir) {
+      rv = -ENOTDIR;
+    } else {
+      directory_delete(to_parent, to_name);
+      storage_release(old);
+      rv = 0;
+    }
+    if (rv < 0) {
+      return rv;
+    }
+  }
+
+  if (directory_put(to_parent, to_name, inum) != 0) {
+    return -ENOSPC;
+  }
+  directory_delete(from_parent, from_name);
+  inode_touch(from_parent, INODE_MTIME | INODE_CTIME);
+  inode_touch(to_parent, INODE_MTIME | INODE_CTIME);
+
+  // a moved directory needs its ".." to point at the new parent
+  icache_wrlock(inum);
+  if (is_dir && from_pinum != to_pinum) {
+    directory_set_parent(node, to_pinum);
+  }
+  inode_touch(node, INODE_CTIME);
+  icache_unlock(inum);
+  return 0;
+}
+
+// Move the entry from_name in from_pinum to to_name in to_pinum, replacing
+// any file already there.
+int storage_rename_at(int from_pinum, const char *from_name, int to_pinum,
+                      const char *to_name) {
+  journal_begin();
+  if (strlen(to_name) >= DIR_NAME_LENGTH) {
+    journal_end();
+    return -ENAMETOOLONG;
+  }
+  // "." and ".." name directories that are locked below
+  if (strcmp(from_name, ".") == 0 || strcmp(from_name, "..") == 0 ||
+      strcmp(to_name, ".") == 0 || strcmp(to_name, "..") == 0) {
+    journal_end();
+    return -EINVAL;
+  }
+
+  pthread_mutex_lock(&rename_lock);
+
+  // a directory cannot be moved inside itself. Only renames move
+  // directories, so the answer holds until the rename lock is released
+  int inum = storage_lookup(from_pinum, from_name);
+  int rv = inum < 0 ? inum : storage_lookup(to_pinum, ".");
+  if (rv >= 0 && S_ISDIR(get_inode(inum)->mode) &&
+      storage_is_ancestor(inum, to_pinum)) {
+    rv = -EINVAL;
+  }
+  // nor can anything replace a directory holding it, which would also
+  // lock the source directory twice
+  if (rv >= 0) {
+    int old = storage_lookup(to_pinum, to_name);
+    if (old >= 0 && storage_is_ancestor(old, from_pinum)) {
+      rv = -ENOTEMPTY;
+    }
+  }
+  if (rv < 0) {
+    pthread_mutex_unlock(&rename_lock);
+    journal_end();
+    return rv;
+  }
+
+  // lock the two directories in inum order
+  int first = from_pinum < to_pinum ? from_pinum : to_pinum;
+  int second = from_pinum < to_pinum ? to_pinum : from_pinum;
+  rv = storage_lock(first, 1);
+  if (rv == 0 && second != first) {
+    rv = storage_lock(second, 1);
+    if (rv < 0) {
+      icache_unlock(first);
+    }
+  }
+  if (rv < 0) {
+    pthread_mutex_unlock(&rename_lock);
+    journal_end();
+    return rv;
+  }
+
+  rv = storage_move(from_pinum, from_name, to_pinum, to_name);
+
+  if (second != first) {
+    icache_unlock(second);
+  }
+  icache_unlock(first);
+  pthread_mutex_unlock(&rename_lock);
+  journal_end();
+  return rv;
+}
+
+// Entries collected from a directory while it is locked, to be handed out
+// once it is unlocked again.
+#define STORAGE_READDIR_BATCH 32
+
+typedef struct readdir_batch {
+  int count;
+  struct {
+    char name[DIR_NAME_LENGTH];
+    int inum;
+    off_t next;
+  } ents[STORAGE_READDIR_BATCH];
+} readdir_batch_t;
+
+// Adds one entry to a batch, stopping the listing once the batch is full.
+static int storage_batch_fill(void *ctx, const char *name, int inum,
+                              off_t next) {
+  readdir_batch_t *batch = ctx;
+  strcpy(batch->ents[batch->count].name, name);
+  batch->ents[batch->count].inum = inum;
+  batch->ents[batch->count].next = next;
+  batch->count++;
+  return batch->count == STORAGE_READDIR_BATCH;
+}
+
+// Pass the entries of directory inum to fill, with their attributes,
+// starting at offset. The directory is only locked while a batch of entries
+// is copied out, so fill is free to look at other inodes (including this
+// one). Each entry's inode is then locked just long enough to read it;
+// entries removed in between are skipped.
+int storage_readdir_ino(int inum, off_t offset, storage_filler_t fill,
+                        void *ctx) {
+  readdir_batch_t batch;
+  do {
+    batch.count = 0;
+    int rv = storage_lock(inum, 0);
+    if (rv < 0) {
+      return rv;
+    }
+    if (!S_ISDIR(get_inode(inum)->mode)) {
+      icache_unlock(inum);
+      return -ENOTDIR;
+    }
+    directory_read(get_inode(inum), offset, storage_batch_fill, &batch);
+    icache_unlock(inum);
+
+    for (int ii = 0; ii < batch.count; ++ii) {
+      struct stat st;
+      if (storage_lock(batch.ents[ii].inum, 0) == 0) {
+        storage_stat_locked(batch.ents[ii].inum, &st);
+        icache_unlock(batch.ents[ii].inum);
+        if (fill(ctx, batch.ents[ii].name, &st, batch.ents[ii].next)) {
+          return 0;
+        }
+      }
+      offset = batch.ents[ii].next;
+    }
+  } while (batch.count == STORAGE_READDIR_BATCH);
+  return 0;
+}
+
+// Look up the directory containing path and copy the last path component
+// into name. Returns the directory's inum or a negative errno.
+static int storage_parent(const char *path, char *name) {
+  const char *slash = strrchr(path, '/');
+  if (slash == NULL || slash[1] == 0) {
+    return -EINVAL;
+  }
+  if (strlen(slash + 1) >= DIR_NAME_LENGTH) {
+    return -ENAMETOOLONG;
+  }
+  strcpy(name, slash + 1);
+
+  char parent[slash - path + 2];
+  memcpy(parent, path, slash - path);
+  parent[slash - path] = 0;
+
+  int inum = tree_lookup(slash == path ? "/" : parent);
+  if (inum < 0) {
+    return -ENOENT;
+  }
+  return inum;
+}
+
+// Look up path, returning its inum or -ENOENT.
+static int storage_path(const char *path) {
+  int inum = tree_lookup(path);
+  return inum < 0 ? -ENOENT : inum;
+}
+
+// Fill in the attributes of the object at path.
+int storage_stat(const char *path, struct stat *st) {
+  int inum = storage_path(path);
+  return inum < 0 ? inum : storage_getattr(inum, st);
+}
+
+// Read up to size bytes at offset, returning the number of bytes read.
+int storage_read(const char *path, char *buf, size_t size, off_t offset) {
+  int inum = storage_path(path);
+  return inum < 0 ? inum : storage_read_ino(inum, buf, size, offset);
+}
+
+// Write size bytes at offset, growing the file as needed.
+int storage_write(const char *path, const char *buf, size_t size,
+                  off_t offset) {
+  int inum = storage_path(path);
+  return inum < 0 ? inum : storage_write_ino(inum, buf, size, offset);
+}
+
+// Set the size of a file. Growing it leaves a hole; shrinking it frees the
+// blocks past the new end.
+int storage_truncate(const char *path, off_t size) {
+  int inum = storage_path(path);
+  return inum < 0 ? inum : storage_truncate_ino(inum, size);
+}
+
+// Create a file or directory (depending on mode) at path.
+int storage_mknod(const char *path, int mode) {
+  char name[DIR_NAME_LENGTH];
+  int pinum = storage_parent(path, name);
+  if (pinum < 0) {
+    return pinum;
+  }
+  int inum = storage_mknod_at(pinum, name, mode, storage_uid, storage_gid);
+  return inum < 0 ? inum : 0;
+}
+
+// Remove a name for a file, freeing the file when its last name goes away.
+int storage_unlink(const char *path) {
+  char name[DIR_NAME_LENGTH];
+  int pinum = storage_parent(path, name);
+  return pinum < 0 ? pinum : storage_unlink_at(pinum, name);
+}
+
+// Remove an empty directory.
+int storage_rmdir(const char *path) {
+  char name[DIR_NAME_LENGTH];
+  int pinum = storage_parent(path, name);
+  return pinum < 0 ? pinum : storage_rmdir_at(pinum, name);
+}
+
+// Add a new name (to) for an existing file (from).
+int storage_link(const char *from, const char *to) {
+  int inum = storage_path(from);
+  if (inum < 0) {
+    return inum;
+  }
+
+  char name[DIR_NAME_LENGTH];
+  int pinum = storage_parent(to, name);
+  return pinum < 0 ? pinum : storage_link_at(inum, pinum, name);
+}
+
+// Move the object at from to the name to, replacing any file already there.
+int storage_rename(const char *from, const char *to) {
+  char from_name[DIR_NAME_LENGTH];
+  char to_name[DIR_NAME_LENGTH];
+
+  int from_pinum = storage_parent(from, from_name);
+  if (from_pinum < 0) {
+    return from_pinum;
+  }
+  int to_pinum = storage_parent(to, to_name);
+  if (to_pinum < 0) {
+    return to_pinum;
+  }
+  return storage_rename_at(from_pinum, from_name, to_pinum, to_name);
+}
+
+// Change the permission bits of an object.
+int storage_chmod(const char *path, int mode) {
+  int inum = storage_path(path);
+  return inum < 0 ? inum : storage_chmod_ino(inum, mode);
+}
+
+// Set the access and modification times of an object.
+int storage_set_time(const char *path, const struct timespec ts[2]) {
+  int inum = storage_path(path);
+  return inum < 0 ? inum : storage_utimens_ino(inum, ts);
+}
+
+// List the names in the directory at path.
+slist_t *storage_list(const char *path) { return directory_list(path); }
+
+// Pass the entries of the directory at path to fill, starting at offset.
+int storage_readdir(const char *path, off_t offset, storage_filler_t fill,
+                    void *ctx) {
+  int inum = storage_path(path);
+  return inum < 0 ? inum : storage_readdir_ino(inum, offset, fill, ctx);
+}
@@ -14,16 +14,82 @@
 
 #include "slist.h"
 
+// Called by storage_readdir() for each entry of a directory, with the
+// entry's attributes (as storage_getattr() gives them; st_ino is its inum)
+// and the offset at which to resume after it. Returns nonzero to stop the
+// listing.
+typedef int (*storage_filler_t)(void *ctx, const char *name,
+                                const struct stat *st, off_t next);
+
+// A piece of a file's data, handed to a storage_io_t: len bytes at mem,
+// which for blocks of the file is also offset pos of the image file. pos
+// is -1 for data kept in the inode, and for a hole in a read, which has no
+// mem either and reads as zeros.
+typedef struct storage_seg {
+  off_t pos;
+  void *mem;
+  size_t len;
+} storage_seg_t;
+
+// Called by storage_read_buf_ino() and storage_write_buf_ino() with the
+// pieces a request covers, in order, while the file is locked; fd is the
+// image file. Returns the number of bytes moved or a negative errno.
+typedef ssize_t (*storage_io_t)(void *ctx, int fd, const storage_seg_t *segs,
+                                int count);
+
 void storage_init(const char *path);
+void storage_start();
+void storage_free();
+
+// Access by inode number. Directory entries are named by the inum of their
+// directory and the entry name. All return a negative errno on failure.
+int storage_lookup(int pinum, const char *name);
+int storage_getattr(int inum, struct stat *st);
+int storage_read_ino(int inum, char *buf, size_t size, off_t offset);
+int storage_write_ino(int inum, const char *buf, size_t size, off_t offset);
+ssize_t storage_read_buf_ino(int inum, size_t size, off_t offset,
+                             storage_io_t io, void *ctx);
+ssize_t storage_write_buf_ino(int inum, size_t size, off_t offset,
+                              storage_io_t io, void *ctx);
+ssize_t storage_copy_range_ino(int src, off_t src_off, int dst, off_t dst_off,
+                               size_t len);
+int storage_truncate_ino(int inum, off_t size);
+int storage_fsync_ino(int inum);
+int storage_flush_ino(int inum);
+int storage_open_ino(int inum);
+void storage_close_ino(int inum);
+void storage_ref_ino(int inum);
+void storage_forget_ino(int inum, unsigned long count);
+int storage_generation_ino(int inum);
+int storage_fallocate_ino(int inum, int mode, off_t offset, off_t len);
+off_t storage_lseek_ino(int inum, off_t offset, int whence);
+int storage_chmod_ino(int inum, int mode);
+int storage_chown_ino(int inum, uid_t uid, gid_t gid);
+int storage_utimens_ino(int inum, const struct timespec ts[2]);
+int storage_mknod_at(int pinum, const char *name, int mode, uid_t uid,
+                     gid_t gid);
+int storage_unlink_at(int pinum, const char *name);
+int storage_rmdir_at(int pinum, const char *name);
+int storage_link_at(int inum, int pinum, const char *name);
+int storage_rename_at(int from_pinum, const char *from_name, int to_pinum,
+                      const char *to_name);
+int storage_readdir_ino(int inum, off_t offset, storage_filler_t fill,
+                        void *ctx);
+
+// Access by path, resolved from the root directory.
 int storage_stat(const char *path, struct stat *st);
 int storage_read(const char *path, char *buf, size_t size, off_t offset);
 int storage_write(const char *path, const char *buf, size_t size, off_t offset);
 int storage_truncate(const char *path, off_t size);
 int storage_mknod(const char *path, int mode);
 int storage_unlink(const char *path);
+int storage_rmdir(const char *path);
 int storage_link(const char *from, const char *to);
 int storage_rename(const char *from, const char *to);
+int storage_chmod(const char *path, int mode);
 int storage_set_time(const char *path, const struct timespec ts[2]);
 slist_t *storage_list(const char *path);
+int storage_readdir(const char *path, off_t offset, storage_filler_t fill,
+                    void *ctx);
 
 #endif
@@ -2,9 +2,12 @@
 use 5.16.0;
 use warnings FATAL => 'all';
 
-use Test::Simple tests => 31;
+use Test::Simple tests => 70;
 use IO::Handle;
 
+# Fcntl does not export these; the values are Linux's
+use constant { SEEK_DATA => 3, SEEK_HOLE => 4 };
+
 sub mount {
     system("(make mount 2>&1) >> test.log &");
     sleep 1;
@@ -14,6 +17,24 @@ sub unmount {
     system("(make unmount 2>&1) >> test.log");
 }
 
+# kill nufs without letting it write anything back, closing the given
+# files so the mount can be cleaned up
+sub crash {
+    my (@open) = @_;
+    system("pkill -KILL -f '^./nufs -f mnt'");
+    close $_ for @open;
+    sleep 1;
+    unmount();
+}
+
+# start over on an image made by mkfs.nufs with the given options, for
+# tests that need more room than the default 1MB image
+sub mkfs {
+    my ($opts) = @_;
+    system("rm -f data.nufs test.log");
+    system("(./mkfs.nufs $opts data.nufs 2>&1) >> test.log");
+}
+
 sub write_text {
     my ($name, $data) = @_;
     open my $fh, ">", "mnt/$name" or return;
@@ -31,6 +52,42 @@ sub read_text {
     return $data;
 }
 
+sub list_dir {
+    my ($name) = @_;
+    opendir my $dh, "mnt/$name" or return ();
+    my @names = grep { $_ ne "." and $_ ne ".." } readdir $dh;
+    closedir $dh;
+    return sort @names;
+}
+
+# copy_file_range(2), which perl has no wrapper for. Returns the bytes
+# copied.
+sub copy_range {
+    my ($from, $from_off, $to, $to_off, $len) = @_;
+    require "syscall.ph";
+    open my $in, "<", "mnt/$from" or return -1;
+    open my $out, "+<", "mnt/$to" or return -1;
+    my $in_off = pack("q", $from_off);
+    my $out_off = pack("q", $to_off);
+    my $done = 0;
+    while ($done < $len) {
+        my $count = syscall(&SYS_copy_file_range, fileno($in), $in_off,
+                            fileno($out), $out_off, $len - $done, 0);
+        last if $count <= 0;
+        $done += $count;
+    }
+    close $in;
+    close $out;
+    return $done;
+}
+
+# a counter from the stats file, or -1 if it is missing
+sub stat_count {
+    my ($name) = @_;
+    my ($count) = read_text(".nufs/stats") =~ /^$name (-?\d+)/m;
+    return $count // -1;
+}
+
 sub read_text_slice {
     my ($name, $count, $offset) = @_;
     open my $fh, "<", "mnt/$name" or return "";
@@ -171,5 +228,313 @@ ok(($listed and $exists and $has_size), "Larger file exists and has the correct
 $back = read_text("larger.txt");
 ok($content eq $back, "Read back data from larger file correctly");
 
-unmount()
+unmount();
+
+mkfs("-s 64M -i 8192");
+
+mount();
+
+say "# Large directories";
+
+# a few thousand entries take many directory blocks
+my @big = map { "f$_" } 0 .. 2999;
+mkdir("mnt/big");
+write_text("big/$_", $_) for @big;
+my @listed = list_dir("big");
+ok("@listed" eq join(" ", sort @big), "Listed 3000 entries");
+
+# removing entries while listing must not skip or repeat the rest
+my %seen;
+opendir my $dh, "mnt/big";
+while (defined(my $name = readdir $dh)) {
+    next if $name eq "." or $name eq "..";
+    $seen{$name}++;
+    unlink("mnt/big/$name") unless $name =~ /0$/;
+}
+closedir $dh;
+ok((scalar(keys %seen) == @big and !grep { $_ != 1 } values %seen),
+   "Listed each entry once while removing most of them");
+
+my @kept = sort grep { /0$/ } @big;
+@listed = list_dir("big");
+ok("@listed" eq "@kept", "Listed the 300 entries left");
+ok(read_text("big/f2990") eq "f2990", "Read back a file that was kept");
+
+unmount();
+mount();
+
+@listed = list_dir("big");
+ok("@listed" eq "@kept", "Listed the 300 entries left after remounting");
 
+unmount();
+
+system("rm -f data.nufs test.log");
+
+mount();
+
+say "# Crash recovery";
+
+mkdir("mnt/kept");
+my $synced = "This was fsynced before the crash.\n" x 200;
+open my $sfh, ">", "mnt/kept/synced.txt";
+print $sfh $synced;
+$sfh->flush;
+$sfh->sync;
+close $sfh;
+
+crash();
+mount();
+
+ok(-d "mnt/kept", "An fsynced directory survives a crash");
+ok(read_text("kept/synced.txt") eq $synced =~ s/\s*$//r,
+   "Fsynced data survives a crash");
+
+write_text("kept/after.txt", "written after the crash");
+unmount();
+mount();
+ok(read_text("kept/after.txt") eq "written after the crash",
+   "The image still works after a crash");
+
+unmount();
+
+mkfs("-s 16M");
+
+mount();
+
+say "# Sparse files";
+
+write_text("grow.txt", "abc");
+truncate("mnt/grow.txt", 100000);
+ok(-s "mnt/grow.txt" == 100000, "Truncate grows a file");
+ok(read_text_slice("grow.txt", 100000, 0) eq "abc\n" . "\0" x 99996,
+   "A grown file reads as zeros past its old end");
+
+open my $gfh, "+<", "mnt/grow.txt";
+sysseek $gfh, 100_000_000, 0;
+syswrite $gfh, "far";
+close $gfh;
+ok(-s "mnt/grow.txt" == 100_000_003, "Write far past the end of a file");
+ok((read_text_slice("grow.txt", 65536, 50_000_000) eq "\0" x 65536 and
+    read_text_slice("grow.txt", 3, 100_000_000) eq "far"),
+   "Read zeros before data written far past the end");
+
+# data in [0, 64K) and [1M, 1M + 64K), with a hole between
+open my $hfh, ">", "mnt/holey.bin";
+print $hfh "a" x 65536;
+seek $hfh, 1 << 20, 0;
+print $hfh "b" x 65536;
+close $hfh;
+open $hfh, "<", "mnt/holey.bin";
+ok((sysseek($hfh, 0, SEEK_HOLE) == 65536 and
+    sysseek($hfh, 65536, SEEK_DATA) == 1 << 20 and
+    sysseek($hfh, 1 << 20, SEEK_HOLE) == (1 << 20) + 65536 and
+    !defined sysseek($hfh, (1 << 20) + 65536, SEEK_DATA)),
+   "SEEK_DATA and SEEK_HOLE find the hole in a file");
+close $hfh;
+
+unmount();
+
+mkfs("-s 16M");
+
+mount();
+
+say "# fallocate";
+
+system("touch mnt/alloc.bin");
+system("fallocate -l 1M mnt/alloc.bin");
+ok((-s "mnt/alloc.bin" == 1 << 20 and
+    read_text_slice("alloc.bin", 1 << 20, 0) eq "\0" x (1 << 20)),
+   "fallocate grows a file and it reads as zeros");
+
+write_text("keep.txt", "keep");
+system("fallocate --keep-size -l 1M mnt/keep.txt");
+ok((-s "mnt/keep.txt" == 5 and read_text("keep.txt") eq "keep"),
+   "fallocate --keep-size leaves the size alone");
+
+open my $pfh, ">", "mnt/punch.bin";
+print $pfh "x" x 12288;
+close $pfh;
+system("fallocate --punch-hole -o 1000 -l 6000 mnt/punch.bin");
+ok(-s "mnt/punch.bin" == 12288, "Punching a hole keeps the size");
+ok(read_text_slice("punch.bin", 12288, 0) eq
+       "x" x 1000 . "\0" x 6000 . "x" x 5288,
+   "Punching a hole zeroes exactly the punched bytes");
+
+unmount();
+
+mkfs("-s 16M");
+
+mount();
+
+say "# Unlinking open files";
+
+my $free0 = stat_count("free_blocks");
+my $orphan = "o" x (1 << 20);
+open my $ofh, "+>", "mnt/orphan.bin";
+print $ofh $orphan;
+$ofh->flush;
+unlink("mnt/orphan.bin");
+ok(!-e "mnt/orphan.bin", "An open file can be unlinked");
+
+print $ofh "more";
+$ofh->flush;
+my $back_orphan;
+sysseek $ofh, 0, 0;
+sysread $ofh, $back_orphan, 2 << 20;
+ok($back_orphan eq $orphan . "more", "Read and write an unlinked file");
+ok(stat_count("free_blocks") < $free0,
+   "An unlinked file keeps its space while open");
+
+close $ofh;
+sleep 1; # the kernel releases and forgets the file after close returns
+ok(stat_count("free_blocks") == $free0,
+   "Closing an unlinked file frees its space");
+
+# crash while an unlinked file is open, once the unlink is committed
+open $ofh, ">", "mnt/orphan.bin";
+print $ofh $orphan;
+unlink("mnt/orphan.bin");
+$ofh->flush;
+$ofh->sync;
+crash($ofh);
+mount();
+ok(stat_count("free_blocks") == $free0,
+   "Mounting frees a file left unlinked by a crash");
+
+unmount();
+
+mkfs("-s 16M");
+
+mount();
+
+say "# copy_file_range";
+
+# 64 blocks that all differ
+my $source = join("", map { sprintf("%4095d\n", $_) } 0 .. 63);
+open my $cfh, ">", "mnt/source.bin";
+print $cfh $source;
+close $cfh;
+
+system("touch mnt/copy.bin mnt/odd.bin");
+ok((copy_range("source.bin", 0, "copy.bin", 0, length $source) ==
+        length $source and
+    read_text_slice("copy.bin", 1 << 20, 0) eq $source),
+   "Copy a file with copy_file_range");
+ok(stat_count("shared_blocks") >= 64, "The copy shares the source's blocks");
+
+ok((copy_range("source.bin", 100, "odd.bin", 5000, 200000) == 200000 and
+    read_text_slice("odd.bin", 1 << 20, 0) eq
+        "\0" x 5000 . substr($source, 100, 200000)),
+   "Copy between unaligned offsets");
+
+my $changed = $source;
+substr($changed, 3 * 4096 + 10, 7) = "changed";
+open $cfh, "+<", "mnt/copy.bin";
+seek $cfh, 3 * 4096 + 10, 0;
+print $cfh "changed";
+close $cfh;
+ok(read_text_slice("copy.bin", 1 << 20, 0) eq $changed,
+   "Overwrite part of a copy");
+ok(read_text_slice("source.bin", 1 << 20, 0) eq $source,
+   "Overwriting a copy leaves the source alone");
+
+unmount();
+mount();
+
+ok((read_text_slice("source.bin", 1 << 20, 0) eq $source and
+    read_text_slice("copy.bin", 1 << 20, 0) eq $changed and
+    read_text_slice("odd.bin", 1 << 20, 5000) eq
+        substr($source, 100, 200000)),
+   "Copies and their source survive a remount");
+
+unmount();
+
+mkfs("-s 16M -d");
+
+mount();
+
+say "# Deduplication";
+
+$free0 = stat_count("free_blocks");
+my $dup = join("", map { sprintf("%4095d\n", $_) } 0 .. 31);
+for my $ii (0 .. 3) {
+    open my $dfh, ">", "mnt/dup$ii.bin";
+    print $dfh $dup;
+    close $dfh;
+}
+ok(!grep({ read_text_slice("dup$_.bin", 1 << 20, 0) ne $dup } 0 .. 3),
+   "Read back files with the same blocks");
+ok(stat_count("dedup_hits") >= 96, "Files with the same blocks share them");
+
+my $dup1 = $dup;
+substr($dup1, 5 * 4096, 7) = "changed";
+open my $dfh, "+<", "mnt/dup1.bin";
+seek $dfh, 5 * 4096, 0;
+print $dfh "changed";
+close $dfh;
+ok((read_text_slice("dup1.bin", 1 << 20, 0) eq $dup1 and
+    !grep({ read_text_slice("dup$_.bin", 1 << 20, 0) ne $dup } 0, 2, 3)),
+   "Overwriting a shared block changes only that file");
+
+unmount();
+mount();
+
+ok((read_text_slice("dup1.bin", 1 << 20, 0) eq $dup1 and
+    !grep({ read_text_slice("dup$_.bin", 1 << 20, 0) ne $dup } 0, 2, 3)),
+   "Shared blocks survive a remount");
+
+unlink("mnt/dup$_.bin") for 0 .. 3;
+sleep 1; # the files are freed once the kernel forgets them
+ok(stat_count("free_blocks") == $free0,
+   "Removing files with shared blocks frees all of them");
+
+unmount();
+
+mkfs("-s 16M -c");
+
+mount();
+
+say "# Compression";
+
+my $text = join("", map { sprintf("line %d of text\n", $_ % 1000) } 0 .. 20000);
+$text = substr($text, 0, 262144);
+srand(42);
+my $noise = join("", map { chr(int(rand(256))) } 1 .. 262144);
+for (["text.txt", $text], ["noise.bin", $noise]) {
+    open my $zfh, ">", "mnt/$_->[0]";
+    print $zfh $_->[1];
+    close $zfh;
+}
+sleep 1; # the last cluster is compressed once the kernel releases the file
+
+ok(read_text_slice("text.txt", 1 << 20, 0) eq $text,
+   "Read back a compressed file");
+ok((stat "mnt/text.txt")[12] * 512 < length($text) / 2,
+   "A compressible file takes less space");
+ok((read_text_slice("noise.bin", 1 << 20, 0) eq $noise and
+    (stat "mnt/noise.bin")[12] * 512 >= length($noise)),
+   "Read back a file that does not compress");
+
+substr($text, 70000, 7) = "changed";
+open my $zfh, "+<", "mnt/text.txt";
+seek $zfh, 70000, 0;
+print $zfh "changed";
+close $zfh;
+ok(read_text_slice("text.txt", 1 << 20, 0) eq $text,
+   "Overwrite part of a compressed cluster");
+
+# cut the third cluster short, then grow the file past it again
+truncate("mnt/text.txt", 150000);
+truncate("mnt/text.txt", 200000);
+$text = substr($text, 0, 150000) . "\0" x 50000;
+ok(read_text_slice("text.txt", 1 << 20, 0) eq $text,
+   "Truncate into a compressed cluster");
+
+unmount();
+mount();
+
+ok((read_text_slice("text.txt", 1 << 20, 0) eq $text and
+    read_text_slice("noise.bin", 1 << 20, 0) eq $noise),
+   "Compressed files survive a remount");
+
+unmount();
@@ -0,0 +1,344 @@
+// nufs-bench-storage: benchmark the storage layer without FUSE.
+//
+// usage: nufs-bench-storage [-b block_size] [-s size] [-i inode_count]
+//                           [-n ops] [-f file_size] [-d depth] [-r seed]
+//                           [-w workload,...] [image]
+//
+// Formats a fresh image (bench.nufs by default) and runs each workload on
+// it by calling the storage_* functions directly, so the numbers measure
+// the file system code alone, without the kernel or FUSE in the way:
+//
+//   create   make -n empty files in one directory, then remove them
+//   randrw   -n 4K reads and writes at random offsets of a -f byte file
+//   seqio    write a -f byte file in 1M chunks, then read it back
+//   stat     stat a file -d directories deep, -n times
+//   readdir  list a directory of -n entries, 100 times
+//
+// Each workload reports its operations per second (and bytes per second
+// for I/O) and the latency percentiles of single operations. The journal's
+// commit thread runs as it does when mounted.
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "blocks.h"
+#include "directory.h"
+#include "inode.h"
+#include "storage.h"
+
+#define BENCH_SMALL_IO 4096
+#define BENCH_LARGE_IO (1 << 20)
+#define BENCH_READDIR_ROUNDS 100
+
+typedef struct bench {
+  long ops;       // -n
+  long file_size; // -f
+  int depth;      // -d
+  uint64_t *lat;  // latency of each timed operation, in ns
+  long count;     // operations timed so far
+  long bytes;     // bytes read or written so far
+  uint64_t start; // when the workload started
+} bench_t;
+
+// Parse a count with an optional K/M/G/T suffix, returning -1 on error.
+static long parse_size(const char *text) {
+  char *end;
+  long value = strtol(text, &end, 10);
+  if (end == text || value <= 0) {
+    return -1;
+  }
+
+  switch (*end) {
+  case 'T': case 't': value <<= 10; // fall through
+  case 'G': case 'g': value <<= 10; // fall through
+  case 'M': case 'm': value <<= 10; // fall through
+  case 'K': case 'k': value <<= 10; end++; break;
+  case 0: break;
+  default: return -1;
+  }
+
+  return *end == 0 ? value : -1;
+}
+
+static void usage(const char *prog) {
+  fprintf(stderr, "usage: %s [-b block_size] [-s size] [-i inode_count] "
+                  "[-n ops] [-f file_size] [-d depth] [-r seed] "
+                  "[-w workload,...] [image]\n", prog);
+  exit(1);
+}
+
+static uint64_t now() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t) ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+// Stop if a storage call failed; a benchmark of failing calls means nothing.
+static void check(int rv, const char *what) {
+  if (rv < 0) {
+    fprintf(stderr, "%s: %s\n", what, strerror(-rv));
+    exit(1);
+  }
+}
+
+// Start timing a workload that will time up to n operations.
+static void bench_start(bench_t *b, long n) {
+  b->lat = realloc(b->lat, n * sizeof(uint64_t));
+  if (b->lat == 0) {
+    perror("realloc");
+    exit(1);
+  }
+  b->count = 0;
+  b->bytes = 0;
+  b->start = now();
+}
+
+// Record one operation that started at the given time.
+static void bench_op(bench_t *b, uint64_t start) {
+  b->lat[b->count++] = now() - start;
+}
+
+static int cmp_u64(const void *a, const void *b) {
+  uint64_t x = *(const uint64_t *) a;
+  uint64_t y = *(const uint64_t *) b;
+  return x < y ? -1 : x > y;
+}
+
+// Print the results of a workload.
+static void bench_report(bench_t *b, const char *name) {
+  double secs = (now() - b->start) / 1e9;
+  qsort(b->lat, b->count, sizeof(uint64_t), cmp_u64);
+
+  uint64_t total = 0;
+  for (long ii = 0; ii < b->count; ++ii) {
+    total += b->lat[ii];
+  }
+  double avg = b->count ? (double) total / b->count : 0;
+#define PCT(p) (b->count ? b->lat[(long) ((b->count - 1) * (p))] / 1e3 : 0)
+
+  printf("%-10s %9ld %12.0f %10.1f %9.1f %9.1f %9.1f %9.1f %10.1f\n", name,
+         b->count, b->count / secs, b->bytes / secs / (1 << 20), avg / 1e3,
+         PCT(0.5), PCT(0.9), PCT(0.99), PCT(1.0));
+#undef PCT
+}
+
+// Create a directory's worth of files, then remove them.
+static void bench_create(bench_t *b) {
+  check(storage_mknod("/create", 040755), "mkdir /create");
+  char path[64];
+
+  bench_start(b, b->ops);
+  for (long ii = 0; ii < b->ops; ++ii) {
+    snprintf(path, sizeof(path), "/create/f%ld", ii);
+    uint64_t t = now();
+    check(storage_mknod(path, 0100644), path);
+    bench_op(b, t);
+  }
+  bench_report(b, "create");
+
+  bench_start(b, b->ops);
+  for (long ii = 0; ii < b->ops; ++ii) {
+    snprintf(path, sizeof(path), "/create/f%ld", ii);
+    uint64_t t = now();
+    check(storage_unlink(path), path);
+    bench_op(b, t);
+  }
+  bench_report(b, "unlink");
+  check(storage_rmdir("/create"), "rmdir /create");
+}
+
+// Small reads and writes at random block-aligned offsets of one file.
+static void bench_randrw(bench_t *b) {
+  char buf[BENCH_SMALL_IO];
+  memset(buf, 'r', sizeof(buf));
+  long chunks = b->file_size / BENCH_SMALL_IO;
+  if (chunks == 0) {
+    return;
+  }
+
+  check(storage_mknod("/randrw", 0100644), "mknod /randrw");
+  check(storage_truncate("/randrw", chunks * BENCH_SMALL_IO), "truncate");
+  int inum = storage_lookup(blocks_super()->root_inum, "randrw");
+  check(inum, "lookup /randrw");
+
+  const char *names[] = {"randwrite", "randread"};
+  for (int pass = 0; pass < 2; ++pass) {
+    bench_start(b, b->ops);
+    for (long ii = 0; ii < b->ops; ++ii) {
+      off_t off = (off_t) (random() % chunks) * BENCH_SMALL_IO;
+      uint64_t t = now();
+      int rv = pass == 0 ? storage_write_ino(inum, buf, sizeof(buf), off)
+                         : storage_read_ino(inum, buf, sizeof(buf), off);
+      check(rv, names[pass]);
+      bench_op(b, t);
+      b->bytes += rv;
+    }
+    bench_report(b, names[pass]);
+  }
+  check(storage_unlink("/randrw"), "unlink /randrw");
+}
+
+// Stream a large file out and back in.
+static void bench_seqio(bench_t *b) {
+  char *buf = malloc(BENCH_LARGE_IO);
+  memset(buf, 's', BENCH_LARGE_IO);
+  long chunks = (b->file_size + BENCH_LARGE_IO - 1) / BENCH_LARGE_IO;
+
+  check(storage_mknod("/seqio", 0100644), "mknod /seqio");
+  int inum = storage_lookup(blocks_super()->root_inum, "seqio");
+  check(inum, "lookup /seqio");
+
+  const char *names[] = {"seqwrite", "seqread"};
+  for (int pass = 0; pass < 2; ++pass) {
+    bench_start(b, chunks);
+    for (long ii = 0; ii < chunks; ++ii) {
+      off_t off = (off_t) ii * BENCH_LARGE_IO;
+      uint64_t t = now();
+      int rv = pass == 0 ? storage_write_ino(inum, buf, BENCH_LARGE_IO, off)
+                         : storage_read_ino(inum, buf, BENCH_LARGE_IO, off);
+      check(rv, names[pass]);
+      bench_op(b, t);
+      b->bytes += rv;
+    }
+    bench_report(b, names[pass]);
+  }
+  check(storage_unlink("/seqio"), "unlink /seqio");
+  free(buf);
+}
+
+// Stat a file at the bottom of a chain of directories, resolving the whole
+// path every time.
+static void bench_stat(bench_t *b) {
+  char path[DIR_NAME_LENGTH * 2 * (b->depth + 1)];
+  path[0] = 0;
+  for (int ii = 0; ii < b->depth; ++ii) {
+    sprintf(path + strlen(path), "/d%d", ii);
+    check(storage_mknod(path, 040755), path);
+  }
+  strcat(path, "/leaf");
+  check(storage_mknod(path, 0100644), path);
+
+  struct stat st;
+  bench_start(b, b->ops);
+  for (long ii = 0; ii < b->ops; ++ii) {
+    uint64_t t = now();
+    check(storage_stat(path, &st), path);
+    bench_op(b, t);
+  }
+  bench_report(b, "stat");
+
+  // tear the chain down from the bottom
+  check(storage_unlink(path), path);
+  for (int ii = b->depth; ii > 0; --ii) {
+    *strrchr(path, '/') = 0;
+    check(storage_rmdir(path), path);
+  }
+}
+
+static int count_entry(void *ctx, const char *name, const struct stat *st,
+                       off_t next) {
+  (*(long *) ctx)++;
+  return 0;
+}
+
+// List a large directory from start to end.
+static void bench_readdir(bench_t *b) {
+  check(storage_mknod("/readdir", 040755), "mkdir /readdir");
+  char path[64];
+  for (long ii = 0; ii < b->ops; ++ii) {
+    snprintf(path, sizeof(path), "/readdir/f%ld", ii);
+    check(storage_mknod(path, 0100644), path);
+  }
+
+  bench_start(b, BENCH_READDIR_ROUNDS);
+  for (int ii = 0; ii < BENCH_READDIR_ROUNDS; ++ii) {
+    long entries = 0;
+    uint64_t t = now();
+    check(storage_readdir("/readdir", 0, count_entry, &entries), "readdir");
+    bench_op(b, t);
+    if (entries < b->ops) {
+      fprintf(stderr, "readdir: %ld of %ld entries\n", entries, b->ops);
+      exit(1);
+    }
+  }
+  bench_report(b, "readdir");
+
+  for (long ii = 0; ii < b->ops; ++ii) {
+    snprintf(path, sizeof(path), "/readdir/f%ld", ii);
+    check(storage_unlink(path), path);
+  }
+  check(storage_rmdir("/readdir"), "rmdir /readdir");
+}
+
+typedef struct workload {
+  const char *name;
+  void (*run)(bench_t *b);
+} workload_t;
+
+static const workload_t workloads[] = {
+    {"create", bench_create}, {"randrw", bench_randrw},
+    {"seqio", bench_seqio},   {"stat", bench_stat},
+    {"readdir", bench_readdir},
+};
+#define WORKLOAD_COUNT (sizeof(workloads) / sizeof(workloads[0]))
+
+int main(int argc, char *argv[]) {
+  long block_size = NUFS_DEFAULT_BLOCK_SIZE;
+  long size = 256L << 20;
+  long inode_count = 0;
+  const char *only = 0;
+  unsigned seed = 1;
+  bench_t b = {10000, 64L << 20, 16, 0, 0, 0, 0};
+
+  int opt;
+  while ((opt = getopt(argc, argv, "b:s:i:n:f:d:r:w:")) != -1) {
+    switch (opt) {
+    case 'b': block_size = parse_size(optarg); break;
+    case 's': size = parse_size(optarg); break;
+    case 'i': inode_count = parse_size(optarg); break;
+    case 'n': b.ops = parse_size(optarg); break;
+    case 'f': b.file_size = parse_size(optarg); break;
+    case 'd': b.depth = atoi(optarg); break;
+    case 'r': seed = atoi(optarg); break;
+    case 'w': only = optarg; break;
+    default: usage(argv[0]);
+    }
+  }
+  if (optind < argc - 1 || block_size <= 0 || size < block_size ||
+      b.ops <= 0 || b.file_size <= 0 || b.depth < 0) {
+    usage(argv[0]);
+  }
+  const char *image = optind < argc ? argv[optind] : "bench.nufs";
+
+  long block_count = size / block_size;
+  if (inode_count <= 0) {
+    inode_count = block_count / 4;
+  }
+  if (block_count > __INT_MAX__ || inode_count > __INT_MAX__ ||
+      blocks_format(image, block_size, block_count, inode_count,
+                    sizeof(inode_t), NUFS_DEFAULT_JOURNAL, 0) != 0) {
+    fprintf(stderr, "%s: cannot format %s\n", argv[0], image);
+    return 1;
+  }
+  storage_init(image);
+  storage_start();
+  srandom(seed);
+
+  printf("%s: %ld blocks of %ld bytes, %ld inodes\n", image, block_count,
+         block_size, inode_count);
+  printf("%-10s %9s %12s %10s %9s %9s %9s %9s %10s\n", "workload", "ops",
+         "ops/s", "MB/s", "avg_us", "p50_us", "p90_us", "p99_us", "max_us");
+  for (size_t ii = 0; ii < WORKLOAD_COUNT; ++ii) {
+    if (only == 0 || strstr(only, workloads[ii].name) != 0) {
+      workloads[ii].run(&b);
+    }
+  }
+
+  storage_free();
+  free(b.lat);
+  return 0;
+}
@@ -0,0 +1,93 @@
+// mkfs.nufs: format a nufs disk image with a chosen geometry.
+//
+// usage: mkfs.nufs [-b block_size] [-s size] [-i inode_count]
+//                  [-j journal_blocks] [-d] [-c] image
+//
+// The size accepts a K, M, G or T suffix. Without -i, one inode is
+// reserved for every four blocks. Without -j, the metadata journal takes
+// 1/32 of the image (at least 32 and at most 8192 blocks); -j 0 formats an
+// image without a journal. -d turns on block-level deduplication of file
+// data (see dedup.h), and -c compression of file data (see compress.h).
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "blocks.h"
+#include "inode.h"
+
+// Parse a byte count with an optional K/M/G/T suffix, returning -1 on error.
+static long parse_size(const char *text) {
+  char *end;
+  long value = strtol(text, &end, 10);
+  if (end == text || value <= 0) {
+    return -1;
+  }
+
+  switch (*end) {
+  case 'T': case 't': value <<= 10; // fall through
+  case 'G': case 'g': value <<= 10; // fall through
+  case 'M': case 'm': value <<= 10; // fall through
+  case 'K': case 'k': value <<= 10; end++; break;
+  case 0: break;
+  default: return -1;
+  }
+
+  return *end == 0 ? value : -1;
+}
+
+static void usage(const char *prog) {
+  fprintf(stderr, "usage: %s [-b block_size] [-s size] [-i inode_count] "
+                  "[-j journal_blocks] [-d] [-c] image\n", prog);
+  exit(1);
+}
+
+int main(int argc, char *argv[]) {
+  long block_size = NUFS_DEFAULT_BLOCK_SIZE;
+  long size = (long) NUFS_DEFAULT_BLOCK_SIZE * NUFS_DEFAULT_BLOCK_COUNT;
+  long inode_count = 0;
+  long journal_blocks = NUFS_DEFAULT_JOURNAL;
+  int features = 0;
+
+  int opt;
+  while ((opt = getopt(argc, argv, "b:s:i:j:dc")) != -1) {
+    switch (opt) {
+    case 'b': block_size = parse_size(optarg); break;
+    case 's': size = parse_size(optarg); break;
+    case 'i': inode_count = parse_size(optarg); break;
+    case 'j':
+      journal_blocks = strcmp(optarg, "0") == 0 ? 0 : parse_size(optarg);
+      if (journal_blocks < 0) {
+        usage(argv[0]);
+      }
+      break;
+    case 'd': features |= NUFS_FEATURE_DEDUP; break;
+    case 'c': features |= NUFS_FEATURE_COMPRESS; break;
+    default: usage(argv[0]);
+    }
+  }
+
+  if (optind != argc - 1 || block_size <= 0 || size < block_size) {
+    usage(argv[0]);
+  }
+
+  long block_count = size / block_size;
+  if (inode_count <= 0) {
+    inode_count = block_count / 4;
+  }
+
+  if (block_count > __INT_MAX__ || inode_count > __INT_MAX__ ||
+      journal_blocks > __INT_MAX__ ||
+      blocks_format(argv[optind], block_size, block_count, inode_count,
+                    sizeof(inode_t), journal_blocks, features) != 0) {
+    fprintf(stderr, "%s: cannot format %s with %ld blocks of %ld bytes and "
+                    "%ld inodes\n", argv[0], argv[optind], block_count,
+            block_size, inode_count);
+    return 1;
+  }
+
+  printf("%s: %ld blocks of %ld bytes, %ld inodes\n", argv[optind],
+         block_count, block_size, inode_count);
+  return 0;
+}
@@ -0,0 +1,103 @@
+// nufs-tracedump: print a binary trace written by nufs as text.
+//
+// usage: nufs-tracedump [-o op] [-t thread] [trace]
+//
+// Records from every thread are merged in time order, one per line:
+// microseconds since tracing started, thread, op, inode, offset, size and
+// result. -o and -t keep only the records of one op or one thread. The
+// trace defaults to nufs.trace.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "trace.h"
+
+static void usage(const char *prog) {
+  fprintf(stderr, "usage: %s [-o op] [-t thread] [trace]\n", prog);
+  exit(1);
+}
+
+static int by_tsc(const void *a, const void *b) {
+  const trace_record_t *ra = a;
+  const trace_record_t *rb = b;
+  return ra->tsc < rb->tsc ? -1 : ra->tsc > rb->tsc;
+}
+
+int main(int argc, char *argv[]) {
+  const char *op_name = 0;
+  int thread = -1;
+
+  int opt;
+  while ((opt = getopt(argc, argv, "o:t:")) != -1) {
+    switch (opt) {
+    case 'o': op_name = optarg; break;
+    case 't': thread = atoi(optarg); break;
+    default: usage(argv[0]);
+    }
+  }
+  if (optind + 1 < argc) {
+    usage(argv[0]);
+  }
+  const char *path = optind < argc ? argv[optind] : "nufs.trace";
+
+  int op = -1;
+  if (op_name != 0) {
+    for (int ii = 0; ii < TRACE_OP_COUNT; ++ii) {
+      if (strcmp(trace_op_name(ii), op_name) == 0) {
+        op = ii;
+      }
+    }
+    if (op < 0) {
+      fprintf(stderr, "%s: unknown op %s\n", argv[0], op_name);
+      return 1;
+    }
+  }
+
+  FILE *in = fopen(path, "r");
+  if (in == 0) {
+    perror(path);
+    return 1;
+  }
+
+  trace_file_header_t header;
+  if (fread(&header, sizeof(header), 1, in) != 1 ||
+      header.magic != TRACE_MAGIC || header.version != TRACE_VERSION) {
+    fprintf(stderr, "%s: not a nufs trace\n", path);
+    return 1;
+  }
+
+  trace_record_t *records = malloc(header.count * sizeof(trace_record_t));
+  if (records == 0 && header.count > 0) {
+    perror("malloc");
+    return 1;
+  }
+  size_t count = fread(records, sizeof(trace_record_t), header.count, in);
+  fclose(in);
+  if (count < header.count) {
+    fprintf(stderr, "%s: truncated after %zu of %lu records\n", path, count,
+            (unsigned long) header.count);
+  }
+
+  qsort(records, count, sizeof(trace_record_t), by_tsc);
+
+  double hz = header.tsc_hz > 0 ? header.tsc_hz : 1e9;
+  printf("%14s %4s %-12s %6s %20s %10s %8s\n", "usec", "thr", "op", "inum",
+         "offset", "size", "result");
+  for (size_t ii = 0; ii < count; ++ii) {
+    trace_record_t *rec = &records[ii];
+    if ((op >= 0 && rec->op != op) || (thread >= 0 && rec->thread != thread)) {
+      continue;
+    }
+
+    const char *name = trace_op_name(rec->op);
+    double usec = (double) (int64_t) (rec->tsc - header.tsc_start) / hz * 1e6;
+    printf("%14.3f %4u %-12s %6u %20lu %10u %8d\n", usec, rec->thread,
+           name != 0 ? name : "?", rec->inum, (unsigned long) rec->offset,
+           rec->size, rec->result);
+  }
+
+  free(records);
+  return 0;
+}
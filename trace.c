@@ -0,0 +1,229 @@
+/**
+ * @file trace.c
+ *
+ * Binary trace ring buffers.
+ */
+#include <assert.h>
+#include <limits.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#endif
+
+#include "trace.h"
+
+typedef struct trace_ring {
+  uint64_t head; // records ever written; only the owning thread writes it
+  int thread;
+  struct trace_ring *next;      // in trace_rings
+  struct trace_ring *next_free; // in trace_free, once its thread exited
+  trace_record_t records[TRACE_RING_RECORDS];
+} trace_ring_t;
+
+volatile int trace_level = TRACE_OFF;
+
+static const char *trace_path = "nufs.trace";
+static char trace_abs_path[PATH_MAX];
+static uint64_t trace_tsc_start;
+static struct timespec trace_time_start;
+
+// Every ring ever made, so that trace_dump() can find them. Rings are only
+// added; the lock is taken once per thread. The rings of threads that have
+// exited wait in trace_free for the next new thread, since FUSE keeps
+// starting and stopping worker threads.
+static pthread_mutex_t trace_rings_lock = PTHREAD_MUTEX_INITIALIZER;
+static trace_ring_t *trace_rings = 0;
+static trace_ring_t *trace_free = 0;
+static int trace_threads = 0;
+
+static __thread trace_ring_t *trace_ring = 0;
+static pthread_once_t trace_key_once = PTHREAD_ONCE_INIT;
+static pthread_key_t trace_key; // the calling thread's ring, to give back
+
+static const char *trace_op_names[TRACE_OP_COUNT] = {
+    [TRACE_OP_INIT] = "init",
+    [TRACE_OP_LOOKUP] = "lookup",
+    [TRACE_OP_ACCESS] = "access",
+    [TRACE_OP_GETATTR] = "getattr",
+    [TRACE_OP_SETATTR] = "setattr",
+    [TRACE_OP_READDIR] = "readdir",
+    [TRACE_OP_READDIRPLUS] = "readdirplus",
+    [TRACE_OP_MKNOD] = "mknod",
+    [TRACE_OP_MKDIR] = "mkdir",
+    [TRACE_OP_CREATE] = "create",
+    [TRACE_OP_UNLINK] = "unlink",
+    [TRACE_OP_LINK] = "link",
+    [TRACE_OP_RMDIR] = "rmdir",
+    [TRACE_OP_RENAME] = "rename",
+    [TRACE_OP_OPEN] = "open",
+    [TRACE_OP_READ] = "read",
+    [TRACE_OP_WRITE] = "write",
+    [TRACE_OP_FLUSH] = "flush",
+    [TRACE_OP_FSYNC] = "fsync",
+    [TRACE_OP_FSYNCDIR] = "fsyncdir",
+    [TRACE_OP_IOCTL] = "ioctl",
+    [TRACE_OP_LSEEK] = "lseek",
+    [TRACE_OP_FALLOCATE] = "fallocate",
+    [TRACE_OP_COPY_RANGE] = "copy_file_range",
+    [TRACE_OP_ALLOC_BLOCK] = "alloc_block",
+    [TRACE_OP_FREE_BLOCK] = "free_block",
+    [TRACE_OP_TREE_LOOKUP] = "tree_lookup",
+    [TRACE_OP_DIR_LOOKUP] = "dir_lookup",
+    [TRACE_OP_DIR_PUT] = "dir_put",
+    [TRACE_OP_DIR_DELETE] = "dir_delete",
+};
+
+// Read the time stamp counter, or a nanosecond clock where there is none.
+static uint64_t trace_clock() {
+#if defined(__x86_64__) || defined(__i386__)
+  return __rdtsc();
+#else
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t) ts.tv_sec * 1000000000 + ts.tv_nsec;
+#endif
+}
+
+// SIGUSR1: step to the next trace level, wrapping around to off.
+static void trace_signal(int sig) {
+  trace_level = trace_level >= TRACE_DEBUG ? TRACE_OFF : trace_level + 1;
+}
+
+// Read the trace level and file from the environment.
+void trace_init() {
+  const char *level = getenv("NUFS_TRACE");
+  if (level != 0) {
+    trace_level = atoi(level);
+  }
+  const char *path = getenv("NUFS_TRACE_FILE");
+  if (path != 0) {
+    trace_path = path;
+  }
+  // the file system runs in / once it daemonizes
+  char cwd[PATH_MAX];
+  if (trace_path[0] != '/' && getcwd(cwd, sizeof(cwd)) != 0 &&
+      snprintf(trace_abs_path, sizeof(trace_abs_path), "%s/%s", cwd,
+               trace_path) < (int) sizeof(trace_abs_path)) {
+    trace_path = trace_abs_path;
+  }
+
+  trace_tsc_start = trace_clock();
+  clock_gettime(CLOCK_MONOTONIC, &trace_time_start);
+
+  struct sigaction sa;
+  memset(&sa, 0, sizeof(sa));
+  sa.sa_handler = trace_signal;
+  sa.sa_flags = SA_RESTART;
+  sigemptyset(&sa.sa_mask);
+  sigaction(SIGUSR1, &sa, 0);
+}
+
+// Thread exit: give the thread's ring to the next new thread. Its records
+// stay in it until they are overwritten.
+static void trace_ring_exit(void *arg) {
+  trace_ring_t *ring = arg;
+  pthread_mutex_lock(&trace_rings_lock);
+  ring->next_free = trace_free;
+  trace_free = ring;
+  pthread_mutex_unlock(&trace_rings_lock);
+}
+
+static void trace_key_init() {
+  int rv = pthread_key_create(&trace_key, trace_ring_exit);
+  assert(rv == 0);
+}
+
+// Make the calling thread's ring, or take one whose thread exited.
+static trace_ring_t *trace_ring_new() {
+  pthread_once(&trace_key_once, trace_key_init);
+
+  pthread_mutex_lock(&trace_rings_lock);
+  trace_ring_t *ring = trace_free;
+  if (ring != 0) {
+    trace_free = ring->next_free;
+  }
+  pthread_mutex_unlock(&trace_rings_lock);
+
+  if (ring == 0) {
+    ring = calloc(1, sizeof(trace_ring_t));
+    assert(ring != 0);
+    pthread_mutex_lock(&trace_rings_lock);
+    ring->thread = trace_threads++;
+    ring->next = trace_rings;
+    trace_rings = ring;
+    pthread_mutex_unlock(&trace_rings_lock);
+  }
+  pthread_setspecific(trace_key, ring);
+  return ring;
+}
+
+// Append a record to the calling thread's ring.
+void trace_record(int op, long inum, long offset, long size, long result) {
+  trace_ring_t *ring = trace_ring;
+  if (ring == 0) {
+    ring = trace_ring = trace_ring_new();
+  }
+
+  trace_record_t *rec = &ring->records[ring->head % TRACE_RING_RECORDS];
+  rec->tsc = trace_clock();
+  rec->offset = offset;
+  rec->inum = inum;
+  rec->size = size;
+  rec->result = result;
+  rec->op = op;
+  rec->thread = ring->thread;
+  __atomic_store_n(&ring->head, ring->head + 1, __ATOMIC_RELEASE);
+}
+
+// Write every ring to the trace file.
+void trace_dump() {
+  trace_file_header_t header;
+  memset(&header, 0, sizeof(header));
+  header.magic = TRACE_MAGIC;
+  header.version = TRACE_VERSION;
+  header.tsc_start = trace_tsc_start;
+
+  for (trace_ring_t *ring = trace_rings; ring != 0; ring = ring->next) {
+    uint64_t head = __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE);
+    header.count += head < TRACE_RING_RECORDS ? head : TRACE_RING_RECORDS;
+  }
+  if (header.count == 0) {
+    return;
+  }
+
+  // calibrate the time stamp counter against the clock
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  uint64_t ticks = trace_clock() - trace_tsc_start;
+  double secs = (now.tv_sec - trace_time_start.tv_sec) +
+                (now.tv_nsec - trace_time_start.tv_nsec) / 1e9;
+  header.tsc_hz = secs > 0 ? ticks / secs : 1000000000;
+
+  FILE *out = fopen(trace_path, "w");
+  if (out == 0) {
+    perror(trace_path);
+    return;
+  }
+  fwrite(&header, sizeof(header), 1, out);
+  for (trace_ring_t *ring = trace_rings; ring != 0; ring = ring->next) {
+    uint64_t head = __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE);
+    uint64_t first = head < TRACE_RING_RECORDS ? 0 : head - TRACE_RING_RECORDS;
+    for (uint64_t ii = first; ii < head; ++ii) {
+      fwrite(&ring->records[ii % TRACE_RING_RECORDS], sizeof(trace_record_t),
+             1, out);
+    }
+  }
+  fclose(out);
+}
+
+// Return the name of a trace op.
+const char *trace_op_name(int op) {
+  return op >= 0 && op < TRACE_OP_COUNT ? trace_op_names[op] : 0;
+}
@@ -0,0 +1,136 @@
+/**
+ * @file trace.h
+ *
+ * Binary tracing of file system operations.
+ *
+ * Each thread appends fixed-size records to its own ring buffer, so
+ * tracing takes no locks and formats nothing. When a ring is full, the
+ * oldest records are overwritten. A thread's ring passes to the next new
+ * thread when it exits, so the number of rings is the most threads that
+ * ever traced at once. The rings are written to a trace file
+ * when the file system is unmounted, and tools/tracedump.c turns that file
+ * into text.
+ *
+ * Tracing is off unless the NUFS_TRACE environment variable sets a level
+ * (TRACE_OPS or TRACE_DEBUG); SIGUSR1 steps through the levels while
+ * mounted. The trace goes to NUFS_TRACE_FILE, or nufs.trace by default;
+ * a relative path is taken from the directory nufs was started in.
+ * Building with -DNUFS_NO_TRACE (make NO_TRACE=1) removes every TRACE()
+ * from the code.
+ */
+#ifndef TRACE_H
+#define TRACE_H
+
+#include <stdint.h>
+
+#define TRACE_MAGIC 0x4352544e // "NTRC"
+#define TRACE_VERSION 4
+#define TRACE_RING_RECORDS 16384 // per thread; a power of two
+
+// Trace levels: a record is kept if its level is at most the current one.
+#define TRACE_OFF 0
+#define TRACE_OPS 1   // FUSE requests
+#define TRACE_DEBUG 2 // allocator and directory internals as well
+
+typedef enum trace_op {
+  TRACE_OP_INIT,
+  TRACE_OP_LOOKUP,
+  TRACE_OP_ACCESS,
+  TRACE_OP_GETATTR,
+  TRACE_OP_SETATTR,
+  TRACE_OP_READDIR,
+  TRACE_OP_READDIRPLUS,
+  TRACE_OP_MKNOD,
+  TRACE_OP_MKDIR,
+  TRACE_OP_CREATE,
+  TRACE_OP_UNLINK,
+  TRACE_OP_LINK,
+  TRACE_OP_RMDIR,
+  TRACE_OP_RENAME,
+  TRACE_OP_OPEN,
+  TRACE_OP_READ,
+  TRACE_OP_WRITE,
+  TRACE_OP_FLUSH,
+  TRACE_OP_FSYNC,
+  TRACE_OP_FSYNCDIR,
+  TRACE_OP_IOCTL,
+  TRACE_OP_LSEEK,
+  TRACE_OP_FALLOCATE,
+  TRACE_OP_COPY_RANGE,
+  TRACE_OP_ALLOC_BLOCK,
+  TRACE_OP_FREE_BLOCK,
+  TRACE_OP_TREE_LOOKUP,
+  TRACE_OP_DIR_LOOKUP,
+  TRACE_OP_DIR_PUT,
+  TRACE_OP_DIR_DELETE,
+  TRACE_OP_COUNT
+} trace_op_t;
+
+/**
+ * One trace record. What inum, offset and size mean depends on the op;
+ * for the FUSE requests they are the request's arguments (the parent for
+ * requests that take a name, the mode or flags as size when there is no
+ * byte count).
+ */
+typedef struct trace_record {
+  uint64_t tsc;    // time stamp counter when the record was made
+  uint64_t offset;
+  uint32_t inum;
+  uint32_t size;
+  int32_t result;
+  uint16_t op;     // trace_op_t
+  uint16_t thread; // index of the thread's ring
+} trace_record_t;
+
+/**
+ * Header of a trace file, followed by count records in no particular order.
+ */
+typedef struct trace_file_header {
+  uint32_t magic;   // TRACE_MAGIC
+  uint32_t version; // TRACE_VERSION
+  uint64_t count;
+  uint64_t tsc_start; // time stamp counter when tracing started
+  uint64_t tsc_hz;    // time stamp counter ticks per second
+} trace_file_header_t;
+
+// The current trace level; see trace_init().
+extern volatile int trace_level;
+
+#ifdef NUFS_NO_TRACE
+#define TRACE(level, op, inum, offset, size, result) ((void) 0)
+#else
+#define TRACE(level, op, inum, offset, size, result)                           \
+  do {                                                                         \
+    if (__builtin_expect(trace_level >= (level), 0)) {                         \
+      trace_record((op), (inum), (offset), (size), (result));                  \
+    }                                                                          \
+  } while (0)
+#endif
+
+/**
+ * Read the trace level and file from the environment and install the
+ * SIGUSR1 handler.
+ */
+void trace_init();
+
+/**
+ * Append a record to the calling thread's ring. Use TRACE() instead, which
+ * skips the call unless tracing is on.
+ */
+void trace_record(int op, long inum, long offset, long size, long result);
+
+/**
+ * Write every ring to the trace file, if anything was traced.
+ *
+ * Must not run while other threads are still tracing.
+ */
+void trace_dump();
+
+/**
+ * Return the name of a trace op, or NULL for an unknown op.
+ *
+ * @param op A trace_op_t.
+ */
+const char *trace_op_name(int op);
+
+#endif